@@ -0,0 +1,51 @@
+#ifndef CBOR_ENCODER_H
+#define CBOR_ENCODER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+/**
+ * @brief Minimal CBOR (RFC 8949) writer for MQTT payloads
+ *
+ * Writes definite-length items straight into a caller supplied buffer. An
+ * item that does not fit marks the encoder as overflowed, which is reported
+ * once by cbor_encoder_finish(), so the encode calls need no error checks.
+ */
+struct cbor_encoder_t {
+    uint8_t *buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+};
+
+void cbor_encoder_init(struct cbor_encoder_t *encoder, void *buffer, size_t size);
+
+/**
+ * @brief Start a map, followed by exactly pairs key/value items
+ */
+void cbor_encode_map(struct cbor_encoder_t *encoder, size_t pairs);
+void cbor_encode_text(struct cbor_encoder_t *encoder, const char *text);
+void cbor_encode_int(struct cbor_encoder_t *encoder, int64_t value);
+
+/**
+ * @brief Encode a float, as half precision when that is lossless
+ */
+void cbor_encode_float(struct cbor_encoder_t *encoder, float value);
+
+/**
+ * @brief Get the encoded length
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the buffer was too small
+ */
+esp_err_t cbor_encoder_finish(struct cbor_encoder_t *encoder, size_t *length);
+
+#if CONFIG_HOMEPOST_MQTT_CBOR_BENCHMARK
+/**
+ * @brief Check the encoder by decoding its output and log cycles per encode against snprintf
+ */
+void cbor_encoder_run_benchmark(void);
+#endif
+
+#endif // CBOR_ENCODER_H
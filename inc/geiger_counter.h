@@ -1,8 +1,37 @@
 #ifndef GEIGER_COUNTER_H
 #define GEIGER_COUNTER_H
 
-#include "mqtt_connection.h"
+#include "sensor_registry.h"
 
-void geiger_counter_start(void);
+/**
+ * @brief Cumulative counts and their NVS writes
+ *
+ * flushes_per_day extrapolates the writes since boot to a day, it stays at
+ * or below flush_budget_per_day whatever the count rate.
+ */
+struct geiger_counter_dose_stats_t {
+    uint64_t counts;
+    float dose_usv;
+    uint64_t flushed_counts;
+    uint32_t flushes;
+    uint32_t flushes_per_day;
+    uint32_t flush_budget_per_day;
+    bool restored_from_rtc;
+};
+
+/**
+ * @brief Driver for sensor_registry_register()
+ *
+ * Its init() restores the cumulative counts and starts counting, it needs
+ * internal_storage_init() to have run.
+ */
+extern const struct sensor_driver_t geiger_counter_driver;
+
+/**
+ * @brief Change the counting period, the reported CPM stays per minute
+ */
+esp_err_t geiger_counter_set_period(uint32_t period_ms);
+
+void geiger_counter_get_dose_stats(struct geiger_counter_dose_stats_t *stats);
 
 #endif
\ No newline at end of file
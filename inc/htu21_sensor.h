@@ -1,8 +1,41 @@
 #ifndef HTU21_SENSOR_H
 #define HTU21_SENSOR_H
 
+#include <stdint.h>
 #include "esp_err.h"
+#include "sensor_registry.h"
 
-void htu21_sensor_start(void);
+/**
+ * @brief Counters of the measurement state machine
+ *
+ * Samples, failures and timings are kept by the sensor registry. bus_us,
+ * conversion_us and energy_uj are those of the last temperature plus
+ * humidity sample, energy_uj being the sensor's measuring current over the
+ * conversion waits. status_errors counts results that passed the CRC but
+ * whose status bits name the other measurement.
+ */
+struct htu21_sensor_stats_t {
+    uint32_t retries;
+    uint32_t i2c_errors;
+    uint32_t crc_errors;
+    uint32_t status_errors;
+    uint32_t bus_us;
+    uint32_t conversion_us;
+    uint32_t energy_uj;
+};
+
+/**
+ * @brief Driver for sensor_registry_register(), samples on the I2C bus
+ *
+ * Needs i2c_bus_init() to have run before sensor_registry_start().
+ */
+extern const struct sensor_driver_t htu21_sensor_driver;
+
+/**
+ * @brief Change the polling interval, takes effect immediately if the sensor is running
+ */
+esp_err_t htu21_sensor_set_period(uint32_t period_ms);
+
+void htu21_sensor_get_stats(struct htu21_sensor_stats_t *stats);
 
 #endif // HTU21_SENSOR_H
@@ -0,0 +1,125 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+#define I2C_BUS_MAX_DEVICES                     4
+
+/**
+ * @brief Device on the shared bus, handed out by i2c_bus_add_device()
+ */
+struct i2c_bus_device_t;
+
+/**
+ * @brief One transfer to a device: write, read, or write then read with a
+ *        repeated start
+ *
+ * A zero length skips that half. result is filled in by the bus worker.
+ */
+struct i2c_bus_transaction_t {
+    struct i2c_bus_device_t *device;
+    const uint8_t *write;
+    size_t write_len;
+    uint8_t *read;
+    size_t read_len;
+    esp_err_t result;
+};
+
+/**
+ * @brief Called on the bus worker task once every transaction of a request
+ *        has run, result being the first error or ESP_OK
+ *
+ * Keep it short and never wait on the bus from it, other drivers' requests
+ * queue behind it.
+ */
+typedef void (*i2c_bus_done_cb_t)(esp_err_t result, void *arg);
+
+/**
+ * @brief Counters and timings of one device
+ *
+ * Latency runs from submitting the request to the end of the transaction and
+ * includes waiting behind other devices, bus time is the transfer alone.
+ */
+struct i2c_bus_device_stats_t {
+    const char *name;
+    uint16_t address;
+    uint32_t transactions;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+    uint32_t bus_avg_us;
+    uint32_t bus_max_us;
+};
+
+/**
+ * @brief Counters of the bus worker
+ *
+ * A batch is the requests the worker ran back to back without waiting for
+ * the queue, batch_max the most in one.
+ */
+struct i2c_bus_stats_t {
+    uint32_t devices;
+    uint32_t requests;
+    uint32_t rejected;
+    uint32_t batches;
+    uint32_t batch_max;
+    uint32_t queue_high_water;
+};
+
+/**
+ * @brief Create the I2C master bus and start its worker task
+ *
+ * The bus is the only owner of the I2C port, drivers add their device and
+ * queue transactions to the worker, which runs them one after another.
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t i2c_bus_init(void);
+
+/**
+ * @brief Add a device with a 7-bit address and its own clock speed
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if the bus is not
+ *         initialized, ESP_ERR_NO_MEM if I2C_BUS_MAX_DEVICES are added
+ */
+esp_err_t i2c_bus_add_device(const char *name, uint16_t address, uint32_t scl_speed_hz, struct i2c_bus_device_t **device);
+
+/**
+ * @brief Queue transactions to run back to back, never blocks
+ *
+ * The transactions and the buffers they point to must stay valid until done
+ * is called. done may be NULL.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the request queue is full
+ */
+esp_err_t i2c_bus_submit(struct i2c_bus_transaction_t *transactions, size_t count, i2c_bus_done_cb_t done, void *arg);
+
+/**
+ * @brief Queue transactions and wait for them on the calling task
+ *
+ * Only the caller waits, other drivers keep using the bus meanwhile. Not
+ * allowed from a done callback or an esp_timer callback.
+ *
+ * @return ESP_OK on success, the first failed transaction's error otherwise
+ */
+esp_err_t i2c_bus_transfer(struct i2c_bus_transaction_t *transactions, size_t count);
+
+/**
+ * @brief i2c_bus_transfer() of a single write, read, or write then read
+ */
+esp_err_t i2c_bus_write_read(struct i2c_bus_device_t *device, const uint8_t *write, size_t write_len, uint8_t *read, size_t read_len);
+
+void i2c_bus_get_stats(struct i2c_bus_stats_t *stats);
+
+/**
+ * @brief Copy the statistics of the index-th added device
+ *
+ * @return false if there is no such device
+ */
+bool i2c_bus_get_device_stats(uint32_t index, struct i2c_bus_device_stats_t *stats);
+
+#endif // I2C_BUS_H
@@ -7,35 +7,94 @@
 #include "esp_log.h"
 #include "esp_err.h"
 
+/**
+ * @brief Initialize NVS and load the stored configuration into RAM
+ *
+ * WiFi credentials, the MQTT connection settings and the runtime settings
+ * live in one versioned, CRC checked blob that is read once here; the
+ * per-key layout of earlier firmware is migrated into it on first boot and,
+ * with CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS, kept up to date for a downgrade.
+ * The check and get functions below are memory reads after that, changes
+ * go through a transaction that rewrites the blob and then updates the
+ * cache. A get for a key that was never saved returns ESP_ERR_NVS_NOT_FOUND.
+ */
 void internal_storage_init(void);
 
+/**
+ * @brief Batch of configuration changes written with a single NVS commit
+ *
+ * internal_storage_begin() snapshots the cached configuration and blocks
+ * other writers, the internal_storage_set_*() calls stage changes on it and
+ * internal_storage_commit() writes the config blob once and frees the
+ * transaction. The blob is replaced as a whole, so a reset midway leaves
+ * either the old or the new configuration. Every begin must be followed by
+ * a commit. A setter given a value that does not fit fails the whole
+ * transaction, commit then writes nothing and returns the error.
+ */
+struct internal_storage_transaction_t;
+
+esp_err_t internal_storage_begin(struct internal_storage_transaction_t **transaction);
+esp_err_t internal_storage_commit(struct internal_storage_transaction_t *transaction);
+
 bool internal_storage_check_wifi_credentials_preserved(void);
-esp_err_t internal_storage_save_wifi_credentials(const char *ssid, const char *password);
+void internal_storage_set_wifi_credentials(struct internal_storage_transaction_t *transaction, const char *ssid, const char *password);
 esp_err_t internal_storage_get_wifi_credentials(char *ssid, char *password);
 esp_err_t internal_storage_erase_wifi_credentials(void);
 
-esp_err_t internal_storage_save_mqtt_client_id(const char *client_id);
+void internal_storage_set_mqtt_client_id(struct internal_storage_transaction_t *transaction, const char *client_id);
 esp_err_t internal_storage_get_mqtt_client_id(char *client_id);
 bool internal_storage_check_mqtt_client_id_preserved(void);
 
-esp_err_t internal_storage_save_mqtt_broker(const char *broker);
+void internal_storage_set_mqtt_broker(struct internal_storage_transaction_t *transaction, const char *broker);
 esp_err_t internal_storage_get_mqtt_broker(char *broker);
 bool internal_storage_check_mqtt_broker_preserved(void);
 
-esp_err_t internal_storage_save_mqtt_port(uint16_t port);
+void internal_storage_set_mqtt_port(struct internal_storage_transaction_t *transaction, uint16_t port);
 esp_err_t internal_storage_get_mqtt_port(uint16_t *port);
 bool internal_storage_check_mqtt_port_preserved(void);
 
-esp_err_t internal_storage_save_mqtt_username(const char *username);
+void internal_storage_set_mqtt_username(struct internal_storage_transaction_t *transaction, const char *username);
 esp_err_t internal_storage_get_mqtt_username(char *username);
 bool internal_storage_check_mqtt_username_preserved(void);
 
-esp_err_t internal_storage_save_mqtt_password(const char *password);
+void internal_storage_set_mqtt_password(struct internal_storage_transaction_t *transaction, const char *password);
 esp_err_t internal_storage_get_mqtt_password(char *password);
 bool internal_storage_check_mqtt_password_preserved(void);
 
-esp_err_t internal_storage_save_mqtt_topic(const char *topic);
+void internal_storage_set_mqtt_topic(struct internal_storage_transaction_t *transaction, const char *topic);
 esp_err_t internal_storage_get_mqtt_topic(char *topic);
 bool internal_storage_check_mqtt_topic_preserved(void);
 
+/**
+ * @brief Trusted CA certificate (PEM) for the TLS broker connection
+ *
+ * Saving an empty certificate erases it. internal_storage_get_mqtt_ca_cert()
+ * returns a NUL terminated heap copy the caller frees, or
+ * ESP_ERR_NVS_NOT_FOUND when no certificate is stored.
+ */
+esp_err_t internal_storage_save_mqtt_ca_cert(const char *cert);
+esp_err_t internal_storage_get_mqtt_ca_cert(char **cert, size_t *cert_len);
+
+/**
+ * @brief Cumulative Geiger counts, kept in their own key
+ *
+ * Stored apart from the config blob so the periodic flush only rewrites
+ * eight bytes. internal_storage_get_dose_counts() returns
+ * ESP_ERR_NVS_NOT_FOUND until the first save.
+ */
+esp_err_t internal_storage_save_dose_counts(uint64_t counts);
+esp_err_t internal_storage_get_dose_counts(uint64_t *counts);
+
+/**
+ * @brief Runtime settings changed over MQTT, kept in the config blob
+ *
+ * Keys are at most 15 characters and share a fixed number of slots, saving
+ * fails with ESP_ERR_NVS_NOT_ENOUGH_SPACE once they are taken.
+ * internal_storage_get_setting() returns ESP_ERR_NVS_NOT_FOUND when the
+ * setting was never changed and the Kconfig default applies.
+ */
+esp_err_t internal_storage_save_setting(const char *key, uint32_t value);
+esp_err_t internal_storage_get_setting(const char *key, uint32_t *value);
+esp_err_t internal_storage_erase_setting(const char *key);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef MQTT_BENCHMARK_H
+#define MQTT_BENCHMARK_H
+
+#include "mqtt_publish_queue.h"
+
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+/**
+ * @brief Start the publish path benchmark in its own task
+ *
+ * Once the broker is connected, synthetic producers enqueue QoS 1 messages
+ * on {topic}/benchmark at a fixed rate through the normal publish queue and
+ * loop. The result is logged: sustained acknowledged messages per second,
+ * enqueue failures, p50/p99 latency from enqueue to PUBACK and heap use.
+ */
+void mqtt_benchmark_start(void);
+
+/**
+ * @brief Record the enqueue to PUBACK latency of an acknowledged message
+ *
+ * Called by the publish loop for every PUBACK, ignores other topics.
+ */
+void mqtt_benchmark_record_ack(const struct mqtt_publish_queue_item_t *item);
+#endif
+
+#endif // MQTT_BENCHMARK_H
@@ -0,0 +1,34 @@
+#ifndef MQTT_COMMAND_H
+#define MQTT_COMMAND_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+#define MQTT_COMMAND_NAME_MAX_LEN                   24
+#define MQTT_COMMAND_VALUE_MAX_LEN                  16
+
+/**
+ * @brief Apply the settings saved by earlier commands
+ *
+ * Call once NVS is up and before the sensors and scanner start, so they
+ * come up with the stored values instead of the Kconfig defaults.
+ */
+void mqtt_command_load_settings(void);
+
+/**
+ * @brief Run a command received on {base topic}/cmd/{name}
+ *
+ * The value is a decimal number, ON/OFF for switches, or "default" to drop
+ * the stored value and go back to the Kconfig default. Applied values are
+ * saved to NVS and echoed to {base topic}/settings.
+ *
+ * @param name Command name, e.g. "htu21/period_ms"
+ * @param value NUL terminated payload
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown command,
+ *         ESP_ERR_INVALID_ARG for a value that does not parse or is out of range
+ */
+esp_err_t mqtt_command_dispatch(const char *name, const char *value);
+
+#endif // MQTT_COMMAND_H
@@ -14,8 +14,50 @@
 #include <freertos/semphr.h>
 #include <freertos/queue.h>
 #include <mqtt_client.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <sys/time.h>
+#include <math.h>
 
 #include "internal_storage.h"
+#include "mqtt_publish_queue.h"
+#include "mqtt_outbox.h"
+#include "cbor_encoder.h"
+#include "mqtt_command.h"
+#include "mqtt_tls.h"
+#include "mqtt_benchmark.h"
+
+// Appended to every sensor topic, tells subscribers how the payload is encoded
+#if CONFIG_HOMEPOST_MQTT_PAYLOAD_CBOR
+#define MQTT_CONNECTION_TOPIC_SUFFIX                        "/cbor"
+#else
+#define MQTT_CONNECTION_TOPIC_SUFFIX                        ""
+#endif
+
+#define MQTT_CONNECTION_TOPIC_MAX_LEN                       64
+
+/**
+ * @brief Topics published by the firmware, resolved through mqtt_connection_get_topic()
+ */
+enum mqtt_connection_topic_t {
+    MQTT_CONNECTION_TOPIC_VERSION = 0,
+    MQTT_CONNECTION_TOPIC_PHONE_PRESENT,
+    MQTT_CONNECTION_TOPIC_PHONE_RSSI,
+    MQTT_CONNECTION_TOPIC_TEMPERATURE,
+    MQTT_CONNECTION_TOPIC_HUMIDITY,
+    MQTT_CONNECTION_TOPIC_RADIATION,
+    MQTT_CONNECTION_TOPIC_DOSE,
+    MQTT_CONNECTION_TOPIC_TELEMETRY,
+    MQTT_CONNECTION_TOPIC_COMMAND,
+    MQTT_CONNECTION_TOPIC_SETTINGS,
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+    MQTT_CONNECTION_TOPIC_BENCHMARK,
+#endif
+#if CONFIG_HOMEPOST_SENSOR_MOCK
+    MQTT_CONNECTION_TOPIC_MOCK,
+#endif
+    MQTT_CONNECTION_TOPIC_COUNT
+};
 
 struct mqtt_connection_message_t {
     char *topic;
@@ -23,9 +65,138 @@ struct mqtt_connection_message_t {
     uint8_t qos;
 };
 
+struct mqtt_connection_stats_t {
+    uint32_t acked;
+    uint32_t publish_failures;
+    uint32_t timeouts;
+    uint32_t retries;
+    uint32_t dropped;
+    uint32_t inflight;
+    uint32_t inflight_high_water;
+    uint32_t batched_metrics;
+    uint32_t batch_frames;
+    uint32_t deadband_passed;
+    uint32_t deadband_suppressed;
+    uint32_t wire_messages;
+    uint32_t wire_bytes;
+    uint32_t alias_hits;
+    uint32_t reconnect_attempts;
+    uint32_t reconnects;
+    uint32_t reconnect_last_ms;
+    uint32_t reconnect_max_ms;
+    uint32_t reconnect_total_ms;
+};
+
+/**
+ * @brief Stop the connection task and wait for it to shut its client down
+ *
+ * Queued messages stay in the publish queue for the next start.
+ */
 void mqtt_connection_stop_task(void);
+
+/**
+ * @brief Start the connection task, or reconfigure the running one
+ *
+ * When the task is already running its client is rebuilt from the stored
+ * settings in place, the publish queue and its contents are kept.
+ */
 void mqtt_connection_start_task(void);
 esp_err_t mqtt_connection_put_publish_queue(struct mqtt_connection_message_t *msg);
+esp_err_t mqtt_connection_reserve_message(enum mqtt_publish_queue_lane_t lane, const char *topic, size_t payload_size, uint8_t qos, struct mqtt_publish_queue_reservation_t *reservation);
+esp_err_t mqtt_connection_commit_message(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len);
+esp_err_t mqtt_connection_commit_telemetry(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len);
+void mqtt_connection_abort_message(struct mqtt_publish_queue_reservation_t *reservation);
+
+/**
+ * @brief Publish one telemetry reading
+ *
+ * With CONFIG_HOMEPOST_MQTT_DEADBAND a reading too close to the last one
+ * sent on the topic is dropped and ESP_OK returned, unless the heartbeat
+ * interval has passed.
+ *
+ * In per-topic mode the reading is sent to topic as {"metric": value}, in
+ * JSON or CBOR depending on CONFIG_HOMEPOST_MQTT_PAYLOAD_CBOR. With
+ * CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH readings taken within the batch window
+ * are combined into one timestamped frame on {base topic}/telemetry instead.
+ *
+ * @param topic Per-topic mode topic ID
+ * @param metric Metric name, must be a string literal
+ * @param value Reading
+ * @param precision Number of decimals sent
+ */
+esp_err_t mqtt_connection_publish_metric(enum mqtt_connection_topic_t topic, const char *metric, float value, uint8_t precision);
+
+/**
+ * @brief Publish a state change such as {"state": "ON"}, always queued in order
+ */
+esp_err_t mqtt_connection_publish_state(enum mqtt_connection_topic_t topic, const char *key, const char *value);
+
+#if CONFIG_HOMEPOST_MQTT_COALESCE_TELEMETRY
+/**
+ * @brief Turn telemetry coalescing on (1) or off (0) at runtime
+ */
+esp_err_t mqtt_connection_set_coalesce(uint32_t enabled);
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+/**
+ * @brief Change the deadband of a telemetry topic
+ *
+ * A reading is published when it moves by more than absolute_milli / 1000
+ * or by more than relative_percent of the last value sent. A threshold of 0
+ * is not checked; with both at 0 every change is published.
+ */
+esp_err_t mqtt_connection_set_deadband_absolute(enum mqtt_connection_topic_t topic, uint32_t absolute_milli);
+esp_err_t mqtt_connection_set_deadband_relative(enum mqtt_connection_topic_t topic, uint32_t relative_percent);
+esp_err_t mqtt_connection_set_heartbeat(uint32_t heartbeat_s);
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+struct mqtt_connection_shaper_stats_t {
+    uint32_t rate;
+    uint32_t burst;
+    int32_t tokens;
+    bool throttled;
+    uint32_t throttled_ms;
+    uint32_t throttle_events;
+};
+
+/**
+ * @brief Change the byte rate of a lane's token bucket, 0 removes the limit
+ */
+esp_err_t mqtt_connection_set_shaper_rate(enum mqtt_publish_queue_lane_t lane, uint32_t rate);
+
+/**
+ * @brief Token bucket state of a lane, throttled_ms is the total time messages waited for tokens
+ */
+void mqtt_connection_get_shaper_stats(enum mqtt_publish_queue_lane_t lane, struct mqtt_connection_shaper_stats_t *stats);
+#endif
+
+/**
+ * @brief Check whether the client is connected to the broker right now
+ */
+bool mqtt_connection_is_connected(void);
+void mqtt_connection_get_queue_stats(enum mqtt_publish_queue_lane_t lane, struct mqtt_publish_queue_stats_t *stats);
+void mqtt_connection_get_stats(struct mqtt_connection_stats_t *stats);
+
+/**
+ * @brief MQTT protocol version in use, "5" or "3.1.1" after a fallback
+ */
+const char *mqtt_connection_get_protocol(void);
 esp_err_t mqtt_connection_get_base_topic(char *topic_out, size_t topic_out_size);
 
+/**
+ * @brief Resolve the base topic and build every topic string in one arena
+ *
+ * Called on start and on every reconfigure, so a base topic saved through
+ * /mqtt-setup takes effect when the client is rebuilt. Producers see
+ * either the old or the new table, never a partly built one.
+ */
+esp_err_t mqtt_connection_build_topics(void);
+
+/**
+ * @brief Get the full topic string for a topic ID, no NVS access or formatting
+ */
+const char *mqtt_connection_get_topic(enum mqtt_connection_topic_t topic);
+
 #endif
\ No newline at end of file
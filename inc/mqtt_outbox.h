@@ -0,0 +1,72 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+struct mqtt_outbox_stats_t {
+    bool available;
+    uint32_t segments;
+    uint32_t backlog;
+    uint32_t backlog_high_water;
+    uint32_t written;
+    uint32_t drained;
+    uint32_t consumed;
+    uint32_t rate_limited;
+    uint32_t overwritten;
+    uint32_t erases;
+    uint32_t max_segment_erases;
+};
+
+/**
+ * @brief Mount the outbox partition and rebuild the backlog from flash
+ *
+ * Only the MQTT connection task may call the other outbox functions,
+ * except mqtt_outbox_get_backlog() and mqtt_outbox_get_stats().
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the partition is missing
+ */
+esp_err_t mqtt_outbox_init(void);
+
+bool mqtt_outbox_is_available(void);
+
+/**
+ * @brief Check whether the flash write budget allows another append right now
+ */
+bool mqtt_outbox_has_write_budget(void);
+
+/**
+ * @brief Append one message to the outbox
+ *
+ * The message is loaded back into the same publish queue lane.
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE when the flash write budget is used up
+ */
+esp_err_t mqtt_outbox_append(uint8_t lane, const char *topic, const char *payload, size_t payload_len, uint8_t qos);
+
+/**
+ * @brief Move up to max_messages stored messages into the publish queue
+ *
+ * Loaded messages are tagged with their flash location and stay in the
+ * outbox until mqtt_outbox_consume() is called with that tag.
+ *
+ * @return Number of messages loaded
+ */
+uint32_t mqtt_outbox_drain(uint32_t max_messages);
+
+/**
+ * @brief Mark a drained message as delivered
+ */
+void mqtt_outbox_consume(uint32_t tag);
+
+/**
+ * @brief Forget that a drained message was loaded so it is drained again later
+ */
+void mqtt_outbox_requeue(uint32_t tag);
+
+uint32_t mqtt_outbox_get_backlog(void);
+void mqtt_outbox_get_stats(struct mqtt_outbox_stats_t *stats);
+
+#endif // MQTT_OUTBOX_H
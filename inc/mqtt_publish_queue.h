@@ -0,0 +1,168 @@
+#ifndef MQTT_PUBLISH_QUEUE_H
+#define MQTT_PUBLISH_QUEUE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+
+/**
+ * @brief Priority lanes, each one a separate ring buffer
+ *
+ * The publish loop takes events before telemetry, so a queue full of sensor
+ * readings never delays a presence change.
+ */
+enum mqtt_publish_queue_lane_t {
+    MQTT_PUBLISH_QUEUE_LANE_EVENT = 0,
+    MQTT_PUBLISH_QUEUE_LANE_TELEMETRY,
+    MQTT_PUBLISH_QUEUE_LANE_COUNT
+};
+
+#define MQTT_PUBLISH_QUEUE_LANE_BIT(lane)       (1U << (lane))
+#define MQTT_PUBLISH_QUEUE_ALL_LANES            (MQTT_PUBLISH_QUEUE_LANE_BIT(MQTT_PUBLISH_QUEUE_LANE_COUNT) - 1)
+
+/**
+ * @brief Space handed out to a producer by mqtt_publish_queue_reserve()
+ *
+ * The payload buffer lives inside the queue, so the producer formats the
+ * message in place. The tag is stored with the record and handed back with
+ * the item, 0 unless the producer sets it before committing. The queue stays
+ * locked for other producers until the reservation is committed or aborted,
+ * keep the work in between short.
+ */
+struct mqtt_publish_queue_reservation_t {
+    char *payload;
+    size_t payload_size;
+    uint32_t tag;
+    uint8_t lane;
+    void *record;
+};
+
+/**
+ * @brief Message handed to the publish loop by mqtt_publish_queue_peek()
+ *
+ * Topic and payload point into the queue storage and stay valid until the
+ * item is released.
+ */
+struct mqtt_publish_queue_item_t {
+    const char *topic;
+    const char *payload;
+    size_t payload_len;
+    uint8_t qos;
+    uint32_t tag;
+    uint8_t lane;
+    TickType_t enqueued_at;
+    void *record;
+};
+
+struct mqtt_publish_queue_stats_t {
+    size_t capacity;
+    size_t used;
+    size_t used_high_water;
+    uint32_t messages;
+    uint32_t messages_high_water;
+    uint32_t committed;
+    uint32_t coalesced;
+    uint32_t dropped;
+    uint32_t sent;
+    uint32_t latency_avg_ms;
+    uint32_t latency_max_ms;
+};
+
+/**
+ * @brief Create the queue lock and wakeup semaphore, safe to call more than once
+ */
+esp_err_t mqtt_publish_queue_init(void);
+
+/**
+ * @brief Reserve a record for one message and copy the topic into it
+ *
+ * @param lane Lane the message is queued in
+ * @param topic Topic string, copied into the record
+ * @param payload_size Payload buffer size requested, including the NUL terminator
+ * @param qos MQTT QoS the message is published with
+ * @param reservation Filled with the payload buffer on success
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the queue is full
+ */
+esp_err_t mqtt_publish_queue_reserve(enum mqtt_publish_queue_lane_t lane, const char *topic, size_t payload_size, uint8_t qos, struct mqtt_publish_queue_reservation_t *reservation);
+
+/**
+ * @brief Publish a reserved record, trimming unused payload space
+ *
+ * @param reservation Reservation returned by mqtt_publish_queue_reserve()
+ * @param payload_len Number of payload bytes written, must be below payload_size
+ */
+esp_err_t mqtt_publish_queue_commit(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len);
+
+/**
+ * @brief Publish a reserved record as the latest value of its topic
+ *
+ * If an older value for the same topic is still waiting for the publish
+ * loop it is replaced, in place when the new payload fits its record, so at
+ * most one value per topic is queued. Use for telemetry only, events need
+ * mqtt_publish_queue_commit() to keep every message.
+ */
+esp_err_t mqtt_publish_queue_commit_latest(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len);
+
+/**
+ * @brief Drop a reservation without publishing it
+ */
+void mqtt_publish_queue_abort(struct mqtt_publish_queue_reservation_t *reservation);
+
+/**
+ * @brief Take the next message to publish without removing it from the queue
+ *
+ * Returns the oldest event first. With CONFIG_HOMEPOST_MQTT_EVENT_LANE_WEIGHT
+ * above 0, one waiting telemetry message is let through after that many
+ * events in a row.
+ *
+ * @return ESP_OK if an item was returned, ESP_ERR_NOT_FOUND if all lanes are empty
+ */
+esp_err_t mqtt_publish_queue_peek(struct mqtt_publish_queue_item_t *item);
+
+/**
+ * @brief Like mqtt_publish_queue_peek(), limited to the lanes set in a mask of MQTT_PUBLISH_QUEUE_LANE_BIT()
+ */
+esp_err_t mqtt_publish_queue_peek_lanes(uint32_t lanes, struct mqtt_publish_queue_item_t *item);
+
+/**
+ * @brief Mask of MQTT_PUBLISH_QUEUE_LANE_BIT() for lanes with messages waiting to be peeked
+ */
+uint32_t mqtt_publish_queue_get_pending_lanes(void);
+
+/**
+ * @brief Count an item as handed to the MQTT client for the lane latency statistics
+ */
+void mqtt_publish_queue_mark_sent(const struct mqtt_publish_queue_item_t *item);
+
+/**
+ * @brief Free the storage of an item returned by mqtt_publish_queue_peek()
+ */
+void mqtt_publish_queue_release(struct mqtt_publish_queue_item_t *item);
+
+/**
+ * @brief Put an item returned by mqtt_publish_queue_peek() back, it is the next one peeked from its lane
+ */
+void mqtt_publish_queue_unpeek(struct mqtt_publish_queue_item_t *item);
+
+/**
+ * @brief Hand every peeked but unreleased item out again, used when the publish loop restarts
+ */
+void mqtt_publish_queue_rewind(void);
+
+/**
+ * @brief Block until a message is committed or the timeout expires
+ *
+ * @return true if woken up by a commit or mqtt_publish_queue_wake()
+ */
+bool mqtt_publish_queue_wait(TickType_t timeout);
+
+/**
+ * @brief Wake up a task blocked in mqtt_publish_queue_wait() without committing a message
+ */
+void mqtt_publish_queue_wake(void);
+
+void mqtt_publish_queue_get_stats(enum mqtt_publish_queue_lane_t lane, struct mqtt_publish_queue_stats_t *stats);
+
+#endif // MQTT_PUBLISH_QUEUE_H
@@ -0,0 +1,48 @@
+#ifndef MQTT_TLS_H
+#define MQTT_TLS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_transport.h>
+
+struct mqtt_tls_handshake_stats_t {
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t avg_ms;
+    uint32_t max_ms;
+    uint32_t heap_peak;
+    uint32_t heap_retained;
+};
+
+/**
+ * @brief Handshake statistics, split by whether a cached session was offered
+ *
+ * heap_peak is the most heap a handshake took at once, from the free heap
+ * before it to the lowest point during it, heap_retained the heap still
+ * held by the connection after it.
+ */
+struct mqtt_tls_stats_t {
+    struct mqtt_tls_handshake_stats_t full;
+    struct mqtt_tls_handshake_stats_t resumed;
+    uint32_t failures;
+    bool ca_from_storage;
+};
+
+/**
+ * @brief Create a TLS transport for the MQTT client
+ *
+ * The transport wraps esp-tls and keeps the TLS session of the last
+ * successful handshake in RAM, so a reconnect to the same broker can resume
+ * it instead of running a full handshake. The CA certificate stored through
+ * /mqtt-ca is trusted if present, otherwise the ESP-IDF certificate bundle.
+ * The MQTT client owns the transport and destroys it with the client.
+ *
+ * @return Transport handle, NULL if out of memory
+ */
+esp_transport_handle_t mqtt_tls_transport_create(void);
+
+void mqtt_tls_get_stats(struct mqtt_tls_stats_t *stats);
+
+#endif // MQTT_TLS_H
@@ -0,0 +1,102 @@
+#ifndef SENSOR_LOG_H
+#define SENSOR_LOG_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+enum sensor_log_channel_t {
+    SENSOR_LOG_CHANNEL_TEMPERATURE = 0,
+    SENSOR_LOG_CHANNEL_HUMIDITY,
+    SENSOR_LOG_CHANNEL_CPM,
+    SENSOR_LOG_CHANNEL_MAX,
+};
+
+/**
+ * @brief One logged reading, value in thousandths of the sensor unit
+ */
+struct sensor_log_sample_t {
+    uint32_t timestamp;
+    enum sensor_log_channel_t channel;
+    int32_t value_milli;
+};
+
+/**
+ * @brief Position of a range query, only changed by sensor_log_iterator_*()
+ */
+struct sensor_log_iterator_t {
+    uint32_t from;
+    uint32_t to;
+    uint32_t segment;
+    uint32_t sequence;
+    uint32_t offset;
+    uint32_t segments_left;
+    uint32_t timestamp;
+    int32_t values[SENSOR_LOG_CHANNEL_MAX];
+};
+
+/**
+ * @brief Counters and timings of the log
+ *
+ * append_max_us is the longest a sampling callback spent in
+ * sensor_log_append(). The write and erase timings are taken on the writer
+ * task and include waiting for readers of the partition.
+ */
+struct sensor_log_stats_t {
+    bool available;
+    uint32_t segments;
+    uint32_t oldest;
+    uint32_t newest;
+    uint32_t appended;
+    uint32_t dropped;
+    uint32_t written;
+    uint32_t erases;
+    uint32_t max_segment_erases;
+    uint32_t append_max_us;
+    uint32_t write_avg_us;
+    uint32_t write_max_us;
+    uint32_t erase_max_us;
+};
+
+/**
+ * @brief Mount the sensor log partition and start its writer task
+ *
+ * The partition is a ring of flash sectors written in turn, so every sector
+ * is erased equally often and the oldest history is overwritten first.
+ * Records are fixed size and store the time and value as deltas to the
+ * previous record of the sector.
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the partition is missing
+ */
+esp_err_t sensor_log_init(void);
+
+/**
+ * @brief Queue a reading for the log, never blocks
+ *
+ * Readings are stamped with the wall clock, they are skipped until SNTP has
+ * set it.
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if the log or the clock is
+ *         not available, ESP_ERR_NO_MEM if the writer is behind
+ */
+esp_err_t sensor_log_append(enum sensor_log_channel_t channel, float value);
+
+/**
+ * @brief Start a query for the readings from from to to (Unix time, inclusive)
+ */
+esp_err_t sensor_log_iterator_init(struct sensor_log_iterator_t *iterator, uint32_t from, uint32_t to);
+
+/**
+ * @brief Return the next reading of the range, oldest first
+ *
+ * A sector overwritten while the query runs is skipped.
+ *
+ * @return true if sample was filled, false at the end of the range
+ */
+bool sensor_log_iterator_next(struct sensor_log_iterator_t *iterator, struct sensor_log_sample_t *sample);
+
+const char *sensor_log_get_channel_name(enum sensor_log_channel_t channel);
+void sensor_log_get_stats(struct sensor_log_stats_t *stats);
+
+#endif // SENSOR_LOG_H
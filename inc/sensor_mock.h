@@ -0,0 +1,18 @@
+#ifndef SENSOR_MOCK_H
+#define SENSOR_MOCK_H
+
+#include "sensor_registry.h"
+
+#if CONFIG_HOMEPOST_SENSOR_MOCK
+/**
+ * @brief Synthetic sensor for sensor_registry_register()
+ *
+ * Reports a triangle wave between 0 and 100 and its sample number, waits
+ * CONFIG_HOMEPOST_SENSOR_MOCK_WAIT_MS between its two calls like a
+ * conversion and fails every CONFIG_HOMEPOST_SENSOR_MOCK_FAIL_EVERY-th
+ * sample.
+ */
+extern const struct sensor_driver_t sensor_mock_driver;
+#endif
+
+#endif // SENSOR_MOCK_H
@@ -0,0 +1,106 @@
+#ifndef SENSOR_REGISTRY_H
+#define SENSOR_REGISTRY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "mqtt_connection.h"
+#include "sensor_log.h"
+
+#define SENSOR_REGISTRY_MAX_SENSORS             6
+#define SENSOR_REGISTRY_MAX_METRICS             4
+
+// Metric topic of a value that is only logged, channel of one that is only published
+#define SENSOR_METRIC_NOT_PUBLISHED             MQTT_CONNECTION_TOPIC_COUNT
+#define SENSOR_METRIC_NOT_LOGGED                SENSOR_LOG_CHANNEL_MAX
+
+/**
+ * @brief One value a driver reports per sample
+ *
+ * name is the key of the MQTT payload {"name": value}.
+ */
+struct sensor_metric_t {
+    const char *name;
+    const char *unit;
+    uint8_t precision;
+    enum mqtt_connection_topic_t topic;
+    enum sensor_log_channel_t channel;
+};
+
+/**
+ * @brief Descriptor of a sensor driver, kept in flash
+ *
+ * init() is optional and runs once from sensor_registry_start(), a driver
+ * whose init() fails is not sampled.
+ *
+ * sample() runs on the scheduler task and fills one value per metric, NAN
+ * for a value it could not read. A driver that has to wait for the hardware
+ * sets *wait_us and returns ESP_ERR_NOT_FINISHED instead of sleeping; it is
+ * called again after that long and other sensors are sampled meanwhile. Any
+ * other error drops the sample.
+ */
+struct sensor_driver_t {
+    const char *name;
+    const struct sensor_metric_t *metrics;
+    size_t metric_count;
+    uint32_t period_ms;
+    esp_err_t (*init)(void);
+    esp_err_t (*sample)(float *values, uint32_t *wait_us);
+};
+
+/**
+ * @brief Scheduling counters of one sensor
+ *
+ * Lateness is the time from a sample's due time to the first sample() call,
+ * spent on other sensors or on other esp_timer callbacks. sample_max_us runs
+ * from that call to the last one including the waits, busy_max_us is the
+ * longest single sample() call and what it held up the other sensors.
+ * skipped counts periods that came due while the previous sample ran.
+ */
+struct sensor_registry_stats_t {
+    const char *name;
+    bool active;
+    uint32_t period_ms;
+    uint32_t samples;
+    uint32_t failures;
+    uint32_t skipped;
+    uint32_t lateness_avg_us;
+    uint32_t lateness_max_us;
+    uint32_t sample_max_us;
+    uint32_t busy_max_us;
+};
+
+/**
+ * @brief Add a driver to be sampled once the registry is started
+ *
+ * Registering does not touch the hardware, so drivers can be registered
+ * before the stored settings change their periods.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if SENSOR_REGISTRY_MAX_SENSORS
+ *         are registered, ESP_ERR_INVALID_STATE once the registry is started
+ */
+esp_err_t sensor_registry_register(const struct sensor_driver_t *driver);
+
+/**
+ * @brief Initialize the registered drivers and start the scheduler task
+ *
+ * One task and one esp_timer sample every sensor, whatever their number.
+ */
+esp_err_t sensor_registry_start(void);
+
+/**
+ * @brief Change a sensor's period, the next sample is due one new period from now
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the driver is not registered
+ */
+esp_err_t sensor_registry_set_period(const struct sensor_driver_t *driver, uint32_t period_ms);
+
+/**
+ * @brief Copy the counters of the index-th registered sensor
+ *
+ * @return false if there is no such sensor
+ */
+bool sensor_registry_get_stats(uint32_t index, struct sensor_registry_stats_t *stats);
+
+#endif // SENSOR_REGISTRY_H
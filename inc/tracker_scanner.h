@@ -12,4 +12,15 @@
 void tracker_scanner_start_task(void);
 void tracker_scanner_stop_task(void);
 
+/**
+ * @brief Change how long the tracker may stay unseen before it is reported absent
+ */
+esp_err_t tracker_scanner_set_timeout(uint32_t minutes);
+
+/**
+ * @brief Change the iBeacon major/minor the scanner looks for
+ */
+esp_err_t tracker_scanner_set_major(uint32_t major);
+esp_err_t tracker_scanner_set_minor(uint32_t minor);
+
 #endif // TRACKER_SCANNER_H
\ No newline at end of file
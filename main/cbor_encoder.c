@@ -0,0 +1,248 @@
+#include "cbor_encoder.h"
+#include <string.h>
+#include <esp_log.h>
+
+#if CONFIG_HOMEPOST_MQTT_CBOR_BENCHMARK
+#include <math.h>
+#include <esp_cpu.h>
+#endif
+
+#define CBOR_MAJOR_UNSIGNED                     0
+#define CBOR_MAJOR_NEGATIVE                     1
+#define CBOR_MAJOR_TEXT                         3
+#define CBOR_MAJOR_MAP                          5
+#define CBOR_MAJOR_SIMPLE                       7
+#define CBOR_ADDITIONAL_UINT8                   24
+#define CBOR_ADDITIONAL_UINT16                  25
+#define CBOR_ADDITIONAL_UINT32                  26
+#define CBOR_ADDITIONAL_UINT64                  27
+#define CBOR_ADDITIONAL_HALF                    25
+#define CBOR_ADDITIONAL_FLOAT                   26
+#define CBOR_BENCHMARK_ITERATIONS               1000
+
+static void cbor_encoder_put(struct cbor_encoder_t *encoder, const void *data, size_t length){
+    if (encoder->overflow || length > encoder->size - encoder->length) {
+        encoder->overflow = true;
+        return;
+    }
+
+    memcpy(encoder->buffer + encoder->length, data, length);
+    encoder->length += length;
+}
+
+static void cbor_encoder_put_head(struct cbor_encoder_t *encoder, uint8_t major, uint64_t argument){
+    uint8_t head[9];
+    size_t length;
+
+    // Arguments are big endian and use the shortest form that holds them
+    if (argument < CBOR_ADDITIONAL_UINT8) {
+        head[0] = (major << 5) | argument;
+        length = 1;
+    } else if (argument <= UINT8_MAX) {
+        head[0] = (major << 5) | CBOR_ADDITIONAL_UINT8;
+        head[1] = argument;
+        length = 2;
+    } else if (argument <= UINT16_MAX) {
+        head[0] = (major << 5) | CBOR_ADDITIONAL_UINT16;
+        head[1] = argument >> 8;
+        head[2] = argument;
+        length = 3;
+    } else if (argument <= UINT32_MAX) {
+        head[0] = (major << 5) | CBOR_ADDITIONAL_UINT32;
+        for (int i = 0; i < 4; i++) {
+            head[1 + i] = argument >> (24 - 8 * i);
+        }
+        length = 5;
+    } else {
+        head[0] = (major << 5) | CBOR_ADDITIONAL_UINT64;
+        for (int i = 0; i < 8; i++) {
+            head[1 + i] = argument >> (56 - 8 * i);
+        }
+        length = 9;
+    }
+
+    cbor_encoder_put(encoder, head, length);
+}
+
+/*
+ * Converts to IEEE 754 half precision if no bits are lost. Subnormal halves
+ * are left to float32, sensor readings never get that small.
+ */
+static bool cbor_float_to_half(float value, uint16_t *half){
+    uint32_t bits;
+    uint32_t sign;
+    int32_t exponent;
+    uint32_t mantissa;
+
+    memcpy(&bits, &value, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+    mantissa = bits & 0x7FFFFF;
+
+    if ((bits & 0x7FFFFFFF) == 0) {
+        *half = sign;
+        return true;
+    }
+    if (exponent <= 0 || exponent >= 31 || (mantissa & 0x1FFF) != 0) {
+        return false;
+    }
+
+    *half = sign | (exponent << 10) | (mantissa >> 13);
+    return true;
+}
+
+void cbor_encoder_init(struct cbor_encoder_t *encoder, void *buffer, size_t size){
+    encoder->buffer = buffer;
+    encoder->size = size;
+    encoder->length = 0;
+    encoder->overflow = false;
+}
+
+void cbor_encode_map(struct cbor_encoder_t *encoder, size_t pairs){
+    cbor_encoder_put_head(encoder, CBOR_MAJOR_MAP, pairs);
+}
+
+void cbor_encode_text(struct cbor_encoder_t *encoder, const char *text){
+    size_t length = strlen(text);
+
+    cbor_encoder_put_head(encoder, CBOR_MAJOR_TEXT, length);
+    cbor_encoder_put(encoder, text, length);
+}
+
+void cbor_encode_int(struct cbor_encoder_t *encoder, int64_t value){
+    if (value >= 0) {
+        cbor_encoder_put_head(encoder, CBOR_MAJOR_UNSIGNED, value);
+    } else {
+        cbor_encoder_put_head(encoder, CBOR_MAJOR_NEGATIVE, -1 - value);
+    }
+}
+
+void cbor_encode_float(struct cbor_encoder_t *encoder, float value){
+    uint8_t item[5];
+    uint16_t half;
+    uint32_t bits;
+
+    if (cbor_float_to_half(value, &half)) {
+        item[0] = (CBOR_MAJOR_SIMPLE << 5) | CBOR_ADDITIONAL_HALF;
+        item[1] = half >> 8;
+        item[2] = half;
+        cbor_encoder_put(encoder, item, 3);
+        return;
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    item[0] = (CBOR_MAJOR_SIMPLE << 5) | CBOR_ADDITIONAL_FLOAT;
+    for (int i = 0; i < 4; i++) {
+        item[1 + i] = bits >> (24 - 8 * i);
+    }
+    cbor_encoder_put(encoder, item, 5);
+}
+
+esp_err_t cbor_encoder_finish(struct cbor_encoder_t *encoder, size_t *length){
+    if (encoder->overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    *length = encoder->length;
+    return ESP_OK;
+}
+
+#if CONFIG_HOMEPOST_MQTT_CBOR_BENCHMARK
+static const char *TAG = __FILE__;
+
+/*
+ * Just enough of a decoder to read back {"name": number} maps written above.
+ */
+static bool cbor_benchmark_decode(const uint8_t *data, size_t length, char *name, size_t name_size, float *value){
+    size_t offset = 0;
+    size_t name_length;
+    uint32_t bits;
+    uint16_t half;
+
+    if (length < 2 || data[offset++] != ((CBOR_MAJOR_MAP << 5) | 1)) {
+        return false;
+    }
+    if ((data[offset] >> 5) != CBOR_MAJOR_TEXT || (data[offset] & 0x1F) >= CBOR_ADDITIONAL_UINT8) {
+        return false;
+    }
+    name_length = data[offset++] & 0x1F;
+    if (name_length >= name_size || offset + name_length >= length) {
+        return false;
+    }
+    memcpy(name, &data[offset], name_length);
+    name[name_length] = '\0';
+    offset += name_length;
+
+    switch (data[offset++]) {
+        case (CBOR_MAJOR_SIMPLE << 5) | CBOR_ADDITIONAL_HALF:
+            if (offset + 2 != length) {
+                return false;
+            }
+            half = (data[offset] << 8) | data[offset + 1];
+            *value = ldexpf((half & 0x3FF) | 0x400, ((half >> 10) & 0x1F) - 25) * ((half & 0x8000) ? -1.0f : 1.0f);
+            if ((half & 0x7FFF) == 0) {
+                *value = 0;
+            }
+            return true;
+        case (CBOR_MAJOR_SIMPLE << 5) | CBOR_ADDITIONAL_FLOAT:
+            if (offset + 4 != length) {
+                return false;
+            }
+            bits = ((uint32_t)data[offset] << 24) | ((uint32_t)data[offset + 1] << 16) | (data[offset + 2] << 8) | data[offset + 3];
+            memcpy(value, &bits, sizeof(*value));
+            return true;
+        default:
+            return false;
+    }
+}
+
+void cbor_encoder_run_benchmark(void){
+    static const float samples[] = { 0.0f, 21.5f, -12.25f, 40.03f, 0.117f, 65504.0f, 1.0e6f, -0.001f };
+    struct cbor_encoder_t encoder;
+    uint8_t buffer[32];
+    char text[32];
+    char name[16];
+    float decoded;
+    size_t length = 0;
+    uint32_t start;
+    uint32_t cbor_cycles = 0;
+    uint32_t snprintf_cycles = 0;
+    size_t cbor_bytes = 0;
+    size_t snprintf_bytes = 0;
+    uint32_t failures = 0;
+
+    for (int i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        cbor_encoder_init(&encoder, buffer, sizeof(buffer));
+        cbor_encode_map(&encoder, 1);
+        cbor_encode_text(&encoder, "temperature");
+        cbor_encode_float(&encoder, samples[i]);
+        if (cbor_encoder_finish(&encoder, &length) != ESP_OK ||
+            !cbor_benchmark_decode(buffer, length, name, sizeof(name), &decoded) ||
+            strcmp(name, "temperature") != 0 || decoded != samples[i]) {
+            ESP_LOGE(TAG, "CBOR round trip failed for %f", samples[i]);
+            failures++;
+        }
+    }
+
+    for (int i = 0; i < CBOR_BENCHMARK_ITERATIONS; i++) {
+        float value = samples[i % (sizeof(samples) / sizeof(samples[0]))];
+
+        start = esp_cpu_get_cycle_count();
+        cbor_encoder_init(&encoder, buffer, sizeof(buffer));
+        cbor_encode_map(&encoder, 1);
+        cbor_encode_text(&encoder, "temperature");
+        cbor_encode_float(&encoder, value);
+        cbor_encoder_finish(&encoder, &length);
+        cbor_cycles += esp_cpu_get_cycle_count() - start;
+        cbor_bytes += length;
+
+        start = esp_cpu_get_cycle_count();
+        snprintf_bytes += snprintf(text, sizeof(text), "{\"temperature\": %.2f}", value);
+        snprintf_cycles += esp_cpu_get_cycle_count() - start;
+    }
+
+    ESP_LOGI(TAG, "CBOR round trip: %lu failures", failures);
+    ESP_LOGI(TAG, "CBOR encode: %lu cycles, %u bytes per message", cbor_cycles / CBOR_BENCHMARK_ITERATIONS, cbor_bytes / CBOR_BENCHMARK_ITERATIONS);
+    ESP_LOGI(TAG, "snprintf encode: %lu cycles, %u bytes per message", snprintf_cycles / CBOR_BENCHMARK_ITERATIONS, snprintf_bytes / CBOR_BENCHMARK_ITERATIONS);
+}
+#endif
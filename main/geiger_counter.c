@@ -1,26 +1,46 @@
 #include "geiger_counter.h"
+#include "internal_storage.h"
 #include <driver/gpio.h>
 #include <esp_attr.h>
 #include <esp_timer.h>
+#include <esp_system.h>
 
 #define GPIO_CPM_PIN_SEL                                GPIO_NUM_4
 #define GPIO_CPM_INPUT_PIN                              (1ULL<<GPIO_CPM_PIN_SEL)
 #define GPIO_INTR_FLAG_DEFAULT                          (0)
 #define GEIGER_COUNTER_CONVERSION_FACTOR                ((CONFIG_HOMEPOST_GEIGER_COUNTER_CONVERSION_FACTOR) / 1000000.0f)
+#define GEIGER_COUNTER_DOSE_MAGIC                       0x45534F44
+#define GEIGER_COUNTER_DOSE_FLUSH_INTERVAL_US           (86400ULL * 1000000 / CONFIG_HOMEPOST_GEIGER_COUNTER_DOSE_WRITES_PER_DAY)
 
 static portMUX_TYPE gpio_spinlock = portMUX_INITIALIZER_UNLOCKED;
 
-static void geiger_counter_timer_cb(void *arg);
+static const char *TAG = __FILE__;
 
-static char radiation_payload[32];
-static char radiation_topic[100];
-static struct mqtt_connection_message_t radiation_message = {
-    .topic = radiation_topic,
-    .payload = radiation_payload,
-    .qos = 0
+enum geiger_counter_metric_t {
+    GEIGER_COUNTER_METRIC_CPM = 0,
+    GEIGER_COUNTER_METRIC_RADIATION,
+    GEIGER_COUNTER_METRIC_DOSE,
+    GEIGER_COUNTER_METRIC_COUNT,
 };
 
-static const char *TAG = __FILE__;
+// CPM only goes to the history, radiation and dose only to MQTT
+static const struct sensor_metric_t geiger_counter_metrics[GEIGER_COUNTER_METRIC_COUNT] = {
+    [GEIGER_COUNTER_METRIC_CPM]       = { "cpm",       "CPM",   0, SENSOR_METRIC_NOT_PUBLISHED,      SENSOR_LOG_CHANNEL_CPM },
+    [GEIGER_COUNTER_METRIC_RADIATION] = { "radiation", "uSv/h", 3, MQTT_CONNECTION_TOPIC_RADIATION, SENSOR_METRIC_NOT_LOGGED },
+    [GEIGER_COUNTER_METRIC_DOSE]      = { "dose",      "uSv",   3, MQTT_CONNECTION_TOPIC_DOSE,      SENSOR_METRIC_NOT_LOGGED },
+};
+
+static esp_err_t geiger_counter_init(void);
+static esp_err_t geiger_counter_sample(float *values, uint32_t *wait_us);
+
+const struct sensor_driver_t geiger_counter_driver = {
+    .name = "geiger",
+    .metrics = geiger_counter_metrics,
+    .metric_count = GEIGER_COUNTER_METRIC_COUNT,
+    .period_ms = CONFIG_HOMEPOST_GEIGER_COUNTER_TIMER_PERIOD_MS,
+    .init = geiger_counter_init,
+    .sample = geiger_counter_sample,
+};
 
 static gpio_config_t io_config = {
     .intr_type = GPIO_INTR_NEGEDGE,
@@ -30,17 +50,31 @@ static gpio_config_t io_config = {
     .pull_up_en = GPIO_PULLUP_DISABLE
 };
 
-static esp_timer_handle_t geiger_counter_timer;
-static const esp_timer_create_args_t geiger_counter_timer_args = {
-    .callback = &geiger_counter_timer_cb,
-};
-
 static uint32_t geiger_counts = 0;
+static int64_t geiger_counted_since = 0;
 
 static uint32_t cpm_history[CONFIG_HOMEPOST_GEIGER_COUNTER_CPM_HISTORY_DEPTH] = {0};
 static uint32_t cpm_index = 0;
 static bool cpm_history_full = false;
 
+/*
+ * Cumulative counts in RTC memory, which keeps its content across
+ * esp_restart(), panics and watchdog resets but not a power cycle. check
+ * holds the inverted counts, so a reset between the two stores or the
+ * random content after power on is not taken for a total.
+ */
+struct geiger_counter_dose_t {
+    uint32_t magic;
+    uint64_t counts;
+    uint64_t check;
+};
+
+static RTC_NOINIT_ATTR struct geiger_counter_dose_t dose;
+static uint64_t dose_flushed_counts = 0;
+static int64_t dose_flushed_at = 0;
+static uint32_t dose_flushes = 0;
+static bool dose_restored_from_rtc = false;
+
 static void IRAM_ATTR geiger_counter_gpio_isr_handler(void *arg) {
     gpio_num_t gpio_num = (gpio_num_t)arg;
     if (gpio_num != GPIO_CPM_PIN_SEL) {
@@ -50,20 +84,95 @@ static void IRAM_ATTR geiger_counter_gpio_isr_handler(void *arg) {
     geiger_counts++;
 }
 
-static void geiger_counter_timer_cb(void *arg)
+// Called with gpio_spinlock taken
+static void geiger_counter_dose_add(uint32_t counts){
+    dose.counts += counts;
+    dose.check = ~dose.counts;
+}
+
+/*
+ * Picks the larger of the RTC and NVS totals: RTC memory after a soft reset
+ * holds the counts since the last flush as well, after power on only NVS is
+ * left.
+ */
+static void geiger_counter_dose_restore(void){
+    uint64_t stored = 0;
+    esp_reset_reason_t reason = esp_reset_reason();
+    esp_err_t err;
+
+    err = internal_storage_get_dose_counts(&stored);
+    if(err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND){
+        ESP_LOGE(TAG, "Failed to read cumulative counts: %s", esp_err_to_name(err));
+    }
+
+    dose_restored_from_rtc = reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT &&
+                             dose.magic == GEIGER_COUNTER_DOSE_MAGIC && dose.check == ~dose.counts &&
+                             dose.counts >= stored;
+    if(!dose_restored_from_rtc){
+        dose.magic = GEIGER_COUNTER_DOSE_MAGIC;
+        dose.counts = stored;
+        dose.check = ~stored;
+    }
+
+    dose_flushed_counts = stored;
+    dose_flushed_at = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Cumulative counts %llu restored from %s", dose.counts, dose_restored_from_rtc ? "RTC memory" : "NVS");
+}
+
+/*
+ * Writes at most once per flush interval whatever the count rate, all counts
+ * since the last write go into one NVS write.
+ */
+static void geiger_counter_dose_flush(void){
+    int64_t now = esp_timer_get_time();
+    esp_err_t err;
+
+    if(dose.counts == dose_flushed_counts || now - dose_flushed_at < GEIGER_COUNTER_DOSE_FLUSH_INTERVAL_US){
+        return;
+    }
+
+    // A failed write is retried only after the next interval, the budget holds either way
+    dose_flushed_at = now;
+    err = internal_storage_save_dose_counts(dose.counts);
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "Failed to store cumulative counts: %s", esp_err_to_name(err));
+        return;
+    }
+
+    dose_flushed_counts = dose.counts;
+    dose_flushes++;
+}
+
+static float geiger_counter_dose_usv(uint64_t counts){
+    // Counts over a minute are the CPM the factor is given for, a minute is 1/60 h
+    return (double)counts * GEIGER_COUNTER_CONVERSION_FACTOR / 60.0;
+}
+
+/*
+ * The CPM is scaled from the time since the previous sample, so a period
+ * changed at runtime or a late sample does not skew it.
+ */
+static esp_err_t geiger_counter_sample(float *values, uint32_t *wait_us)
 {
+    uint32_t counts;
     uint32_t cpm = 0;
     uint32_t cpm_sum = 0;
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_ms = (now - geiger_counted_since) / 1000;
     float average_cpm = 0;
-    float average_usvh = 0;
-    int ret;
 
     taskENTER_CRITICAL(&gpio_spinlock);
-    cpm = geiger_counts;
+    counts = geiger_counts;
     geiger_counts = 0;
+    geiger_counter_dose_add(counts);
     taskEXIT_CRITICAL(&gpio_spinlock);
+    geiger_counted_since = now;
 
-    ESP_LOGI(TAG, "Latest CPM: %lu", cpm);
+    if(elapsed_ms <= 0){
+        return ESP_ERR_INVALID_STATE;
+    }
+    cpm = (uint64_t)counts * 60000 / elapsed_ms;
 
     cpm_history[cpm_index] = cpm;
     cpm_index = (cpm_index + 1) % CONFIG_HOMEPOST_GEIGER_COUNTER_CPM_HISTORY_DEPTH;
@@ -74,35 +183,45 @@ static void geiger_counter_timer_cb(void *arg)
     }
 
     average_cpm = (float)cpm_sum / (float)(cpm_history_full ? CONFIG_HOMEPOST_GEIGER_COUNTER_CPM_HISTORY_DEPTH : cpm_index);
-    average_usvh = average_cpm * GEIGER_COUNTER_CONVERSION_FACTOR;
 
-    ESP_LOGI(TAG, "Average CPM: %f, Average uSv/h: %f", average_cpm, average_usvh);
+    geiger_counter_dose_flush();
 
-    memset(radiation_payload, 0, sizeof(radiation_payload));
-    ret = snprintf(radiation_payload, sizeof(radiation_payload), "{\"radiation\": %.3f}", average_usvh);
-    if (ret < 0 || ret >= sizeof(radiation_payload)) {
-        ESP_LOGE(TAG, "Failed to create radiation payload");
-        return;
-    }
+    values[GEIGER_COUNTER_METRIC_CPM] = cpm;
+    values[GEIGER_COUNTER_METRIC_RADIATION] = average_cpm * GEIGER_COUNTER_CONVERSION_FACTOR;
+    values[GEIGER_COUNTER_METRIC_DOSE] = geiger_counter_dose_usv(dose.counts);
 
-    if(mqtt_connection_put_publish_queue(&radiation_message) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to enqueue radiation message");
-    }
+    return ESP_OK;
 }
 
-void geiger_counter_start(void){
-    // Build MQTT topic from base topic
-    char base_topic[64];
-    if (mqtt_connection_get_base_topic(base_topic, sizeof(base_topic)) == ESP_OK) {
-        snprintf(radiation_topic, sizeof(radiation_topic), "%s/radiation", base_topic);
-    } else {
-        ESP_LOGE(TAG, "Failed to get base topic, using default");
-        snprintf(radiation_topic, sizeof(radiation_topic), "%s/radiation", CONFIG_HOMEPOST_MQTT_TOPIC);
+static esp_err_t geiger_counter_init(void){
+    esp_err_t err;
+
+    geiger_counter_dose_restore();
+
+    err = gpio_config(&io_config);
+    if(err == ESP_OK){
+        err = gpio_install_isr_service(GPIO_INTR_FLAG_DEFAULT);
+    }
+    if(err == ESP_OK){
+        err = gpio_isr_handler_add(GPIO_CPM_PIN_SEL, geiger_counter_gpio_isr_handler, (void *)GPIO_CPM_PIN_SEL);
     }
+    geiger_counted_since = esp_timer_get_time();
 
-    ESP_ERROR_CHECK(gpio_config(&io_config));
-    ESP_ERROR_CHECK(gpio_install_isr_service(GPIO_INTR_FLAG_DEFAULT));
-    ESP_ERROR_CHECK(gpio_isr_handler_add(GPIO_CPM_PIN_SEL, geiger_counter_gpio_isr_handler, (void *)GPIO_CPM_PIN_SEL));
-    ESP_ERROR_CHECK(esp_timer_create(&geiger_counter_timer_args, &geiger_counter_timer));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(geiger_counter_timer, CONFIG_HOMEPOST_GEIGER_COUNTER_TIMER_PERIOD_MS * 1000));
-}
\ No newline at end of file
+    return err;
+}
+
+esp_err_t geiger_counter_set_period(uint32_t period_ms){
+    return sensor_registry_set_period(&geiger_counter_driver, period_ms);
+}
+
+void geiger_counter_get_dose_stats(struct geiger_counter_dose_stats_t *stats){
+    int64_t uptime_s = esp_timer_get_time() / 1000000;
+
+    stats->counts = dose.counts;
+    stats->dose_usv = geiger_counter_dose_usv(dose.counts);
+    stats->flushed_counts = dose_flushed_counts;
+    stats->flushes = dose_flushes;
+    stats->flushes_per_day = uptime_s > 0 ? (uint64_t)dose_flushes * 86400 / uptime_s : 0;
+    stats->flush_budget_per_day = CONFIG_HOMEPOST_GEIGER_COUNTER_DOSE_WRITES_PER_DAY;
+    stats->restored_from_rtc = dose_restored_from_rtc;
+}
@@ -4,6 +4,18 @@
 #include "ota_update.h"
 #endif
 
+#if CONFIG_HOMEPOST_SENSOR_LOG_ENABLED
+#include "sensor_log.h"
+#endif
+
+#include "geiger_counter.h"
+#include "htu21_sensor.h"
+#include "i2c_bus.h"
+#include "sensor_registry.h"
+
+// Room for every optional endpoint, the default of 8 is already used up with TLS and OTA
+#define HTTP_SERVER_MAX_URI_HANDLERS 16
+
 static const char *TAG = __FILE__;
 static httpd_handle_t server = NULL;
 static esp_timer_handle_t restart_timer;
@@ -31,6 +43,8 @@ static void http_server_restart_timer_callback(void *arg)
 }
 
 #define PASSWORD_PLACEHOLDER "********"
+// NVS strings are limited to 4000 bytes including the NUL
+#define MQTT_CA_CERT_MAX_LEN 4000
 
 static esp_err_t config_get_handler(httpd_req_t *req)
 {
@@ -88,6 +102,7 @@ static esp_err_t config_get_handler(httpd_req_t *req)
 static esp_err_t configure_mqtt_post_handler(httpd_req_t *req)
 {
     char buff[250];
+    struct internal_storage_transaction_t *transaction;
     int ret, remaining = req->content_len;
     if (remaining >= sizeof(buff)) {
         // Respond with 500 Internal Server Error
@@ -156,14 +171,22 @@ static esp_err_t configure_mqtt_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    ESP_ERROR_CHECK(internal_storage_save_mqtt_broker(mqtt_server));
-    ESP_ERROR_CHECK(internal_storage_save_mqtt_port(atoi(mqtt_port)));
-    ESP_ERROR_CHECK(internal_storage_save_mqtt_client_id(mqtt_client_id));
-    ESP_ERROR_CHECK(internal_storage_save_mqtt_username(mqtt_user));
+    if (internal_storage_begin(&transaction) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    internal_storage_set_mqtt_broker(transaction, mqtt_server);
+    internal_storage_set_mqtt_port(transaction, atoi(mqtt_port));
+    internal_storage_set_mqtt_client_id(transaction, mqtt_client_id);
+    internal_storage_set_mqtt_username(transaction, mqtt_user);
     if (strcmp(mqtt_password, PASSWORD_PLACEHOLDER) != 0) {
-        ESP_ERROR_CHECK(internal_storage_save_mqtt_password(mqtt_password));
+        internal_storage_set_mqtt_password(transaction, mqtt_password);
+    }
+    internal_storage_set_mqtt_topic(transaction, mqtt_topic);
+    if (internal_storage_commit(transaction) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save MQTT configuration");
+        return ESP_FAIL;
     }
-    ESP_ERROR_CHECK(internal_storage_save_mqtt_topic(mqtt_topic));
 
     mqtt_connection_start_task();
     ESP_LOGI(TAG, "MQTT connection started successfully");
@@ -174,6 +197,7 @@ static esp_err_t configure_mqtt_post_handler(httpd_req_t *req)
 static esp_err_t configure_wifi_post_handler(httpd_req_t *req)
 {
     char buf[100];
+    struct internal_storage_transaction_t *transaction;
     int ret, remaining = req->content_len;
     if (remaining >= sizeof(buf)) {
         // Respond with 500 Internal Server Error
@@ -217,14 +241,22 @@ static esp_err_t configure_wifi_post_handler(httpd_req_t *req)
 
     ESP_LOGI(TAG, "SSID: %s", ssid);
 
+    if (internal_storage_begin(&transaction) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
     if (strcmp(password, PASSWORD_PLACEHOLDER) == 0 && internal_storage_check_wifi_credentials_preserved()) {
         // Password unchanged, retrieve existing password and re-save with new SSID
         char existing_ssid[33] = {0};
         char existing_password[65] = {0};
         ESP_ERROR_CHECK(internal_storage_get_wifi_credentials(existing_ssid, existing_password));
-        ESP_ERROR_CHECK(internal_storage_save_wifi_credentials(ssid, existing_password));
+        internal_storage_set_wifi_credentials(transaction, ssid, existing_password);
     } else {
-        ESP_ERROR_CHECK(internal_storage_save_wifi_credentials(ssid, password));
+        internal_storage_set_wifi_credentials(transaction, ssid, password);
+    }
+    if (internal_storage_commit(transaction) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save WiFi credentials");
+        return ESP_FAIL;
     }
     if(wifi_connect_sta(true)){
         ESP_LOGI(TAG, "WiFi connection succeeded");
@@ -248,6 +280,121 @@ static esp_err_t configure_wifi_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static void mqtt_stats_format_lane(char *buffer, size_t size, enum mqtt_publish_queue_lane_t lane)
+{
+    struct mqtt_publish_queue_stats_t queue_stats;
+    char shaper[160];
+
+    mqtt_connection_get_queue_stats(lane, &queue_stats);
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+    struct mqtt_connection_shaper_stats_t shaper_stats;
+
+    mqtt_connection_get_shaper_stats(lane, &shaper_stats);
+    snprintf(shaper, sizeof(shaper),
+        "{\"rate\":%lu,\"burst\":%lu,\"tokens\":%ld,\"throttled\":%s,"
+        "\"throttled_ms\":%lu,\"throttle_events\":%lu}",
+        (unsigned long)shaper_stats.rate, (unsigned long)shaper_stats.burst, (long)shaper_stats.tokens,
+        shaper_stats.throttled ? "true" : "false",
+        (unsigned long)shaper_stats.throttled_ms, (unsigned long)shaper_stats.throttle_events);
+#else
+    strcpy(shaper, "null");
+#endif
+
+    snprintf(buffer, size,
+        "{\"capacity\":%u,\"used\":%u,\"used_high_water\":%u,"
+        "\"messages\":%lu,\"messages_high_water\":%lu,"
+        "\"committed\":%lu,\"coalesced\":%lu,\"dropped\":%lu,"
+        "\"sent\":%lu,\"latency_avg_ms\":%lu,\"latency_max_ms\":%lu,\"shaper\":%s}",
+        (unsigned)queue_stats.capacity, (unsigned)queue_stats.used, (unsigned)queue_stats.used_high_water,
+        (unsigned long)queue_stats.messages, (unsigned long)queue_stats.messages_high_water,
+        (unsigned long)queue_stats.committed, (unsigned long)queue_stats.coalesced, (unsigned long)queue_stats.dropped,
+        (unsigned long)queue_stats.sent, (unsigned long)queue_stats.latency_avg_ms, (unsigned long)queue_stats.latency_max_ms,
+        shaper);
+}
+
+#if CONFIG_HOMEPOST_MQTT_TLS
+static void mqtt_stats_format_handshakes(char *buffer, size_t size, const struct mqtt_tls_handshake_stats_t *handshake_stats)
+{
+    snprintf(buffer, size,
+        "{\"count\":%lu,\"last_ms\":%lu,\"avg_ms\":%lu,\"max_ms\":%lu,"
+        "\"heap_peak\":%lu,\"heap_retained\":%lu}",
+        (unsigned long)handshake_stats->count, (unsigned long)handshake_stats->last_ms,
+        (unsigned long)handshake_stats->avg_ms, (unsigned long)handshake_stats->max_ms,
+        (unsigned long)handshake_stats->heap_peak, (unsigned long)handshake_stats->heap_retained);
+}
+
+static void mqtt_stats_format_tls(char *buffer, size_t size)
+{
+    struct mqtt_tls_stats_t tls_stats;
+    char full[160];
+    char resumed[160];
+
+    mqtt_tls_get_stats(&tls_stats);
+    mqtt_stats_format_handshakes(full, sizeof(full), &tls_stats.full);
+    mqtt_stats_format_handshakes(resumed, sizeof(resumed), &tls_stats.resumed);
+
+    snprintf(buffer, size,
+        "{\"ca\":\"%s\",\"failures\":%lu,\"full\":%s,\"resumed\":%s}",
+        tls_stats.ca_from_storage ? "storage" : "bundle", (unsigned long)tls_stats.failures, full, resumed);
+}
+#endif
+
+static esp_err_t mqtt_stats_get_handler(httpd_req_t *req)
+{
+    // Too big for the httpd task stack, handlers run one at a time on that task
+    static char response[2560];
+    char event_stats[448];
+    char telemetry_stats[448];
+    char tls_stats[384];
+    struct mqtt_connection_stats_t connection_stats;
+    struct mqtt_outbox_stats_t outbox_stats;
+
+    mqtt_stats_format_lane(event_stats, sizeof(event_stats), MQTT_PUBLISH_QUEUE_LANE_EVENT);
+    mqtt_stats_format_lane(telemetry_stats, sizeof(telemetry_stats), MQTT_PUBLISH_QUEUE_LANE_TELEMETRY);
+#if CONFIG_HOMEPOST_MQTT_TLS
+    mqtt_stats_format_tls(tls_stats, sizeof(tls_stats));
+#else
+    strcpy(tls_stats, "null");
+#endif
+    mqtt_connection_get_stats(&connection_stats);
+    mqtt_outbox_get_stats(&outbox_stats);
+
+    snprintf(response, sizeof(response),
+        "{\"queue\":{\"event\":%s,\"telemetry\":%s},\"tls\":%s,"
+        "\"inflight\":%lu,\"inflight_high_water\":%lu,\"inflight_window\":%d,"
+        "\"acked\":%lu,\"publish_failures\":%lu,\"timeouts\":%lu,"
+        "\"retries\":%lu,\"unacked_dropped\":%lu,"
+        "\"batched_metrics\":%lu,\"batch_frames\":%lu,\"batch_packets_saved\":%lu,"
+        "\"deadband_passed\":%lu,\"deadband_suppressed\":%lu,"
+        "\"protocol\":\"%s\",\"wire_messages\":%lu,\"wire_bytes\":%lu,\"wire_bytes_per_message\":%lu,\"alias_hits\":%lu,"
+        "\"reconnect_attempts\":%lu,\"reconnects\":%lu,\"reconnect_last_ms\":%lu,\"reconnect_max_ms\":%lu,\"reconnect_avg_ms\":%lu,"
+        "\"outbox_available\":%s,\"outbox_segments\":%lu,\"outbox_backlog\":%lu,"
+        "\"outbox_backlog_high_water\":%lu,\"outbox_written\":%lu,\"outbox_drained\":%lu,"
+        "\"outbox_consumed\":%lu,\"outbox_rate_limited\":%lu,\"outbox_overwritten\":%lu,"
+        "\"outbox_erases\":%lu,\"outbox_max_segment_erases\":%lu}",
+        event_stats, telemetry_stats, tls_stats,
+        (unsigned long)connection_stats.inflight, (unsigned long)connection_stats.inflight_high_water, CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW,
+        (unsigned long)connection_stats.acked, (unsigned long)connection_stats.publish_failures, (unsigned long)connection_stats.timeouts,
+        (unsigned long)connection_stats.retries, (unsigned long)connection_stats.dropped,
+        (unsigned long)connection_stats.batched_metrics, (unsigned long)connection_stats.batch_frames,
+        (unsigned long)(connection_stats.batched_metrics - connection_stats.batch_frames),
+        (unsigned long)connection_stats.deadband_passed, (unsigned long)connection_stats.deadband_suppressed,
+        mqtt_connection_get_protocol(), (unsigned long)connection_stats.wire_messages, (unsigned long)connection_stats.wire_bytes,
+        (unsigned long)(connection_stats.wire_messages > 0 ? connection_stats.wire_bytes / connection_stats.wire_messages : 0),
+        (unsigned long)connection_stats.alias_hits,
+        (unsigned long)connection_stats.reconnect_attempts, (unsigned long)connection_stats.reconnects,
+        (unsigned long)connection_stats.reconnect_last_ms, (unsigned long)connection_stats.reconnect_max_ms,
+        (unsigned long)(connection_stats.reconnects > 0 ? connection_stats.reconnect_total_ms / connection_stats.reconnects : 0),
+        outbox_stats.available ? "true" : "false", (unsigned long)outbox_stats.segments, (unsigned long)outbox_stats.backlog,
+        (unsigned long)outbox_stats.backlog_high_water, (unsigned long)outbox_stats.written, (unsigned long)outbox_stats.drained,
+        (unsigned long)outbox_stats.consumed, (unsigned long)outbox_stats.rate_limited, (unsigned long)outbox_stats.overwritten,
+        (unsigned long)outbox_stats.erases, (unsigned long)outbox_stats.max_segment_erases);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, response);
+    return ESP_OK;
+}
+
 static const httpd_uri_t root = {
     .uri       = "/",
     .method    = HTTP_GET,
@@ -272,6 +419,265 @@ static const httpd_uri_t get_config = {
     .handler   = config_get_handler
 };
 
+#if CONFIG_HOMEPOST_MQTT_TLS
+static esp_err_t mqtt_ca_post_handler(httpd_req_t *req)
+{
+    char *cert;
+    int ret, received = 0;
+    esp_err_t err;
+
+    if (req->content_len >= MQTT_CA_CERT_MAX_LEN) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Content too long");
+        return ESP_FAIL;
+    }
+
+    cert = malloc(req->content_len + 1);
+    if (cert == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+
+    while (received < req->content_len) {
+        ret = httpd_req_recv(req, cert + received, req->content_len - received);
+        if (ret <= 0) {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Retry receiving if timeout occurred
+                continue;
+            }
+            free(cert);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive data");
+            return ESP_FAIL;
+        }
+        received += ret;
+    }
+    cert[received] = '\0';
+
+    // An empty body removes the certificate and falls back to the bundle
+    if (received > 0 && strstr(cert, "-----BEGIN CERTIFICATE-----") == NULL) {
+        free(cert);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Expected a PEM certificate");
+        return ESP_FAIL;
+    }
+
+    err = internal_storage_save_mqtt_ca_cert(cert);
+    free(cert);
+    if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to save certificate");
+        return ESP_FAIL;
+    }
+
+    // The client reads the certificate when it is rebuilt
+    mqtt_connection_start_task();
+
+    httpd_resp_sendstr(req, received > 0 ? "CA certificate saved" : "CA certificate removed");
+    return ESP_OK;
+}
+
+static const httpd_uri_t post_mqtt_ca = {
+    .uri       = "/mqtt-ca",
+    .method    = HTTP_POST,
+    .handler   = mqtt_ca_post_handler
+};
+#endif
+
+static const httpd_uri_t get_mqtt_stats = {
+    .uri       = "/mqtt-stats",
+    .method    = HTTP_GET,
+    .handler   = mqtt_stats_get_handler
+};
+
+static esp_err_t dose_stats_get_handler(httpd_req_t *req)
+{
+    char response[256];
+    struct geiger_counter_dose_stats_t stats;
+
+    geiger_counter_get_dose_stats(&stats);
+
+    snprintf(response, sizeof(response),
+        "{\"counts\":%llu,\"dose_usv\":%.3f,\"restored_from\":\"%s\",\"flushed_counts\":%llu,"
+        "\"flash_writes\":%lu,\"flash_writes_per_day\":%lu,\"flash_write_budget_per_day\":%lu}",
+        (unsigned long long)stats.counts, stats.dose_usv, stats.restored_from_rtc ? "rtc" : "nvs",
+        (unsigned long long)stats.flushed_counts, (unsigned long)stats.flushes,
+        (unsigned long)stats.flushes_per_day, (unsigned long)stats.flush_budget_per_day);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, response);
+    return ESP_OK;
+}
+
+static const httpd_uri_t get_dose_stats = {
+    .uri       = "/dose-stats",
+    .method    = HTTP_GET,
+    .handler   = dose_stats_get_handler
+};
+
+// One chunk per sensor, so the response grows with the registry without a bigger buffer
+static esp_err_t sensor_stats_get_handler(httpd_req_t *req)
+{
+    char chunk[320];
+    struct sensor_registry_stats_t sensor_stats;
+    struct htu21_sensor_stats_t htu21_stats;
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "{\"sensors\":[");
+
+    for (uint32_t i = 0; sensor_registry_get_stats(i, &sensor_stats); i++) {
+        snprintf(chunk, sizeof(chunk),
+            "%s{\"name\":\"%s\",\"active\":%s,\"period_ms\":%lu,\"samples\":%lu,\"failures\":%lu,\"skipped\":%lu,"
+            "\"lateness_avg_us\":%lu,\"lateness_max_us\":%lu,\"sample_max_us\":%lu,\"busy_max_us\":%lu}",
+            i > 0 ? "," : "", sensor_stats.name, sensor_stats.active ? "true" : "false", (unsigned long)sensor_stats.period_ms,
+            (unsigned long)sensor_stats.samples, (unsigned long)sensor_stats.failures, (unsigned long)sensor_stats.skipped,
+            (unsigned long)sensor_stats.lateness_avg_us, (unsigned long)sensor_stats.lateness_max_us,
+            (unsigned long)sensor_stats.sample_max_us, (unsigned long)sensor_stats.busy_max_us);
+        httpd_resp_sendstr_chunk(req, chunk);
+    }
+
+    htu21_sensor_get_stats(&htu21_stats);
+    snprintf(chunk, sizeof(chunk),
+        "],\"htu21\":{\"retries\":%lu,\"i2c_errors\":%lu,\"crc_errors\":%lu,\"status_errors\":%lu,\"bus_us\":%lu,\"conversion_us\":%lu,\"energy_uj\":%lu}}",
+        (unsigned long)htu21_stats.retries, (unsigned long)htu21_stats.i2c_errors, (unsigned long)htu21_stats.crc_errors,
+        (unsigned long)htu21_stats.status_errors,
+        (unsigned long)htu21_stats.bus_us, (unsigned long)htu21_stats.conversion_us, (unsigned long)htu21_stats.energy_uj);
+    httpd_resp_sendstr_chunk(req, chunk);
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static const httpd_uri_t get_sensor_stats = {
+    .uri       = "/sensor-stats",
+    .method    = HTTP_GET,
+    .handler   = sensor_stats_get_handler
+};
+
+// One chunk per device, so the response grows with the bus without a bigger buffer
+static esp_err_t i2c_stats_get_handler(httpd_req_t *req)
+{
+    char chunk[256];
+    struct i2c_bus_stats_t bus_stats;
+    struct i2c_bus_device_stats_t device_stats;
+
+    i2c_bus_get_stats(&bus_stats);
+
+    httpd_resp_set_type(req, "application/json");
+    snprintf(chunk, sizeof(chunk),
+        "{\"requests\":%lu,\"rejected\":%lu,\"batches\":%lu,\"batch_max\":%lu,\"queue_high_water\":%lu,\"devices\":[",
+        (unsigned long)bus_stats.requests, (unsigned long)bus_stats.rejected, (unsigned long)bus_stats.batches,
+        (unsigned long)bus_stats.batch_max, (unsigned long)bus_stats.queue_high_water);
+    httpd_resp_sendstr_chunk(req, chunk);
+
+    for (uint32_t i = 0; i2c_bus_get_device_stats(i, &device_stats); i++) {
+        snprintf(chunk, sizeof(chunk),
+            "%s{\"name\":\"%s\",\"address\":%u,\"transactions\":%lu,\"errors\":%lu,\"timeouts\":%lu,"
+            "\"latency_avg_us\":%lu,\"latency_max_us\":%lu,\"bus_avg_us\":%lu,\"bus_max_us\":%lu}",
+            i > 0 ? "," : "", device_stats.name, device_stats.address,
+            (unsigned long)device_stats.transactions, (unsigned long)device_stats.errors, (unsigned long)device_stats.timeouts,
+            (unsigned long)device_stats.latency_avg_us, (unsigned long)device_stats.latency_max_us,
+            (unsigned long)device_stats.bus_avg_us, (unsigned long)device_stats.bus_max_us);
+        httpd_resp_sendstr_chunk(req, chunk);
+    }
+
+    httpd_resp_sendstr_chunk(req, "]}");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static const httpd_uri_t get_i2c_stats = {
+    .uri       = "/i2c-stats",
+    .method    = HTTP_GET,
+    .handler   = i2c_stats_get_handler
+};
+
+#if CONFIG_HOMEPOST_SENSOR_LOG_ENABLED
+#define HISTORY_CHUNK_SIZE      1024
+#define HISTORY_LINE_MAX        48
+
+/*
+ * Streams the readings between the optional from and to query parameters
+ * (Unix time) as CSV, chunk by chunk so a query over the whole partition
+ * needs no more memory than a short one.
+ */
+static esp_err_t history_get_handler(httpd_req_t *req)
+{
+    static char chunk[HISTORY_CHUNK_SIZE];
+    char query[64];
+    char param[16];
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    struct sensor_log_iterator_t iterator;
+    struct sensor_log_sample_t sample;
+    int32_t value;
+    size_t len;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "from", param, sizeof(param)) == ESP_OK) {
+            from = strtoul(param, NULL, 10);
+        }
+        if (httpd_query_key_value(query, "to", param, sizeof(param)) == ESP_OK) {
+            to = strtoul(param, NULL, 10);
+        }
+    }
+
+    if (sensor_log_iterator_init(&iterator, from, to) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Sensor log not available");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "text/csv");
+    len = snprintf(chunk, sizeof(chunk), "timestamp,channel,value\n");
+    while (sensor_log_iterator_next(&iterator, &sample)) {
+        if (len + HISTORY_LINE_MAX > sizeof(chunk)) {
+            if (httpd_resp_send_chunk(req, chunk, len) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            len = 0;
+        }
+        value = sample.value_milli < 0 ? -sample.value_milli : sample.value_milli;
+        len += snprintf(chunk + len, sizeof(chunk) - len, "%lu,%s,%s%ld.%03ld\n",
+                        (unsigned long)sample.timestamp, sensor_log_get_channel_name(sample.channel),
+                        sample.value_milli < 0 ? "-" : "", (long)(value / 1000), (long)(value % 1000));
+    }
+
+    if (httpd_resp_send_chunk(req, chunk, len) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t history_stats_get_handler(httpd_req_t *req)
+{
+    char response[512];
+    struct sensor_log_stats_t stats;
+
+    sensor_log_get_stats(&stats);
+
+    snprintf(response, sizeof(response),
+        "{\"available\":%s,\"segments\":%lu,\"oldest\":%lu,\"newest\":%lu,"
+        "\"appended\":%lu,\"dropped\":%lu,\"written\":%lu,\"erases\":%lu,\"max_segment_erases\":%lu,"
+        "\"append_max_us\":%lu,\"write_avg_us\":%lu,\"write_max_us\":%lu,\"erase_max_us\":%lu}",
+        stats.available ? "true" : "false", (unsigned long)stats.segments, (unsigned long)stats.oldest, (unsigned long)stats.newest,
+        (unsigned long)stats.appended, (unsigned long)stats.dropped, (unsigned long)stats.written,
+        (unsigned long)stats.erases, (unsigned long)stats.max_segment_erases,
+        (unsigned long)stats.append_max_us, (unsigned long)stats.write_avg_us,
+        (unsigned long)stats.write_max_us, (unsigned long)stats.erase_max_us);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, response);
+    return ESP_OK;
+}
+
+static const httpd_uri_t get_history = {
+    .uri       = "/history",
+    .method    = HTTP_GET,
+    .handler   = history_get_handler
+};
+
+static const httpd_uri_t get_history_stats = {
+    .uri       = "/history-stats",
+    .method    = HTTP_GET,
+    .handler   = history_stats_get_handler
+};
+#endif
+
 #if CONFIG_HOMEPOST_OTA_ENABLED
 static esp_err_t check_update_get_handler(httpd_req_t *req)
 {
@@ -338,10 +744,12 @@ static httpd_handle_t start_webserver(void)
     extern const unsigned char prvtkey_pem_end[]   asm("_binary_prvtkey_pem_end");
     conf.prvtkey_pem = prvtkey_pem_start;
     conf.prvtkey_len = prvtkey_pem_end - prvtkey_pem_start;
+    conf.httpd.max_uri_handlers = HTTP_SERVER_MAX_URI_HANDLERS;
 
     esp_err_t ret = httpd_ssl_start(&http_server, &conf);
 #else
     httpd_config_t conf = HTTPD_DEFAULT_CONFIG();
+    conf.max_uri_handlers = HTTP_SERVER_MAX_URI_HANDLERS;
     esp_err_t ret = httpd_start(&http_server, &conf);
 #endif
     if (ESP_OK != ret) {
@@ -355,6 +763,17 @@ static httpd_handle_t start_webserver(void)
     httpd_register_uri_handler(http_server, &configure_wifi);
     httpd_register_uri_handler(http_server, &configure_mqtt);
     httpd_register_uri_handler(http_server, &get_config);
+    httpd_register_uri_handler(http_server, &get_mqtt_stats);
+    httpd_register_uri_handler(http_server, &get_dose_stats);
+    httpd_register_uri_handler(http_server, &get_sensor_stats);
+    httpd_register_uri_handler(http_server, &get_i2c_stats);
+#if CONFIG_HOMEPOST_MQTT_TLS
+    httpd_register_uri_handler(http_server, &post_mqtt_ca);
+#endif
+#if CONFIG_HOMEPOST_SENSOR_LOG_ENABLED
+    httpd_register_uri_handler(http_server, &get_history);
+    httpd_register_uri_handler(http_server, &get_history_stats);
+#endif
 #if CONFIG_HOMEPOST_OTA_ENABLED
     httpd_register_uri_handler(http_server, &check_update);
     httpd_register_uri_handler(http_server, &trigger_update);
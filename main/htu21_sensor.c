@@ -1,6 +1,6 @@
 #include "htu21_sensor.h"
-#include "mqtt_connection.h"
-#include <driver/i2c_master.h>
+#include "i2c_bus.h"
+#include <math.h>
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <string.h>
@@ -12,214 +12,331 @@
 #define HTU21_CMD_HUMIDITY_HOLD         0xE5
 #define HTU21_CMD_TEMP_NOHOLD           0xF3
 #define HTU21_CMD_HUMIDITY_NOHOLD       0xF5
+#define HTU21_CMD_WRITE_USER_REG        0xE6
+#define HTU21_CMD_READ_USER_REG         0xE7
 #define HTU21_CMD_SOFT_RESET            0xFE
+#define HTU21_USER_REG_RESOLUTION_MASK  0x81
+#define HTU21_CRC_POLYNOMIAL            0x31
+#define HTU21_STATUS_MASK               0x0003
+#define HTU21_STATUS_HUMIDITY           0x0002
+#define HTU21_SUPPLY_MV                 3300
+#define HTU21_MEASURING_UA              450
+
+// User register resolution bits and the worst case conversion times for them
+#if CONFIG_HOMEPOST_HTU21_RESOLUTION_RH10_T13
+#define HTU21_RESOLUTION_BITS           0x80
+#define HTU21_TEMPERATURE_CONVERSION_US 43000
+#define HTU21_HUMIDITY_CONVERSION_US    9000
+#elif CONFIG_HOMEPOST_HTU21_RESOLUTION_RH8_T12
+#define HTU21_RESOLUTION_BITS           0x01
+#define HTU21_TEMPERATURE_CONVERSION_US 22000
+#define HTU21_HUMIDITY_CONVERSION_US    4000
+#elif CONFIG_HOMEPOST_HTU21_RESOLUTION_RH11_T11
+#define HTU21_RESOLUTION_BITS           0x81
+#define HTU21_TEMPERATURE_CONVERSION_US 11000
+#define HTU21_HUMIDITY_CONVERSION_US    15000
+#else
+#define HTU21_RESOLUTION_BITS           0x00
+#define HTU21_TEMPERATURE_CONVERSION_US 85000
+#define HTU21_HUMIDITY_CONVERSION_US    29000
+#endif
+
+/*
+ * One sample runs as IDLE -> TEMPERATURE -> HUMIDITY -> IDLE. Each state
+ * takes CONFIG_HOMEPOST_HTU21_SAMPLES conversions: trigger a no-hold
+ * conversion, hand the conversion time back to the sensor scheduler and read
+ * the result when it calls again. A conversion that fails is repeated up to
+ * CONFIG_HOMEPOST_HTU21_RETRIES times, then the state reports the average of
+ * what it has and moves on.
+ */
+enum htu21_state_t {
+    HTU21_STATE_TEMPERATURE = 0,
+    HTU21_STATE_HUMIDITY,
+    HTU21_STATE_IDLE,
+};
+
+struct htu21_measurement_t {
+    uint8_t command;
+    uint16_t status;
+    uint32_t conversion_us;
+    float offset;
+    float scale;
+};
 
 static const char *TAG = __FILE__;
 
-static i2c_master_bus_handle_t i2c_bus_handle = NULL;
-static i2c_master_dev_handle_t htu21_dev_handle = NULL;
+static const struct htu21_measurement_t htu21_measurements[HTU21_STATE_IDLE] = {
+    [HTU21_STATE_TEMPERATURE] = {
+        .command = HTU21_CMD_TEMP_NOHOLD, .status = 0,
+        .conversion_us = HTU21_TEMPERATURE_CONVERSION_US, .offset = -46.85f, .scale = 175.72f,
+    },
+    [HTU21_STATE_HUMIDITY] = {
+        .command = HTU21_CMD_HUMIDITY_NOHOLD, .status = HTU21_STATUS_HUMIDITY,
+        .conversion_us = HTU21_HUMIDITY_CONVERSION_US, .offset = -6.0f, .scale = 125.0f,
+    },
+};
 
-static esp_timer_handle_t htu21_timer;
+// Indexed by state, the scheduler fills the values in the same order
+static const struct sensor_metric_t htu21_metrics[HTU21_STATE_IDLE] = {
+    [HTU21_STATE_TEMPERATURE] = { "temperature", "C", 2, MQTT_CONNECTION_TOPIC_TEMPERATURE, SENSOR_LOG_CHANNEL_TEMPERATURE },
+    [HTU21_STATE_HUMIDITY]    = { "humidity",    "%", 2, MQTT_CONNECTION_TOPIC_HUMIDITY,    SENSOR_LOG_CHANNEL_HUMIDITY },
+};
 
-static char temperature_payload[32];
-static char humidity_payload[32];
-static char temperature_topic[100];
-static char humidity_topic[100];
+static esp_err_t htu21_init(void);
+static esp_err_t htu21_sample(float *values, uint32_t *wait_us);
 
-static struct mqtt_connection_message_t temperature_message = {
-    .topic = temperature_topic,
-    .payload = temperature_payload,
-    .qos = 0
+const struct sensor_driver_t htu21_sensor_driver = {
+    .name = "htu21",
+    .metrics = htu21_metrics,
+    .metric_count = HTU21_STATE_IDLE,
+    .period_ms = CONFIG_HOMEPOST_HTU21_TIMER_PERIOD_MS,
+    .init = htu21_init,
+    .sample = htu21_sample,
 };
 
-static struct mqtt_connection_message_t humidity_message = {
-    .topic = humidity_topic,
-    .payload = humidity_payload,
-    .qos = 0
-};
+static struct i2c_bus_device_t *htu21_device = NULL;
+
+// Owned by the sensor scheduler task
+static enum htu21_state_t htu21_state = HTU21_STATE_IDLE;
+static uint32_t htu21_samples = 0;
+static uint32_t htu21_attempts = 0;
+static float htu21_sum = 0;
+static uint32_t htu21_cycle_bus_us = 0;
+static uint32_t htu21_cycle_conversion_us = 0;
+static struct htu21_sensor_stats_t htu21_stats;
 
-static esp_err_t htu21_read_temperature(float *temperature)
+static void htu21_start_measurement(enum htu21_state_t state, float *values);
+static void htu21_trigger(enum htu21_state_t state, float *values);
+
+// CRC-8 of the datasheet: polynomial x^8 + x^5 + x^4 + 1, initial value 0
+static uint8_t htu21_crc8(const uint8_t *data, size_t len)
 {
-    uint8_t cmd = HTU21_CMD_TEMP_NOHOLD;
-    uint8_t data[2];
-    esp_err_t ret;
+    uint8_t crc = 0;
 
-    ret = i2c_master_transmit(htu21_dev_handle, &cmd, 1, 1000);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to send temperature command: %s", esp_err_to_name(ret));
-        return ret;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ HTU21_CRC_POLYNOMIAL : crc << 1;
+        }
     }
 
-    vTaskDelay(pdMS_TO_TICKS(85));
+    return crc;
+}
 
-    ret = i2c_master_receive(htu21_dev_handle, data, sizeof(data), 1000);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to receive temperature data: %s", esp_err_to_name(ret));
-        return ret;
-    }
+static esp_err_t htu21_bus_transmit(const uint8_t *data, size_t len)
+{
+    int64_t started = esp_timer_get_time();
+    esp_err_t ret = i2c_bus_write_read(htu21_device, data, len, NULL, 0);
 
-    uint16_t raw_temp = (data[0] << 8) | data[1];
-    *temperature = -46.85 + 175.72 * (raw_temp / 65536.0);
+    htu21_cycle_bus_us += esp_timer_get_time() - started;
+    return ret;
+}
 
-    return ESP_OK;
+static esp_err_t htu21_bus_receive(uint8_t *data, size_t len)
+{
+    int64_t started = esp_timer_get_time();
+    esp_err_t ret = i2c_bus_write_read(htu21_device, NULL, 0, data, len);
+
+    htu21_cycle_bus_us += esp_timer_get_time() - started;
+    return ret;
 }
 
-static esp_err_t htu21_read_humidity(float *humidity)
+static void htu21_finish_cycle(void)
 {
-    uint8_t cmd = HTU21_CMD_HUMIDITY_NOHOLD;
-    uint8_t data[2];
-    esp_err_t ret;
+    htu21_state = HTU21_STATE_IDLE;
 
-    ret = i2c_master_transmit(htu21_dev_handle, &cmd, 1, 1000);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to send humidity command: %s", esp_err_to_name(ret));
-        return ret;
+    // The sensor draws its measuring current for at most the conversion windows, the bus time is the ESP32 side
+    htu21_stats.bus_us = htu21_cycle_bus_us;
+    htu21_stats.conversion_us = htu21_cycle_conversion_us;
+    htu21_stats.energy_uj = (uint64_t)HTU21_SUPPLY_MV * HTU21_MEASURING_UA * htu21_cycle_conversion_us / 1000000000;
+}
+
+static void htu21_finish_measurement(enum htu21_state_t state, float *values)
+{
+    if (htu21_samples > 0) {
+        values[state] = htu21_sum / htu21_samples;
+    } else {
+        ESP_LOGE(TAG, "Failed to read %s", htu21_metrics[state].name);
+    }
+
+    if (state == HTU21_STATE_TEMPERATURE) {
+        htu21_start_measurement(HTU21_STATE_HUMIDITY, values);
+    } else {
+        htu21_finish_cycle();
+    }
+}
+
+static void htu21_sample_failed(enum htu21_state_t state, float *values, uint32_t *error_counter)
+{
+    (*error_counter)++;
+
+    if (htu21_attempts < CONFIG_HOMEPOST_HTU21_RETRIES) {
+        htu21_attempts++;
+        htu21_stats.retries++;
+        htu21_trigger(state, values);
+        return;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(50));
+    ESP_LOGE(TAG, "Giving up %s conversion after %d retries", htu21_metrics[state].name, CONFIG_HOMEPOST_HTU21_RETRIES);
+    htu21_finish_measurement(state, values);
+}
+
+static void htu21_trigger(enum htu21_state_t state, float *values)
+{
+    const struct htu21_measurement_t *measurement = &htu21_measurements[state];
+    esp_err_t ret;
 
-    ret = i2c_master_receive(htu21_dev_handle, data, sizeof(data), 1000);
+    ret = htu21_bus_transmit(&measurement->command, 1);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to receive humidity data: %s", esp_err_to_name(ret));
-        return ret;
+        ESP_LOGE(TAG, "Failed to send %s command: %s", htu21_metrics[state].name, esp_err_to_name(ret));
+        htu21_sample_failed(state, values, &htu21_stats.i2c_errors);
+        return;
     }
 
-    uint16_t raw_humidity = (data[0] << 8) | data[1];
-    *humidity = -6.0 + 125.0 * (raw_humidity / 65536.0);
+    htu21_cycle_conversion_us += measurement->conversion_us;
+}
 
-    return ESP_OK;
+static void htu21_start_measurement(enum htu21_state_t state, float *values)
+{
+    htu21_state = state;
+    htu21_samples = 0;
+    htu21_attempts = 0;
+    htu21_sum = 0;
+
+    htu21_trigger(state, values);
 }
 
-static void htu21_timer_cb(void *arg)
+static void htu21_complete_conversion(float *values)
 {
-    float temperature, humidity;
+    enum htu21_state_t state = htu21_state;
+    const struct htu21_measurement_t *measurement = &htu21_measurements[state];
+    const char *name = htu21_metrics[state].name;
+    uint8_t data[3];
+    uint16_t raw;
     esp_err_t ret;
 
-    ret = htu21_read_temperature(&temperature);
-    if (ret == ESP_OK) {
-        ESP_LOGI(TAG, "Temperature: %.2f C", temperature);
-        memset(temperature_payload, 0, sizeof(temperature_payload));
-        int len = snprintf(temperature_payload, sizeof(temperature_payload), 
-                          "{\"temperature\": %.2f}", temperature);
-        if (len > 0 && len < sizeof(temperature_payload)) {
-            if (mqtt_connection_put_publish_queue(&temperature_message) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to enqueue temperature message");
-            }
-        } else {
-            ESP_LOGE(TAG, "Failed to format temperature payload");
-        }
-    } else {
-        ESP_LOGE(TAG, "Failed to read temperature, skipping publish");
-    }
-
-    ret = htu21_read_humidity(&humidity);
-    if (ret == ESP_OK) {
-        ESP_LOGI(TAG, "Humidity: %.2f %%", humidity);
-        memset(humidity_payload, 0, sizeof(humidity_payload));
-        int len = snprintf(humidity_payload, sizeof(humidity_payload), 
-                          "{\"humidity\": %.2f}", humidity);
-        if (len > 0 && len < sizeof(humidity_payload)) {
-            if (mqtt_connection_put_publish_queue(&humidity_message) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to enqueue humidity message");
-            }
-        } else {
-            ESP_LOGE(TAG, "Failed to format humidity payload");
-        }
+    ret = htu21_bus_receive(data, sizeof(data));
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to receive %s data: %s", name, esp_err_to_name(ret));
+        htu21_sample_failed(state, values, &htu21_stats.i2c_errors);
+        return;
+    }
+
+    if (htu21_crc8(data, 2) != data[2]) {
+        ESP_LOGW(TAG, "CRC mismatch in %s data", name);
+        htu21_sample_failed(state, values, &htu21_stats.crc_errors);
+        return;
+    }
+
+    // The two low bits are status, bit 1 tells a humidity from a temperature result
+    raw = (data[0] << 8) | data[1];
+    if ((raw & HTU21_STATUS_HUMIDITY) != measurement->status) {
+        ESP_LOGW(TAG, "Unexpected result type for %s", name);
+        htu21_sample_failed(state, values, &htu21_stats.status_errors);
+        return;
+    }
+
+    htu21_sum += measurement->offset + measurement->scale * ((raw & ~HTU21_STATUS_MASK) / 65536.0f);
+    htu21_samples++;
+    htu21_attempts = 0;
+
+    if (htu21_samples < CONFIG_HOMEPOST_HTU21_SAMPLES) {
+        htu21_trigger(state, values);
     } else {
-        ESP_LOGE(TAG, "Failed to read humidity, skipping publish");
+        htu21_finish_measurement(state, values);
     }
 }
 
-static const esp_timer_create_args_t htu21_timer_args = {
-    .callback = &htu21_timer_cb,
-};
+/*
+ * Every state other than IDLE has a conversion running, so the scheduler is
+ * asked to come back after its conversion time.
+ */
+static esp_err_t htu21_sample(float *values, uint32_t *wait_us)
+{
+    if (htu21_state == HTU21_STATE_IDLE) {
+        htu21_cycle_bus_us = 0;
+        htu21_cycle_conversion_us = 0;
+        htu21_start_measurement(HTU21_STATE_TEMPERATURE, values);
+    } else {
+        htu21_complete_conversion(values);
+    }
 
-static esp_err_t htu21_init(void)
+    if (htu21_state != HTU21_STATE_IDLE) {
+        *wait_us = htu21_measurements[htu21_state].conversion_us;
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+    return isnan(values[HTU21_STATE_TEMPERATURE]) && isnan(values[HTU21_STATE_HUMIDITY]) ? ESP_FAIL : ESP_OK;
+}
+
+/*
+ * Only the resolution bits are changed, the reserved bits of the user
+ * register have to be written back as read.
+ */
+static esp_err_t htu21_set_resolution(void)
 {
-    uint8_t cmd = HTU21_CMD_SOFT_RESET;
+    uint8_t cmd = HTU21_CMD_READ_USER_REG;
+    uint8_t write[2] = { HTU21_CMD_WRITE_USER_REG, 0 };
+    uint8_t user_reg;
     esp_err_t ret;
 
-    ret = i2c_master_transmit(htu21_dev_handle, &cmd, 1, 1000);
+    ret = i2c_bus_write_read(htu21_device, &cmd, 1, &user_reg, 1);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to reset HTU21: %s", esp_err_to_name(ret));
         return ret;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(20));
-    ESP_LOGI(TAG, "HTU21 sensor initialized successfully");
-
-    return ESP_OK;
+    write[1] = (user_reg & ~HTU21_USER_REG_RESOLUTION_MASK) | HTU21_RESOLUTION_BITS;
+    return i2c_bus_write_read(htu21_device, write, sizeof(write), NULL, 0);
 }
 
-void htu21_sensor_start(void)
+static esp_err_t htu21_reset(void)
 {
+    uint8_t cmd = HTU21_CMD_SOFT_RESET;
     esp_err_t ret;
 
-    // Build MQTT topics from base topic
-    char base_topic[64];
-    if (mqtt_connection_get_base_topic(base_topic, sizeof(base_topic)) == ESP_OK) {
-        snprintf(temperature_topic, sizeof(temperature_topic), "%s/temperature", base_topic);
-        snprintf(humidity_topic, sizeof(humidity_topic), "%s/humidity", base_topic);
-    } else {
-        ESP_LOGE(TAG, "Failed to get base topic, using default");
-        snprintf(temperature_topic, sizeof(temperature_topic), "%s/temperature", CONFIG_HOMEPOST_MQTT_TOPIC);
-        snprintf(humidity_topic, sizeof(humidity_topic), "%s/humidity", CONFIG_HOMEPOST_MQTT_TOPIC);
+    ret = i2c_bus_write_read(htu21_device, &cmd, 1, NULL, 0);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to reset HTU21: %s", esp_err_to_name(ret));
+        return ret;
     }
 
-    ESP_LOGI(TAG, "Starting HTU21 sensor on I2C bus (SDA: %d, SCL: %d, freq: %d Hz)",
-             CONFIG_HOMEPOST_HTU21_I2C_SDA_GPIO, CONFIG_HOMEPOST_HTU21_I2C_SCL_GPIO,
-             CONFIG_HOMEPOST_HTU21_I2C_FREQ_HZ);
-
-    i2c_master_bus_config_t bus_config = {
-        .i2c_port = I2C_NUM_0,
-        .sda_io_num = CONFIG_HOMEPOST_HTU21_I2C_SDA_GPIO,
-        .scl_io_num = CONFIG_HOMEPOST_HTU21_I2C_SCL_GPIO,
-        .clk_source = I2C_CLK_SRC_DEFAULT,
-        .glitch_ignore_cnt = 7,
-        .flags.enable_internal_pullup = true,
-    };
+    vTaskDelay(pdMS_TO_TICKS(20));
 
-    ret = i2c_new_master_bus(&bus_config, &i2c_bus_handle);
+    ret = htu21_set_resolution();
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create I2C bus: %s", esp_err_to_name(ret));
-        return;
+        ESP_LOGE(TAG, "Failed to set HTU21 resolution: %s", esp_err_to_name(ret));
+        return ret;
     }
 
-    i2c_device_config_t dev_config = {
-        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
-        .device_address = HTU21_I2C_ADDR,
-        .scl_speed_hz = CONFIG_HOMEPOST_HTU21_I2C_FREQ_HZ,
-    };
+    ESP_LOGI(TAG, "HTU21 sensor initialized successfully");
 
-    ret = i2c_master_bus_add_device(i2c_bus_handle, &dev_config, &htu21_dev_handle);
+    return ESP_OK;
+}
+
+// Sampled even if the reset fails, a sensor plugged in later still reports at its default resolution
+static esp_err_t htu21_init(void)
+{
+    esp_err_t ret;
+
+    ret = i2c_bus_add_device("htu21", HTU21_I2C_ADDR, CONFIG_HOMEPOST_HTU21_I2C_FREQ_HZ, &htu21_device);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to add HTU21 device: %s", esp_err_to_name(ret));
-        i2c_del_master_bus(i2c_bus_handle);
-        return;
+        return ret;
     }
-    ESP_LOGI(TAG, "HTU21 device added to I2C bus at address 0x%02X", HTU21_I2C_ADDR);
 
-    ret = htu21_init();
-    if (ret != ESP_OK) {
+    if (htu21_reset() != ESP_OK) {
         ESP_LOGE(TAG, "HTU21 initialization failed, sensor readings may be unreliable");
     }
 
-    ret = esp_timer_create(&htu21_timer_args, &htu21_timer);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create timer: %s", esp_err_to_name(ret));
-        i2c_master_bus_rm_device(htu21_dev_handle);
-        i2c_del_master_bus(i2c_bus_handle);
-        return;
-    }
+    return ESP_OK;
+}
 
-    ret = esp_timer_start_periodic(htu21_timer, CONFIG_HOMEPOST_HTU21_TIMER_PERIOD_MS * 1000);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start timer: %s", esp_err_to_name(ret));
-        esp_timer_delete(htu21_timer);
-        i2c_master_bus_rm_device(htu21_dev_handle);
-        i2c_del_master_bus(i2c_bus_handle);
-        return;
-    }
+esp_err_t htu21_sensor_set_period(uint32_t period_ms)
+{
+    return sensor_registry_set_period(&htu21_sensor_driver, period_ms);
+}
 
-    ESP_LOGI(TAG, "HTU21 sensor started successfully (polling interval: %d ms)", CONFIG_HOMEPOST_HTU21_TIMER_PERIOD_MS);
+void htu21_sensor_get_stats(struct htu21_sensor_stats_t *stats)
+{
+    *stats = htu21_stats;
 }
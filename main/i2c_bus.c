@@ -0,0 +1,297 @@
+#include "i2c_bus.h"
+#include <string.h>
+#include <driver/i2c_master.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define I2C_BUS_PORT                            I2C_NUM_0
+#define I2C_BUS_GLITCH_IGNORE_COUNT             7
+#define I2C_BUS_TIMEOUT_MS                      1000
+#define I2C_BUS_TASK_NAME                       "i2c_bus"
+#define I2C_BUS_TASK_STACK_SIZE                 3072
+#define I2C_BUS_TASK_PRIORITY                   5
+
+struct i2c_bus_device_t {
+    i2c_master_dev_handle_t handle;
+    struct i2c_bus_device_stats_t stats;
+    uint64_t latency_total_us;
+    uint64_t bus_total_us;
+};
+
+struct i2c_bus_request_t {
+    struct i2c_bus_transaction_t *transactions;
+    size_t count;
+    i2c_bus_done_cb_t done;
+    void *arg;
+    int64_t submitted;
+};
+
+struct i2c_bus_waiter_t {
+    SemaphoreHandle_t done;
+    esp_err_t result;
+};
+
+static const char *TAG = __FILE__;
+
+static i2c_master_bus_handle_t bus_handle = NULL;
+static QueueHandle_t bus_queue = NULL;
+static SemaphoreHandle_t bus_mutex = NULL;
+static TaskHandle_t bus_task = NULL;
+
+// Device stats are only written by the worker task
+static struct i2c_bus_device_t bus_devices[I2C_BUS_MAX_DEVICES];
+static struct i2c_bus_stats_t bus_stats;
+
+static esp_err_t i2c_bus_run(struct i2c_bus_transaction_t *transaction, int64_t submitted){
+    struct i2c_bus_device_t *device = transaction->device;
+    struct i2c_bus_device_stats_t *stats = &device->stats;
+    int64_t started = esp_timer_get_time();
+    uint32_t bus_us;
+    uint32_t latency_us;
+    esp_err_t ret;
+
+    if(transaction->write_len > 0 && transaction->read_len > 0){
+        ret = i2c_master_transmit_receive(device->handle, transaction->write, transaction->write_len,
+                                          transaction->read, transaction->read_len, I2C_BUS_TIMEOUT_MS);
+    } else if(transaction->write_len > 0){
+        ret = i2c_master_transmit(device->handle, transaction->write, transaction->write_len, I2C_BUS_TIMEOUT_MS);
+    } else {
+        ret = i2c_master_receive(device->handle, transaction->read, transaction->read_len, I2C_BUS_TIMEOUT_MS);
+    }
+
+    bus_us = esp_timer_get_time() - started;
+    latency_us = esp_timer_get_time() - submitted;
+
+    stats->transactions++;
+    if(ret != ESP_OK){
+        stats->errors++;
+        if(ret == ESP_ERR_TIMEOUT){
+            stats->timeouts++;
+        }
+    }
+
+    device->bus_total_us += bus_us;
+    device->latency_total_us += latency_us;
+    stats->bus_avg_us = device->bus_total_us / stats->transactions;
+    stats->latency_avg_us = device->latency_total_us / stats->transactions;
+    if(bus_us > stats->bus_max_us){
+        stats->bus_max_us = bus_us;
+    }
+    if(latency_us > stats->latency_max_us){
+        stats->latency_max_us = latency_us;
+    }
+
+    transaction->result = ret;
+    return ret;
+}
+
+static void i2c_bus_execute(struct i2c_bus_request_t *request){
+    esp_err_t result = ESP_OK;
+    esp_err_t ret;
+
+    for(size_t i = 0; i < request->count; i++){
+        ret = i2c_bus_run(&request->transactions[i], request->submitted);
+        if(ret != ESP_OK && result == ESP_OK){
+            ESP_LOGW(TAG, "Transaction to %s failed: %s", request->transactions[i].device->stats.name, esp_err_to_name(ret));
+            result = ret;
+        }
+    }
+
+    if(request->done != NULL){
+        request->done(result, request->arg);
+    }
+}
+
+/*
+ * Whatever queued up while a request ran is taken without blocking, so reads
+ * from several drivers due at the same time go out back to back.
+ */
+static void i2c_bus_task(void *arg){
+    struct i2c_bus_request_t request;
+    uint32_t waiting;
+    uint32_t batch;
+
+    while(true){
+        xQueueReceive(bus_queue, &request, portMAX_DELAY);
+
+        batch = 0;
+        do {
+            waiting = uxQueueMessagesWaiting(bus_queue) + 1;
+            if(waiting > bus_stats.queue_high_water){
+                bus_stats.queue_high_water = waiting;
+            }
+            i2c_bus_execute(&request);
+            batch++;
+        } while(xQueueReceive(bus_queue, &request, 0) == pdTRUE);
+
+        bus_stats.batches++;
+        if(batch > bus_stats.batch_max){
+            bus_stats.batch_max = batch;
+        }
+    }
+}
+
+esp_err_t i2c_bus_init(void){
+    esp_err_t ret;
+
+    if(bus_handle != NULL){
+        return ESP_OK;
+    }
+
+    i2c_master_bus_config_t bus_config = {
+        .i2c_port = I2C_BUS_PORT,
+        .sda_io_num = CONFIG_HOMEPOST_I2C_BUS_SDA_GPIO,
+        .scl_io_num = CONFIG_HOMEPOST_I2C_BUS_SCL_GPIO,
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = I2C_BUS_GLITCH_IGNORE_COUNT,
+        .flags.enable_internal_pullup = true,
+    };
+
+    bus_queue = xQueueCreate(CONFIG_HOMEPOST_I2C_BUS_QUEUE_LEN, sizeof(struct i2c_bus_request_t));
+    bus_mutex = xSemaphoreCreateMutex();
+    if(bus_queue == NULL || bus_mutex == NULL){
+        return ESP_ERR_NO_MEM;
+    }
+
+    ret = i2c_new_master_bus(&bus_config, &bus_handle);
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to create I2C bus: %s", esp_err_to_name(ret));
+        bus_handle = NULL;
+        return ret;
+    }
+
+    if(xTaskCreate(i2c_bus_task, I2C_BUS_TASK_NAME, I2C_BUS_TASK_STACK_SIZE, NULL, I2C_BUS_TASK_PRIORITY, &bus_task) != pdPASS){
+        i2c_del_master_bus(bus_handle);
+        bus_handle = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "I2C bus started (SDA: %d, SCL: %d)", CONFIG_HOMEPOST_I2C_BUS_SDA_GPIO, CONFIG_HOMEPOST_I2C_BUS_SCL_GPIO);
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_bus_add_device(const char *name, uint16_t address, uint32_t scl_speed_hz, struct i2c_bus_device_t **device){
+    struct i2c_bus_device_t *added;
+    esp_err_t ret;
+
+    if(bus_handle == NULL){
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    i2c_device_config_t dev_config = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = address,
+        .scl_speed_hz = scl_speed_hz,
+    };
+
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    if(bus_stats.devices >= I2C_BUS_MAX_DEVICES){
+        xSemaphoreGive(bus_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+
+    added = &bus_devices[bus_stats.devices];
+    ret = i2c_master_bus_add_device(bus_handle, &dev_config, &added->handle);
+    if(ret == ESP_OK){
+        added->stats.name = name;
+        added->stats.address = address;
+        bus_stats.devices++;
+        *device = added;
+    }
+    xSemaphoreGive(bus_mutex);
+
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to add %s at 0x%02X: %s", name, address, esp_err_to_name(ret));
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "%s added to I2C bus at address 0x%02X", name, address);
+
+    return ESP_OK;
+}
+
+esp_err_t i2c_bus_submit(struct i2c_bus_transaction_t *transactions, size_t count, i2c_bus_done_cb_t done, void *arg){
+    struct i2c_bus_request_t request = {
+        .transactions = transactions,
+        .count = count,
+        .done = done,
+        .arg = arg,
+        .submitted = esp_timer_get_time(),
+    };
+
+    if(bus_queue == NULL){
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(count == 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if(xQueueSend(bus_queue, &request, 0) != pdTRUE){
+        __atomic_fetch_add(&bus_stats.rejected, 1, __ATOMIC_RELAXED);
+        return ESP_ERR_NO_MEM;
+    }
+    __atomic_fetch_add(&bus_stats.requests, 1, __ATOMIC_RELAXED);
+
+    return ESP_OK;
+}
+
+static void i2c_bus_transfer_done(esp_err_t result, void *arg){
+    struct i2c_bus_waiter_t *waiter = arg;
+
+    waiter->result = result;
+    xSemaphoreGive(waiter->done);
+}
+
+esp_err_t i2c_bus_transfer(struct i2c_bus_transaction_t *transactions, size_t count){
+    StaticSemaphore_t done_buffer;
+    struct i2c_bus_waiter_t waiter = {
+        .result = ESP_FAIL,
+    };
+    esp_err_t ret;
+
+    // The worker would wait on itself
+    if(xTaskGetCurrentTaskHandle() == bus_task){
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    waiter.done = xSemaphoreCreateBinaryStatic(&done_buffer);
+    ret = i2c_bus_submit(transactions, count, i2c_bus_transfer_done, &waiter);
+    if(ret == ESP_OK){
+        // Every transaction times out on its own, so the worker always answers
+        xSemaphoreTake(waiter.done, portMAX_DELAY);
+        ret = waiter.result;
+    }
+    vSemaphoreDelete(waiter.done);
+
+    return ret;
+}
+
+esp_err_t i2c_bus_write_read(struct i2c_bus_device_t *device, const uint8_t *write, size_t write_len, uint8_t *read, size_t read_len){
+    struct i2c_bus_transaction_t transaction = {
+        .device = device,
+        .write = write,
+        .write_len = write_len,
+        .read = read,
+        .read_len = read_len,
+    };
+
+    return i2c_bus_transfer(&transaction, 1);
+}
+
+void i2c_bus_get_stats(struct i2c_bus_stats_t *stats){
+    *stats = bus_stats;
+}
+
+bool i2c_bus_get_device_stats(uint32_t index, struct i2c_bus_device_stats_t *stats){
+    if(index >= bus_stats.devices){
+        return false;
+    }
+
+    *stats = bus_devices[index].stats;
+    return true;
+}
@@ -1,601 +1,888 @@
 #include "internal_storage.h"
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#if CONFIG_HOMEPOST_STORAGE_BENCHMARK
+#include <esp_timer.h>
+#endif
 
 #define INTERNAL_STORAGE_NAMESPACE              "storage"
+#define INTERNAL_STORAGE_RECORD_VERSION         1
+#define INTERNAL_STORAGE_RECORD_HEADER_LEN      offsetof(struct internal_storage_record_t, config)
+#define INTERNAL_STORAGE_WIFI_SSID_LEN          33
+#define INTERNAL_STORAGE_WIFI_PASSWORD_LEN      65
+#define INTERNAL_STORAGE_LEGACY_WIFI_LEN        96
+#define INTERNAL_STORAGE_MQTT_BROKER_LEN        100
+#define INTERNAL_STORAGE_MQTT_FIELD_LEN         64
+#define INTERNAL_STORAGE_SETTING_KEY_LEN        16
+#define INTERNAL_STORAGE_MAX_SETTINGS           20
+#define INTERNAL_STORAGE_BENCHMARK_ROUNDS       100
+#define INTERNAL_STORAGE_BENCHMARK_READS_PER_ROUND 30
+#define INTERNAL_STORAGE_BENCHMARK_CHANGE_EVERY 10
+#define INTERNAL_STORAGE_BENCHMARK_SETTING      "storage_bench"
+
+// Every NVS call goes through these so the benchmark sees all flash traffic
+#define INTERNAL_STORAGE_NVS_READ(call)         (storage_nvs_reads++, (call))
+#define INTERNAL_STORAGE_NVS_WRITE(call)        (storage_nvs_writes++, (call))
+#define INTERNAL_STORAGE_FIELD_BIT(field)       (1UL << (field))
+#define INTERNAL_STORAGE_FIELD(name, storage_key, nvs_type) \
+    { .key = storage_key, .type = nvs_type, .offset = offsetof(struct internal_storage_config_t, name), \
+      .size = sizeof(((struct internal_storage_config_t *)0)->name) }
+
+enum internal_storage_field_id_t {
+    INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS = 0,
+    INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID,
+    INTERNAL_STORAGE_FIELD_MQTT_BROKER,
+    INTERNAL_STORAGE_FIELD_MQTT_PORT,
+    INTERNAL_STORAGE_FIELD_MQTT_USERNAME,
+    INTERNAL_STORAGE_FIELD_MQTT_PASSWORD,
+    INTERNAL_STORAGE_FIELD_MQTT_TOPIC,
+    INTERNAL_STORAGE_FIELD_COUNT,
+};
+
+struct internal_storage_setting_t {
+    char key[INTERNAL_STORAGE_SETTING_KEY_LEN];
+    uint32_t value;
+};
+
+/*
+ * Payload of the config record. Fields are only ever appended: a firmware
+ * keeps the prefix it knows of a longer record and zero fills the tail of a
+ * shorter one, which leaves the fields that were missing not preserved.
+ * Changing what an existing field means needs a version bump and a
+ * conversion in internal_storage_record_load().
+ */
+struct internal_storage_config_t {
+    uint32_t preserved;
+    uint16_t mqtt_port;
+    char wifi_ssid[INTERNAL_STORAGE_WIFI_SSID_LEN];
+    char wifi_password[INTERNAL_STORAGE_WIFI_PASSWORD_LEN];
+    char mqtt_client_id[INTERNAL_STORAGE_MQTT_FIELD_LEN];
+    char mqtt_broker[INTERNAL_STORAGE_MQTT_BROKER_LEN];
+    char mqtt_username[INTERNAL_STORAGE_MQTT_FIELD_LEN];
+    char mqtt_password[INTERNAL_STORAGE_MQTT_FIELD_LEN];
+    char mqtt_topic[INTERNAL_STORAGE_MQTT_FIELD_LEN];
+    struct internal_storage_setting_t settings[INTERNAL_STORAGE_MAX_SETTINGS];
+};
+
+// Stored as one blob, the CRC covers the length bytes of config that follow the header
+struct internal_storage_record_t {
+    uint16_t version;
+    uint16_t length;
+    uint32_t crc;
+    struct internal_storage_config_t config;
+};
+
+struct internal_storage_transaction_t {
+    struct internal_storage_record_t record;
+    bool changed;
+    esp_err_t err;
+};
 
-static const char *TAG = __FILE__;
-
-void internal_storage_init(void){
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_LOGW(TAG, "Erasing NVS flash...");
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
+// Per-key layout of earlier firmware, only read to migrate it into the record
+struct internal_storage_legacy_field_t {
+    const char *key;
+    nvs_type_t type;
+    size_t offset;
+    size_t size;
+};
 
-    ESP_LOGI(TAG, "Internal storage initialized");
-}
+static const char *TAG = __FILE__;
 
-bool internal_storage_check_wifi_credentials_preserved(void){
-    nvs_handle_t nvs_handle;
+static const struct internal_storage_legacy_field_t storage_legacy_fields[INTERNAL_STORAGE_FIELD_COUNT] = {
+    // Held "ssid\npassword" in one string, split by internal_storage_legacy_load()
+    [INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS] = { .key = CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY, .type = NVS_TYPE_STR },
+    [INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID] = INTERNAL_STORAGE_FIELD(mqtt_client_id, CONFIG_HOMEPOST_MQTT_CLIENT_ID_STORAGE_KEY, NVS_TYPE_STR),
+    [INTERNAL_STORAGE_FIELD_MQTT_BROKER] = INTERNAL_STORAGE_FIELD(mqtt_broker, CONFIG_HOMEPOST_MQTT_BROKER_STORAGE_KEY, NVS_TYPE_STR),
+    [INTERNAL_STORAGE_FIELD_MQTT_PORT] = INTERNAL_STORAGE_FIELD(mqtt_port, CONFIG_HOMEPOST_MQTT_PORT_STORAGE_KEY, NVS_TYPE_U16),
+    [INTERNAL_STORAGE_FIELD_MQTT_USERNAME] = INTERNAL_STORAGE_FIELD(mqtt_username, CONFIG_HOMEPOST_MQTT_USERNAME_STORAGE_KEY, NVS_TYPE_STR),
+    [INTERNAL_STORAGE_FIELD_MQTT_PASSWORD] = INTERNAL_STORAGE_FIELD(mqtt_password, CONFIG_HOMEPOST_MQTT_PASSWORD_STORAGE_KEY, NVS_TYPE_STR),
+    [INTERNAL_STORAGE_FIELD_MQTT_TOPIC] = INTERNAL_STORAGE_FIELD(mqtt_topic, CONFIG_HOMEPOST_MQTT_TOPIC_STORAGE_KEY, NVS_TYPE_STR),
+};
+
+/*
+ * The record loaded once by internal_storage_init(). Readers copy out under
+ * the config mutex, writers are serialized from internal_storage_begin() to
+ * internal_storage_commit() by the write mutex and only swap in the new
+ * config once the blob is in NVS.
+ */
+static struct internal_storage_config_t storage_config;
+static SemaphoreHandle_t storage_config_mutex = NULL;
+static SemaphoreHandle_t storage_write_mutex = NULL;
+// NVS gets, and sets, erases and commits, counted for the storage benchmark
+static uint32_t storage_nvs_reads = 0;
+static uint32_t storage_nvs_writes = 0;
+
+static esp_err_t internal_storage_record_load(nvs_handle_t nvs_handle, struct internal_storage_config_t *config){
+    struct internal_storage_record_t *record;
+    size_t length = 0;
     esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool wifi_credentials_preserved = false;
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+    err = INTERNAL_STORAGE_NVS_READ(nvs_get_blob(nvs_handle, CONFIG_HOMEPOST_CONFIG_RECORD_STORAGE_KEY, NULL, &length));
+    if(err != ESP_OK){
+        return err;
+    }
+    if(length < INTERNAL_STORAGE_RECORD_HEADER_LEN){
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    ESP_ERROR_CHECK(err);
-
-    ESP_LOGI(TAG, "Opened NVS handle");
-
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
+    // Sized by what is stored, a newer firmware may have written a longer record
+    record = malloc(length);
+    if(record == NULL){
+        return ESP_ERR_NO_MEM;
+    }
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+    err = INTERNAL_STORAGE_NVS_READ(nvs_get_blob(nvs_handle, CONFIG_HOMEPOST_CONFIG_RECORD_STORAGE_KEY, record, &length));
+    if(err == ESP_OK && record->length != length - INTERNAL_STORAGE_RECORD_HEADER_LEN){
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if(err == ESP_OK && esp_rom_crc32_le(0, (const uint8_t *)&record->config, record->length) != record->crc){
+        err = ESP_ERR_INVALID_CRC;
+    }
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY) == 0){
-            ESP_LOGI(TAG, "WiFi credentials found in NVS");
-            wifi_credentials_preserved = true;
-            break;
+    if(err == ESP_OK){
+        if(record->version != INTERNAL_STORAGE_RECORD_VERSION){
+            ESP_LOGI(TAG, "Reading v%u config record (%u bytes) as v%d", record->version, record->length, INTERNAL_STORAGE_RECORD_VERSION);
         }
-
-        err = nvs_entry_next(&nvs_it);
+        memset(config, 0, sizeof(*config));
+        memcpy(config, &record->config, record->length < sizeof(*config) ? record->length : sizeof(*config));
     }
 
-    nvs_release_iterator(nvs_it);
-
-    nvs_close(nvs_handle);
+    free(record);
 
-    return wifi_credentials_preserved;
+    return err;
 }
 
-esp_err_t internal_storage_save_wifi_credentials(const char *ssid, const char *password){
-    nvs_handle_t nvs_handle;
+static esp_err_t internal_storage_record_write(nvs_handle_t nvs_handle, struct internal_storage_record_t *record){
     esp_err_t err;
-    char wifi_credentials[96] = {0};
-    size_t ssid_length = strlen(ssid);
-    size_t password_length = strlen(password);
-
-    if(ssid_length + password_length + 1 > 96){
-        ESP_LOGE(TAG, "SSID and password too long");
-        return ESP_FAIL;
-    }
 
-    strncpy(wifi_credentials, ssid, ssid_length);
-    wifi_credentials[ssid_length] = '\n';
-    strncpy(wifi_credentials + ssid_length + 1, password, password_length);
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+    record->version = INTERNAL_STORAGE_RECORD_VERSION;
+    record->length = sizeof(record->config);
+    record->crc = esp_rom_crc32_le(0, (const uint8_t *)&record->config, sizeof(record->config));
 
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY, wifi_credentials);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    nvs_close(nvs_handle);
+    // A single blob is replaced as a whole, so a reset midway keeps the previous record
+    err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_blob(nvs_handle, CONFIG_HOMEPOST_CONFIG_RECORD_STORAGE_KEY, record, sizeof(*record)));
+    if(err == ESP_OK){
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_commit(nvs_handle));
+    }
 
-    return ESP_OK;
+    return err;
 }
 
-esp_err_t internal_storage_get_wifi_credentials(char *ssid, char *password){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    size_t ssid_length;
-    size_t password_length;
+static void internal_storage_legacy_load_wifi(nvs_handle_t nvs_handle, struct internal_storage_config_t *config){
+    char wifi_credentials[INTERNAL_STORAGE_LEGACY_WIFI_LEN] = {0};
+    size_t length = sizeof(wifi_credentials);
     char *delimiter;
-    char wifi_credentials[96] = {0};
-    size_t credentials_len = (sizeof(wifi_credentials) / sizeof(wifi_credentials[0]));
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY, wifi_credentials, &credentials_len);
-    ESP_ERROR_CHECK(err);
 
-    memset(ssid, 0, 32);
-    memset(password, 0, 64);
+    if(INTERNAL_STORAGE_NVS_READ(nvs_get_str(nvs_handle, CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY, wifi_credentials, &length)) != ESP_OK){
+        return;
+    }
 
     delimiter = strchr(wifi_credentials, '\n');
-
-    if(delimiter == NULL){
-        nvs_close(nvs_handle);
-        return ESP_FAIL;
+    if(delimiter == NULL || delimiter - wifi_credentials >= sizeof(config->wifi_ssid) || strlen(delimiter + 1) >= sizeof(config->wifi_password)){
+        ESP_LOGW(TAG, "Dropping malformed WiFi credentials");
+        return;
     }
 
-    ssid_length = delimiter - wifi_credentials;
-
-    strncpy(ssid, wifi_credentials, ssid_length);
-    ssid[ssid_length] = '\0';
-
-    password_length = strlen(wifi_credentials) - ssid_length - 1;
-
-    strncpy(password, delimiter + 1, password_length);
-    password[password_length] = '\0';
+    *delimiter = '\0';
+    strcpy(config->wifi_ssid, wifi_credentials);
+    strcpy(config->wifi_password, delimiter + 1);
+    config->preserved |= INTERNAL_STORAGE_FIELD_BIT(INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS);
+}
 
-    nvs_close(nvs_handle);
+#if CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS
+static esp_err_t internal_storage_legacy_erase_key(nvs_handle_t nvs_handle, const char *key){
+    esp_err_t err = INTERNAL_STORAGE_NVS_WRITE(nvs_erase_key(nvs_handle, key));
 
-    return ESP_OK;
+    return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
 }
 
-esp_err_t internal_storage_erase_wifi_credentials(void){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if(err != ESP_OK){
-        return err;
+/*
+ * Writes a committed config back in the per-key layout as well, so firmware
+ * that predates the record, for instance after an OTA rollback, still finds
+ * the current WiFi and MQTT settings. NVS skips values that did not change.
+ * The record stays authoritative, changes made by such firmware are not
+ * read back after upgrading again.
+ */
+static esp_err_t internal_storage_legacy_write(nvs_handle_t nvs_handle, const struct internal_storage_config_t *config){
+    char wifi_credentials[INTERNAL_STORAGE_LEGACY_WIFI_LEN];
+    const struct internal_storage_legacy_field_t *field;
+    esp_err_t err = ESP_OK;
+
+    for(int id = 0; id < INTERNAL_STORAGE_FIELD_COUNT && err == ESP_OK; id++){
+        field = &storage_legacy_fields[id];
+
+        if(!(config->preserved & INTERNAL_STORAGE_FIELD_BIT(id))){
+            err = internal_storage_legacy_erase_key(nvs_handle, field->key);
+        } else if(id == INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS){
+            // Older firmware fails to boot on credentials longer than its buffer, it gets none instead
+            if(snprintf(wifi_credentials, sizeof(wifi_credentials), "%s\n%s", config->wifi_ssid, config->wifi_password) >= sizeof(wifi_credentials)){
+                ESP_LOGW(TAG, "WiFi credentials too long for the per-key layout");
+                err = internal_storage_legacy_erase_key(nvs_handle, field->key);
+            } else {
+                err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_str(nvs_handle, field->key, wifi_credentials));
+            }
+        } else if(field->type == NVS_TYPE_U16){
+            err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_u16(nvs_handle, field->key, config->mqtt_port));
+        } else {
+            err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_str(nvs_handle, field->key, (const char *)config + field->offset));
+        }
     }
-
-    err = nvs_erase_key(nvs_handle, CONFIG_HOMEPOST_WIFI_CREDENTIALS_STORAGE_KEY);
-    if(err != ESP_OK){
-        return err;
+    if(err == ESP_OK){
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_commit(nvs_handle));
     }
 
-    err = nvs_commit(nvs_handle);
-    if(err != ESP_OK){
-        return err;
+    return err;
+}
+#else
+static void internal_storage_legacy_erase(nvs_handle_t nvs_handle){
+    for(int id = 0; id < INTERNAL_STORAGE_FIELD_COUNT; id++){
+        (void)INTERNAL_STORAGE_NVS_WRITE(nvs_erase_key(nvs_handle, storage_legacy_fields[id].key));
     }
-
-    nvs_close(nvs_handle);
-
-    return ESP_OK;
+    (void)INTERNAL_STORAGE_NVS_WRITE(nvs_commit(nvs_handle));
 }
-
-esp_err_t internal_storage_save_mqtt_client_id(const char *client_id){
-    nvs_handle_t nvs_handle;
+#endif
+
+/*
+ * Moves the per-key layout of earlier firmware into the record. With
+ * CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS the old keys are kept for a downgrade,
+ * otherwise they are only erased once the record is committed, a reset
+ * before that simply migrates again on the next boot.
+ */
+static esp_err_t internal_storage_legacy_migrate(nvs_handle_t nvs_handle, struct internal_storage_config_t *config){
+    struct internal_storage_record_t *record;
+    const struct internal_storage_legacy_field_t *field;
+    size_t length;
     esp_err_t err;
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_CLIENT_ID_STORAGE_KEY, client_id);
-    ESP_ERROR_CHECK(err);
+    record = calloc(1, sizeof(*record));
+    if(record == NULL){
+        return ESP_ERR_NO_MEM;
+    }
 
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+    internal_storage_legacy_load_wifi(nvs_handle, &record->config);
+    for(int id = INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS + 1; id < INTERNAL_STORAGE_FIELD_COUNT; id++){
+        field = &storage_legacy_fields[id];
+        length = field->size;
 
-    nvs_close(nvs_handle);
+        if(field->type == NVS_TYPE_U16){
+            err = INTERNAL_STORAGE_NVS_READ(nvs_get_u16(nvs_handle, field->key, (uint16_t *)((uint8_t *)&record->config + field->offset)));
+        } else {
+            err = INTERNAL_STORAGE_NVS_READ(nvs_get_str(nvs_handle, field->key, (char *)&record->config + field->offset, &length));
+        }
+        if(err == ESP_OK){
+            record->config.preserved |= INTERNAL_STORAGE_FIELD_BIT(id);
+        }
+    }
 
-    return ESP_OK;
-}
+    if(record->config.preserved == 0){
+        free(record);
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
 
-esp_err_t internal_storage_get_mqtt_client_id(char *client_id){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    size_t client_id_length;
-    char mqtt_client_id[32] = {0};
-    size_t client_id_len = (sizeof(mqtt_client_id) / sizeof(mqtt_client_id[0]));
+    err = internal_storage_record_write(nvs_handle, record);
+    if(err == ESP_OK){
+        ESP_LOGI(TAG, "Migrated per-key configuration into the config record");
+#if !CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS
+        internal_storage_legacy_erase(nvs_handle);
+#endif
+        *config = record->config;
+    }
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+    free(record);
 
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_CLIENT_ID_STORAGE_KEY, mqtt_client_id, &client_id_len);
-    ESP_ERROR_CHECK(err);
+    return err;
+}
 
-    client_id_length = strlen(mqtt_client_id);
+static bool internal_storage_check_preserved(enum internal_storage_field_id_t id){
+    return (storage_config.preserved & INTERNAL_STORAGE_FIELD_BIT(id)) != 0;
+}
 
-    strncpy(client_id, mqtt_client_id, client_id_length);
-    client_id[client_id_length] = '\0';
+static esp_err_t internal_storage_read_str(enum internal_storage_field_id_t id, char *value){
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
 
-    nvs_close(nvs_handle);
+    xSemaphoreTake(storage_config_mutex, portMAX_DELAY);
+    if(internal_storage_check_preserved(id)){
+        strcpy(value, (const char *)&storage_config + storage_legacy_fields[id].offset);
+        err = ESP_OK;
+    }
+    xSemaphoreGive(storage_config_mutex);
 
-    return ESP_OK;
+    return err;
 }
 
-bool internal_storage_check_mqtt_client_id_preserved(void){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_client_id_preserved = false;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+static void internal_storage_fail(struct internal_storage_transaction_t *transaction, esp_err_t err){
+    if(transaction->err == ESP_OK){
+        transaction->err = err;
     }
+}
 
-    ESP_ERROR_CHECK(err);
+static void internal_storage_set_str(struct internal_storage_transaction_t *transaction, enum internal_storage_field_id_t id, const char *value){
+    const struct internal_storage_legacy_field_t *field = &storage_legacy_fields[id];
 
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
+    if(strlen(value) >= field->size){
+        ESP_LOGE(TAG, "Value for %s too long", field->key);
+        internal_storage_fail(transaction, ESP_ERR_INVALID_SIZE);
+        return;
+    }
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+    strcpy((char *)&transaction->record.config + field->offset, value);
+    transaction->record.config.preserved |= INTERNAL_STORAGE_FIELD_BIT(id);
+    transaction->changed = true;
+}
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_CLIENT_ID_STORAGE_KEY) == 0){
-            mqtt_client_id_preserved = true;
-            break;
+static struct internal_storage_setting_t *internal_storage_setting_find(struct internal_storage_config_t *config, const char *key){
+    for(int i = 0; i < INTERNAL_STORAGE_MAX_SETTINGS; i++){
+        if(strncmp(config->settings[i].key, key, INTERNAL_STORAGE_SETTING_KEY_LEN) == 0){
+            return &config->settings[i];
         }
-
-        err = nvs_entry_next(&nvs_it);
     }
-
-    nvs_release_iterator(nvs_it);
-
-    nvs_close(nvs_handle);
-
-    return mqtt_client_id_preserved;
+    return NULL;
 }
 
-esp_err_t internal_storage_save_mqtt_broker(const char *broker){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+#if CONFIG_HOMEPOST_STORAGE_BENCHMARK
+static int internal_storage_benchmark_compare(const void *a, const void *b){
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
 
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_BROKER_STORAGE_KEY, broker);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+    return (left > right) - (left < right);
+}
 
-    nvs_close(nvs_handle);
+static uint32_t internal_storage_benchmark_percentile(uint32_t *samples, uint32_t count, uint32_t percent){
+    qsort(samples, count, sizeof(samples[0]), internal_storage_benchmark_compare);
+    return samples[count * percent / 100];
+}
 
-    return ESP_OK;
+/*
+ * Checks and gets every key the way boot and GET /config do, each call timed
+ * on its own.
+ */
+static uint32_t internal_storage_benchmark_read_all(uint32_t *samples){
+    char ssid[INTERNAL_STORAGE_WIFI_SSID_LEN];
+    char password[INTERNAL_STORAGE_WIFI_PASSWORD_LEN];
+    char value[INTERNAL_STORAGE_MQTT_BROKER_LEN];
+    uint16_t port;
+    uint32_t setting;
+    uint32_t count = 0;
+    int64_t started;
+
+#define INTERNAL_STORAGE_BENCHMARK_CALL(call) \
+    started = esp_timer_get_time(); \
+    call; \
+    samples[count++] = esp_timer_get_time() - started
+
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_wifi_credentials_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_wifi_credentials(ssid, password));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_client_id_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_client_id(value));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_broker_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_broker(value));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_port_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_port(&port));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_username_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_username(value));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_password_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_password(value));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_check_mqtt_topic_preserved());
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_mqtt_topic(value));
+    INTERNAL_STORAGE_BENCHMARK_CALL(internal_storage_get_setting(INTERNAL_STORAGE_BENCHMARK_SETTING, &setting));
+
+#undef INTERNAL_STORAGE_BENCHMARK_CALL
+
+    return count;
 }
 
-esp_err_t internal_storage_get_mqtt_broker(char *broker){
-    nvs_handle_t nvs_handle;
+/*
+ * Saves every stored key with the value it already has, as a config page
+ * submit without changes does. Keys that are not stored stay that way.
+ */
+static esp_err_t internal_storage_benchmark_save_all(void){
+    struct internal_storage_transaction_t *transaction;
+    struct internal_storage_config_t config;
     esp_err_t err;
-    size_t broker_length;
-    char mqtt_broker[100] = {0};
-    size_t broker_len = (sizeof(mqtt_broker) / sizeof(mqtt_broker[0]));
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
 
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_BROKER_STORAGE_KEY, mqtt_broker, &broker_len);
-    ESP_ERROR_CHECK(err);
-
-    broker_length = strlen(mqtt_broker);
-
-    strncpy(broker, mqtt_broker, broker_length);
-    broker[broker_length] = '\0';
+    err = internal_storage_begin(&transaction);
+    if(err != ESP_OK){
+        return err;
+    }
 
-    nvs_close(nvs_handle);
+    config = transaction->record.config;
+    if(internal_storage_check_wifi_credentials_preserved()){
+        internal_storage_set_wifi_credentials(transaction, config.wifi_ssid, config.wifi_password);
+    }
+    for(enum internal_storage_field_id_t id = INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID; id < INTERNAL_STORAGE_FIELD_COUNT; id++){
+        if(!internal_storage_check_preserved(id)){
+            continue;
+        }
+        if(id == INTERNAL_STORAGE_FIELD_MQTT_PORT){
+            internal_storage_set_mqtt_port(transaction, config.mqtt_port);
+        } else {
+            internal_storage_set_str(transaction, id, (const char *)&config + storage_legacy_fields[id].offset);
+        }
+    }
 
-    return ESP_OK;
+    return internal_storage_commit(transaction);
 }
 
-bool internal_storage_check_mqtt_broker_preserved(void){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_broker_preserved = false;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+/*
+ * Repeats a boot plus config page workload: read every key twice (boot and
+ * GET /config), then save them all back. Every tenth round also changes a
+ * setting, so part of the saves reach flash. Runs on a device that was
+ * never configured too, the keys are then read as not found.
+ */
+static void internal_storage_benchmark(void){
+    uint32_t reads_per_round = INTERNAL_STORAGE_BENCHMARK_READS_PER_ROUND;
+    uint32_t *read_us = malloc(INTERNAL_STORAGE_BENCHMARK_ROUNDS * reads_per_round * sizeof(uint32_t));
+    uint32_t *save_us = malloc(INTERNAL_STORAGE_BENCHMARK_ROUNDS * 2 * sizeof(uint32_t));
+    uint32_t reads = 0;
+    uint32_t saves = 0;
+    uint32_t failures = 0;
+    uint32_t nvs_reads = storage_nvs_reads;
+    uint32_t nvs_writes = storage_nvs_writes;
+    int64_t started;
+    int64_t call_started;
+    int64_t duration_us;
+    uint32_t read_p50_us, read_p99_us;
+    uint32_t save_p50_us, save_p99_us;
+
+    if(read_us == NULL || save_us == NULL){
+        ESP_LOGE(TAG, "Storage benchmark not run, no memory for latency samples");
+        free(read_us);
+        free(save_us);
+        return;
     }
 
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
+    started = esp_timer_get_time();
+    for(uint32_t round = 0; round < INTERNAL_STORAGE_BENCHMARK_ROUNDS; round++){
+        reads += internal_storage_benchmark_read_all(&read_us[reads]);
+        reads += internal_storage_benchmark_read_all(&read_us[reads]);
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+        call_started = esp_timer_get_time();
+        failures += internal_storage_benchmark_save_all() != ESP_OK;
+        save_us[saves++] = esp_timer_get_time() - call_started;
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_BROKER_STORAGE_KEY) == 0){
-            mqtt_broker_preserved = true;
-            break;
+        if(round % INTERNAL_STORAGE_BENCHMARK_CHANGE_EVERY == 0){
+            call_started = esp_timer_get_time();
+            failures += internal_storage_save_setting(INTERNAL_STORAGE_BENCHMARK_SETTING, round) != ESP_OK;
+            save_us[saves++] = esp_timer_get_time() - call_started;
         }
-
-        err = nvs_entry_next(&nvs_it);
     }
-
-    nvs_release_iterator(nvs_it);
-
-    nvs_close(nvs_handle);
-
-    return mqtt_broker_preserved;
+    duration_us = esp_timer_get_time() - started;
+
+    internal_storage_erase_setting(INTERNAL_STORAGE_BENCHMARK_SETTING);
+
+    ESP_LOGI(TAG, "Storage benchmark: %d rounds, %lu calls in %lld ms, %lld calls/s, %lu failed",
+             INTERNAL_STORAGE_BENCHMARK_ROUNDS, reads + saves, duration_us / 1000,
+             duration_us > 0 ? (int64_t)(reads + saves) * 1000000 / duration_us : 0, failures);
+    read_p50_us = internal_storage_benchmark_percentile(read_us, reads, 50);
+    read_p99_us = internal_storage_benchmark_percentile(read_us, reads, 99);
+    save_p50_us = internal_storage_benchmark_percentile(save_us, saves, 50);
+    save_p99_us = internal_storage_benchmark_percentile(save_us, saves, 99);
+    ESP_LOGI(TAG, "Check/get: %lu calls, p50 %lu us, p99 %lu us; save: %lu calls, p50 %lu us, p99 %lu us, max %lu us",
+             reads, read_p50_us, read_p99_us, saves, save_p50_us, save_p99_us, save_us[saves - 1]);
+    ESP_LOGI(TAG, "NVS operations issued: %lu reads, %lu writes",
+             storage_nvs_reads - nvs_reads, storage_nvs_writes - nvs_writes);
+
+    free(read_us);
+    free(save_us);
 }
+#endif
 
-esp_err_t internal_storage_save_mqtt_port(uint16_t port){
+void internal_storage_init(void){
     nvs_handle_t nvs_handle;
-    esp_err_t err;
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "Erasing NVS flash...");
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+    storage_config_mutex = xSemaphoreCreateMutex();
+    storage_write_mutex = xSemaphoreCreateMutex();
+    ESP_ERROR_CHECK(storage_config_mutex == NULL || storage_write_mutex == NULL ? ESP_ERR_NO_MEM : ESP_OK);
 
-    err = nvs_set_u16(nvs_handle, CONFIG_HOMEPOST_MQTT_PORT_STORAGE_KEY, port);
-    ESP_ERROR_CHECK(err);
+    ESP_ERROR_CHECK(nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle));
 
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+    ret = internal_storage_record_load(nvs_handle, &storage_config);
+#if CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND && ret != ESP_ERR_NO_MEM){
+        // The per-key copy is kept in sync, rebuild the record from it; runtime settings go back to their defaults
+        ESP_LOGE(TAG, "Config record unusable, restoring it from the per-key configuration: %s", esp_err_to_name(ret));
+        ret = ESP_ERR_NVS_NOT_FOUND;
+    }
+#endif
+    if(ret == ESP_ERR_NVS_NOT_FOUND){
+        ret = internal_storage_legacy_migrate(nvs_handle, &storage_config);
+    }
+    // Running out of memory this early says nothing about the record, restart instead of dropping it
+    ESP_ERROR_CHECK(ret == ESP_ERR_NO_MEM ? ret : ESP_OK);
+    if(ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND){
+        // The device comes up unconfigured and offers the setup page again
+        ESP_LOGE(TAG, "Config record unusable, starting unconfigured: %s", esp_err_to_name(ret));
+        memset(&storage_config, 0, sizeof(storage_config));
+    }
 
     nvs_close(nvs_handle);
 
-    return ESP_OK;
-}
-
-esp_err_t internal_storage_get_mqtt_port(uint16_t *port){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    uint16_t mqtt_port;
+    ESP_LOGI(TAG, "Internal storage initialized");
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+#if CONFIG_HOMEPOST_STORAGE_BENCHMARK
+    internal_storage_benchmark();
+#endif
+}
 
-    err = nvs_get_u16(nvs_handle, CONFIG_HOMEPOST_MQTT_PORT_STORAGE_KEY, &mqtt_port);
-    ESP_ERROR_CHECK(err);
+esp_err_t internal_storage_begin(struct internal_storage_transaction_t **transaction){
+    xSemaphoreTake(storage_write_mutex, portMAX_DELAY);
 
-    *port = mqtt_port;
+    *transaction = calloc(1, sizeof(**transaction));
+    if(*transaction == NULL){
+        xSemaphoreGive(storage_write_mutex);
+        return ESP_ERR_NO_MEM;
+    }
 
-    nvs_close(nvs_handle);
+    // Only commits change the config, and they cannot run while this one is open
+    (*transaction)->record.config = storage_config;
 
     return ESP_OK;
 }
 
-bool internal_storage_check_mqtt_port_preserved(void){
+esp_err_t internal_storage_commit(struct internal_storage_transaction_t *transaction){
     nvs_handle_t nvs_handle;
-    esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_port_preserved = false;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    esp_err_t err = transaction->err;
+
+    if(err == ESP_OK && transaction->changed){
+        err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+        if(err == ESP_OK){
+            err = internal_storage_record_write(nvs_handle, &transaction->record);
+#if CONFIG_HOMEPOST_STORAGE_LEGACY_KEYS
+            // The change is in the record already, a stale per-key copy only matters after a downgrade
+            if(err == ESP_OK && internal_storage_legacy_write(nvs_handle, &transaction->record.config) != ESP_OK){
+                ESP_LOGW(TAG, "Failed to update the per-key configuration");
+            }
+#endif
+            nvs_close(nvs_handle);
+        }
 
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+        if(err == ESP_OK){
+            xSemaphoreTake(storage_config_mutex, portMAX_DELAY);
+            storage_config = transaction->record.config;
+            xSemaphoreGive(storage_config_mutex);
+        } else {
+            ESP_LOGE(TAG, "Failed to commit configuration: %s", esp_err_to_name(err));
+        }
     }
 
-    ESP_ERROR_CHECK(err);
+    free(transaction);
+    xSemaphoreGive(storage_write_mutex);
 
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_U16, &nvs_it);
+    return err;
+}
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+bool internal_storage_check_wifi_credentials_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS);
+}
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_PORT_STORAGE_KEY) == 0){
-            mqtt_port_preserved = true;
-            break;
-        }
+void internal_storage_set_wifi_credentials(struct internal_storage_transaction_t *transaction, const char *ssid, const char *password){
+    struct internal_storage_config_t *config = &transaction->record.config;
 
-        err = nvs_entry_next(&nvs_it);
+    if(strlen(ssid) >= sizeof(config->wifi_ssid) || strlen(password) >= sizeof(config->wifi_password)){
+        ESP_LOGE(TAG, "SSID or password too long");
+        internal_storage_fail(transaction, ESP_ERR_INVALID_SIZE);
+        return;
     }
 
-    nvs_release_iterator(nvs_it);
+    strcpy(config->wifi_ssid, ssid);
+    strcpy(config->wifi_password, password);
+    config->preserved |= INTERNAL_STORAGE_FIELD_BIT(INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS);
+    transaction->changed = true;
+}
 
-    nvs_close(nvs_handle);
+esp_err_t internal_storage_get_wifi_credentials(char *ssid, char *password){
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    xSemaphoreTake(storage_config_mutex, portMAX_DELAY);
+    if(internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS)){
+        memset(ssid, 0, 32);
+        memset(password, 0, 64);
+        strcpy(ssid, storage_config.wifi_ssid);
+        strcpy(password, storage_config.wifi_password);
+        err = ESP_OK;
+    }
+    xSemaphoreGive(storage_config_mutex);
 
-    return mqtt_port_preserved;
+    return err;
 }
 
-esp_err_t internal_storage_save_mqtt_username(const char *username){
-    nvs_handle_t nvs_handle;
+esp_err_t internal_storage_erase_wifi_credentials(void){
+    struct internal_storage_transaction_t *transaction;
     esp_err_t err;
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_USERNAME_STORAGE_KEY, username);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+    err = internal_storage_begin(&transaction);
+    if(err != ESP_OK){
+        return err;
+    }
 
-    nvs_close(nvs_handle);
+    memset(transaction->record.config.wifi_ssid, 0, sizeof(transaction->record.config.wifi_ssid));
+    memset(transaction->record.config.wifi_password, 0, sizeof(transaction->record.config.wifi_password));
+    transaction->record.config.preserved &= ~INTERNAL_STORAGE_FIELD_BIT(INTERNAL_STORAGE_FIELD_WIFI_CREDENTIALS);
+    transaction->changed = true;
 
-    return ESP_OK;
+    return internal_storage_commit(transaction);
 }
 
-esp_err_t internal_storage_get_mqtt_username(char *username){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    size_t username_length;
-    char mqtt_username[32] = {0};
-    size_t username_len = (sizeof(mqtt_username) / sizeof(mqtt_username[0]));
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+void internal_storage_set_mqtt_client_id(struct internal_storage_transaction_t *transaction, const char *client_id){
+    internal_storage_set_str(transaction, INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID, client_id);
+}
 
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_USERNAME_STORAGE_KEY, mqtt_username, &username_len);
-    ESP_ERROR_CHECK(err);
+esp_err_t internal_storage_get_mqtt_client_id(char *client_id){
+    return internal_storage_read_str(INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID, client_id);
+}
 
-    username_length = strlen(mqtt_username);
+bool internal_storage_check_mqtt_client_id_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_CLIENT_ID);
+}
 
-    strncpy(username, mqtt_username, username_length);
-    username[username_length] = '\0';
+void internal_storage_set_mqtt_broker(struct internal_storage_transaction_t *transaction, const char *broker){
+    internal_storage_set_str(transaction, INTERNAL_STORAGE_FIELD_MQTT_BROKER, broker);
+}
 
-    nvs_close(nvs_handle);
+esp_err_t internal_storage_get_mqtt_broker(char *broker){
+    return internal_storage_read_str(INTERNAL_STORAGE_FIELD_MQTT_BROKER, broker);
+}
 
-    return ESP_OK;
+bool internal_storage_check_mqtt_broker_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_BROKER);
 }
 
-bool internal_storage_check_mqtt_username_preserved(void){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_username_preserved = false;
+void internal_storage_set_mqtt_port(struct internal_storage_transaction_t *transaction, uint16_t port){
+    transaction->record.config.mqtt_port = port;
+    transaction->record.config.preserved |= INTERNAL_STORAGE_FIELD_BIT(INTERNAL_STORAGE_FIELD_MQTT_PORT);
+    transaction->changed = true;
+}
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+esp_err_t internal_storage_get_mqtt_port(uint16_t *port){
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
 
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+    xSemaphoreTake(storage_config_mutex, portMAX_DELAY);
+    if(internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_PORT)){
+        *port = storage_config.mqtt_port;
+        err = ESP_OK;
     }
+    xSemaphoreGive(storage_config_mutex);
 
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
-
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
-
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_USERNAME_STORAGE_KEY) == 0){
-            mqtt_username_preserved = true;
-            break;
-        }
+    return err;
+}
 
-        err = nvs_entry_next(&nvs_it);
-    }
+bool internal_storage_check_mqtt_port_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_PORT);
+}
 
-    nvs_release_iterator(nvs_it);
+void internal_storage_set_mqtt_username(struct internal_storage_transaction_t *transaction, const char *username){
+    internal_storage_set_str(transaction, INTERNAL_STORAGE_FIELD_MQTT_USERNAME, username);
+}
 
-    nvs_close(nvs_handle);
+esp_err_t internal_storage_get_mqtt_username(char *username){
+    return internal_storage_read_str(INTERNAL_STORAGE_FIELD_MQTT_USERNAME, username);
+}
 
-    return mqtt_username_preserved;
+bool internal_storage_check_mqtt_username_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_USERNAME);
 }
 
-esp_err_t internal_storage_save_mqtt_password(const char *password){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+void internal_storage_set_mqtt_password(struct internal_storage_transaction_t *transaction, const char *password){
+    internal_storage_set_str(transaction, INTERNAL_STORAGE_FIELD_MQTT_PASSWORD, password);
+}
 
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
+esp_err_t internal_storage_get_mqtt_password(char *password){
+    return internal_storage_read_str(INTERNAL_STORAGE_FIELD_MQTT_PASSWORD, password);
+}
 
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_PASSWORD_STORAGE_KEY, password);
-    ESP_ERROR_CHECK(err);
+bool internal_storage_check_mqtt_password_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_PASSWORD);
+}
 
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+void internal_storage_set_mqtt_topic(struct internal_storage_transaction_t *transaction, const char *topic){
+    internal_storage_set_str(transaction, INTERNAL_STORAGE_FIELD_MQTT_TOPIC, topic);
+}
 
-    nvs_close(nvs_handle);
+esp_err_t internal_storage_get_mqtt_topic(char *topic){
+    return internal_storage_read_str(INTERNAL_STORAGE_FIELD_MQTT_TOPIC, topic);
+}
 
-    return ESP_OK;
+bool internal_storage_check_mqtt_topic_preserved(void){
+    return internal_storage_check_preserved(INTERNAL_STORAGE_FIELD_MQTT_TOPIC);
 }
 
-esp_err_t internal_storage_get_mqtt_password(char *password){
-    nvs_handle_t nvs_handle;
+esp_err_t internal_storage_save_setting(const char *key, uint32_t value){
+    struct internal_storage_transaction_t *transaction;
+    struct internal_storage_setting_t *setting;
     esp_err_t err;
-    size_t password_length;
-    char mqtt_password[64] = {0};
-    size_t password_len = (sizeof(mqtt_password) / sizeof(mqtt_password[0]));
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
 
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_PASSWORD_STORAGE_KEY, mqtt_password, &password_len);
-    ESP_ERROR_CHECK(err);
+    if(strlen(key) >= INTERNAL_STORAGE_SETTING_KEY_LEN){
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
 
-    password_length = strlen(mqtt_password);
+    err = internal_storage_begin(&transaction);
+    if(err != ESP_OK){
+        return err;
+    }
 
-    strncpy(password, mqtt_password, password_length);
-    password[password_length] = '\0';
+    setting = internal_storage_setting_find(&transaction->record.config, key);
+    if(setting == NULL){
+        setting = internal_storage_setting_find(&transaction->record.config, "");
+    }
 
-    nvs_close(nvs_handle);
+    if(setting == NULL){
+        ESP_LOGE(TAG, "No room to store setting %s", key);
+        internal_storage_fail(transaction, ESP_ERR_NVS_NOT_ENOUGH_SPACE);
+    } else {
+        strcpy(setting->key, key);
+        setting->value = value;
+        transaction->changed = true;
+    }
 
-    return ESP_OK;
+    return internal_storage_commit(transaction);
 }
 
-bool internal_storage_check_mqtt_password_preserved(void){
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_password_preserved = false;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+esp_err_t internal_storage_get_setting(const char *key, uint32_t *value){
+    struct internal_storage_setting_t *setting;
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
 
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+    if(key[0] == '\0'){
+        return err;
     }
 
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
+    xSemaphoreTake(storage_config_mutex, portMAX_DELAY);
+    setting = internal_storage_setting_find(&storage_config, key);
+    if(setting != NULL){
+        *value = setting->value;
+        err = ESP_OK;
+    }
+    xSemaphoreGive(storage_config_mutex);
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+    return err;
+}
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_PASSWORD_STORAGE_KEY) == 0){
-            mqtt_password_preserved = true;
-            break;
-        }
+esp_err_t internal_storage_erase_setting(const char *key){
+    struct internal_storage_transaction_t *transaction;
+    struct internal_storage_setting_t *setting;
+    esp_err_t err;
 
-        err = nvs_entry_next(&nvs_it);
+    if(key[0] == '\0'){
+        return ESP_OK;
     }
 
-    nvs_release_iterator(nvs_it);
+    err = internal_storage_begin(&transaction);
+    if(err != ESP_OK){
+        return err;
+    }
 
-    nvs_close(nvs_handle);
+    setting = internal_storage_setting_find(&transaction->record.config, key);
+    if(setting != NULL){
+        memset(setting, 0, sizeof(*setting));
+        transaction->changed = true;
+    }
 
-    return mqtt_password_preserved;
+    return internal_storage_commit(transaction);
 }
 
-esp_err_t internal_storage_save_mqtt_topic(const char *topic){
+esp_err_t internal_storage_save_mqtt_ca_cert(const char *cert){
     nvs_handle_t nvs_handle;
     esp_err_t err;
 
     err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_TOPIC_STORAGE_KEY, topic);
-    ESP_ERROR_CHECK(err);
+    if(err != ESP_OK){
+        ESP_LOGE(TAG, "Failed to open storage: %s", esp_err_to_name(err));
+        return err;
+    }
 
-    err = nvs_commit(nvs_handle);
-    ESP_ERROR_CHECK(err);
+    if(strlen(cert) == 0){
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_erase_key(nvs_handle, CONFIG_HOMEPOST_MQTT_CA_CERT_STORAGE_KEY));
+        if(err == ESP_ERR_NVS_NOT_FOUND){
+            err = ESP_OK;
+        }
+    } else {
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_str(nvs_handle, CONFIG_HOMEPOST_MQTT_CA_CERT_STORAGE_KEY, cert));
+    }
+    if(err == ESP_OK){
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_commit(nvs_handle));
+    }
 
     nvs_close(nvs_handle);
 
-    return ESP_OK;
+    return err;
 }
 
-esp_err_t internal_storage_get_mqtt_topic(char *topic){
+esp_err_t internal_storage_get_mqtt_ca_cert(char **cert, size_t *cert_len){
     nvs_handle_t nvs_handle;
     esp_err_t err;
-    size_t topic_length;
-    char mqtt_topic[64] = {0};
-    size_t topic_len = (sizeof(mqtt_topic) / sizeof(mqtt_topic[0]));
+    size_t length = 0;
+    char *buffer;
 
     err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
-    ESP_ERROR_CHECK(err);
-
-    err = nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_TOPIC_STORAGE_KEY, mqtt_topic, &topic_len);
-    ESP_ERROR_CHECK(err);
+    if(err != ESP_OK){
+        return err;
+    }
 
-    topic_length = strlen(mqtt_topic);
+    err = INTERNAL_STORAGE_NVS_READ(nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_CA_CERT_STORAGE_KEY, NULL, &length));
+    if(err != ESP_OK){
+        nvs_close(nvs_handle);
+        return err;
+    }
 
-    strncpy(topic, mqtt_topic, topic_length);
-    topic[topic_length] = '\0';
+    buffer = malloc(length);
+    if(buffer == NULL){
+        nvs_close(nvs_handle);
+        return ESP_ERR_NO_MEM;
+    }
 
+    err = INTERNAL_STORAGE_NVS_READ(nvs_get_str(nvs_handle, CONFIG_HOMEPOST_MQTT_CA_CERT_STORAGE_KEY, buffer, &length));
     nvs_close(nvs_handle);
+    if(err != ESP_OK){
+        free(buffer);
+        return err;
+    }
+
+    *cert = buffer;
+    *cert_len = strlen(buffer);
 
     return ESP_OK;
 }
 
-bool internal_storage_check_mqtt_topic_preserved(void){
+esp_err_t internal_storage_save_dose_counts(uint64_t counts){
     nvs_handle_t nvs_handle;
     esp_err_t err;
-    nvs_iterator_t nvs_it = NULL;
-    bool mqtt_topic_preserved = false;
-
-    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
 
-    if(err == ESP_ERR_NVS_NOT_FOUND){
-        return false;
+    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if(err != ESP_OK){
+        return err;
     }
 
-    ESP_ERROR_CHECK(err);
+    err = INTERNAL_STORAGE_NVS_WRITE(nvs_set_u64(nvs_handle, CONFIG_HOMEPOST_DOSE_STORAGE_KEY, counts));
+    if(err == ESP_OK){
+        err = INTERNAL_STORAGE_NVS_WRITE(nvs_commit(nvs_handle));
+    }
 
-    err = nvs_entry_find_in_handle(nvs_handle, NVS_TYPE_STR, &nvs_it);
+    nvs_close(nvs_handle);
 
-    while(err == ESP_OK){
-        nvs_entry_info_t nvs_info;
-        nvs_entry_info(nvs_it, &nvs_info);
+    return err;
+}
 
-        if(strcmp(nvs_info.key, CONFIG_HOMEPOST_MQTT_TOPIC_STORAGE_KEY) == 0){
-            mqtt_topic_preserved = true;
-            break;
-        }
+esp_err_t internal_storage_get_dose_counts(uint64_t *counts){
+    nvs_handle_t nvs_handle;
+    esp_err_t err;
 
-        err = nvs_entry_next(&nvs_it);
+    err = nvs_open(INTERNAL_STORAGE_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if(err != ESP_OK){
+        return err;
     }
 
-    nvs_release_iterator(nvs_it);
-
+    err = INTERNAL_STORAGE_NVS_READ(nvs_get_u64(nvs_handle, CONFIG_HOMEPOST_DOSE_STORAGE_KEY, counts));
     nvs_close(nvs_handle);
 
-    return mqtt_topic_preserved;
-}
\ No newline at end of file
+    return err;
+}
@@ -5,13 +5,30 @@
 #include "http_server.h"
 #include "geiger_counter.h"
 #include "htu21_sensor.h"
+#include "i2c_bus.h"
+#include "sensor_registry.h"
+#include "sensor_mock.h"
+#include "mqtt_command.h"
 #include "esp_log.h"
 #include <esp_timer.h>
+#include <esp_netif_sntp.h>
 
 #if CONFIG_HOMEPOST_OTA_ENABLED
 #include "ota_update.h"
 #endif
 
+#if CONFIG_HOMEPOST_MQTT_CBOR_BENCHMARK
+#include "cbor_encoder.h"
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+#include "mqtt_benchmark.h"
+#endif
+
+#if CONFIG_HOMEPOST_SENSOR_LOG_ENABLED
+#include "sensor_log.h"
+#endif
+
 static void wifi_reconnection_timer_cb(void *arg);
 
 static esp_timer_handle_t wifi_reconnection_timer;
@@ -40,8 +57,16 @@ void app_main(void)
     bool connected_to_ap = false;
     internal_storage_init();
 
+#if CONFIG_HOMEPOST_MQTT_CBOR_BENCHMARK
+    cbor_encoder_run_benchmark();
+#endif
+
     wifi_init();
 
+    // Clock for telemetry timestamps, synced in the background once STA is up
+    esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_HOMEPOST_SNTP_SERVER);
+    esp_netif_sntp_init(&sntp_config);
+
     if(internal_storage_check_wifi_credentials_preserved()){
         connected_to_ap = wifi_connect_sta(false);
         if (!connected_to_ap){
@@ -62,10 +87,28 @@ void app_main(void)
     http_server_init();
     http_server_start();
 
+    // Registered before the stored settings, which change the sensor periods
+    sensor_registry_register(&geiger_counter_driver);
+    sensor_registry_register(&htu21_sensor_driver);
+#if CONFIG_HOMEPOST_SENSOR_MOCK
+    sensor_registry_register(&sensor_mock_driver);
+#endif
+
+    // Settings changed over MQTT survive a reboot
+    mqtt_command_load_settings();
+
     tracker_scanner_start_task();
     mqtt_connection_start_task();
-    geiger_counter_start();
-    htu21_sensor_start();
+#if CONFIG_HOMEPOST_SENSOR_LOG_ENABLED
+    sensor_log_init();
+#endif
+    // Drivers on the I2C bus fail their init and are not sampled without it
+    i2c_bus_init();
+    sensor_registry_start();
+
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+    mqtt_benchmark_start();
+#endif
 
 #if CONFIG_HOMEPOST_OTA_ENABLED
     ota_update_start_task();
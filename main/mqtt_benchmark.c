@@ -0,0 +1,188 @@
+#include "mqtt_benchmark.h"
+
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+#include "mqtt_connection.h"
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define MQTT_BENCHMARK_TASK_NAME                "mqtt_bench"
+#define MQTT_BENCHMARK_PRODUCER_TASK_NAME       "mqtt_bench_prod"
+#define MQTT_BENCHMARK_STACK_SIZE               3072
+#define MQTT_BENCHMARK_PRODUCER_STACK_SIZE      2560
+#define MQTT_BENCHMARK_TASK_PRIORITY            5
+#define MQTT_BENCHMARK_CONNECT_TIMEOUT          pdMS_TO_TICKS(60000)
+#define MQTT_BENCHMARK_DRAIN_TIME               pdMS_TO_TICKS(CONFIG_HOMEPOST_MQTT_INFLIGHT_TIMEOUT_MS)
+#define MQTT_BENCHMARK_POLL_INTERVAL            pdMS_TO_TICKS(100)
+#define MQTT_BENCHMARK_MAX_SAMPLES              2048
+#define MQTT_BENCHMARK_TIMESTAMP_PREFIX         "{\"t\":"
+
+static const char *TAG = __FILE__;
+
+static volatile bool benchmark_running = false;
+static volatile uint32_t benchmark_producers_active = 0;
+static uint32_t benchmark_enqueued = 0;
+static uint32_t benchmark_failures = 0;
+
+// Written by the publish loop only, read once the producers have stopped
+static uint32_t *benchmark_latency_us = NULL;
+static volatile uint32_t benchmark_samples = 0;
+static volatile uint32_t benchmark_acked = 0;
+
+static int mqtt_benchmark_compare(const void *a, const void *b){
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+static esp_err_t mqtt_benchmark_enqueue(uint32_t sequence){
+    struct mqtt_publish_queue_reservation_t reservation;
+    esp_err_t err;
+    int len;
+
+    err = mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY, mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_BENCHMARK),
+                                          CONFIG_HOMEPOST_MQTT_BENCHMARK_PAYLOAD_BYTES + 1, 1, &reservation);
+    if(err != ESP_OK){
+        return err;
+    }
+
+    // The enqueue time leads the payload so the ack side can read it back without a parser
+    len = snprintf(reservation.payload, reservation.payload_size, MQTT_BENCHMARK_TIMESTAMP_PREFIX "%lld,\"seq\":%lu,\"pad\":\"",
+                   esp_timer_get_time(), sequence);
+    while(len < CONFIG_HOMEPOST_MQTT_BENCHMARK_PAYLOAD_BYTES - 2){
+        reservation.payload[len++] = 'x';
+    }
+    len += snprintf(reservation.payload + len, reservation.payload_size - len, "\"}");
+
+    return mqtt_connection_commit_message(&reservation, len);
+}
+
+/*
+ * Enqueues as many messages as are due at the configured rate on every
+ * tick, so rates above the tick rate need no finer timer.
+ */
+static void mqtt_benchmark_producer_task(void *arg){
+    uint32_t producer = (uintptr_t)arg;
+    int64_t started = esp_timer_get_time();
+    uint64_t offered = 0;
+    uint64_t due;
+
+    while(benchmark_running){
+        due = (uint64_t)(esp_timer_get_time() - started) * CONFIG_HOMEPOST_MQTT_BENCHMARK_RATE / 1000000;
+        while(offered < due && benchmark_running){
+            if(mqtt_benchmark_enqueue(producer << 24 | (uint32_t)offered) == ESP_OK){
+                __atomic_fetch_add(&benchmark_enqueued, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_fetch_add(&benchmark_failures, 1, __ATOMIC_RELAXED);
+            }
+            offered++;
+        }
+        vTaskDelay(1);
+    }
+
+    __atomic_fetch_sub(&benchmark_producers_active, 1, __ATOMIC_RELAXED);
+    vTaskDelete(NULL);
+}
+
+static void mqtt_benchmark_report(uint32_t duration_ms, uint32_t acked, size_t heap_before, uint32_t *latency_us){
+    struct mqtt_publish_queue_stats_t queue_stats;
+    uint32_t samples = benchmark_samples;
+    uint32_t offered = benchmark_enqueued + benchmark_failures;
+
+    mqtt_connection_get_queue_stats(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY, &queue_stats);
+
+    ESP_LOGI(TAG, "Benchmark: %d producers x %d msg/s, %d byte payloads, %lu ms",
+             CONFIG_HOMEPOST_MQTT_BENCHMARK_PRODUCERS, CONFIG_HOMEPOST_MQTT_BENCHMARK_RATE,
+             CONFIG_HOMEPOST_MQTT_BENCHMARK_PAYLOAD_BYTES, duration_ms);
+    ESP_LOGI(TAG, "Enqueued %lu of %lu, %lu failed (queue full), %lu acked, %lu msg/s sustained",
+             benchmark_enqueued, offered, benchmark_failures, acked, duration_ms > 0 ? acked * 1000 / duration_ms : 0);
+
+    if(samples > 0){
+        qsort(latency_us, samples, sizeof(latency_us[0]), mqtt_benchmark_compare);
+        ESP_LOGI(TAG, "Enqueue to PUBACK over %lu messages: p50 %lu us, p99 %lu us, max %lu us",
+                 samples, latency_us[samples / 2], latency_us[samples * 99 / 100], latency_us[samples - 1]);
+    }
+
+    ESP_LOGI(TAG, "Heap: %u free before, %lu free after, %lu lowest since boot; queue high water %u of %u bytes",
+             heap_before, esp_get_free_heap_size(), esp_get_minimum_free_heap_size(),
+             queue_stats.used_high_water, queue_stats.capacity);
+}
+
+static void mqtt_benchmark_task(void *arg){
+    TickType_t started = xTaskGetTickCount();
+    size_t heap_before;
+    uint32_t *samples;
+    uint32_t acked;
+    uint32_t duration_ms;
+
+    while(!mqtt_connection_is_connected()){
+        if(xTaskGetTickCount() - started > MQTT_BENCHMARK_CONNECT_TIMEOUT){
+            ESP_LOGE(TAG, "Benchmark not run, MQTT broker not connected");
+            vTaskDelete(NULL);
+        }
+        vTaskDelay(MQTT_BENCHMARK_POLL_INTERVAL);
+    }
+
+    benchmark_latency_us = malloc(MQTT_BENCHMARK_MAX_SAMPLES * sizeof(benchmark_latency_us[0]));
+    if(benchmark_latency_us == NULL){
+        ESP_LOGE(TAG, "Benchmark not run, no memory for latency samples");
+        vTaskDelete(NULL);
+    }
+
+    heap_before = esp_get_free_heap_size();
+    ESP_LOGI(TAG, "Benchmark started");
+
+    benchmark_running = true;
+    started = xTaskGetTickCount();
+    for(uint32_t i = 0; i < CONFIG_HOMEPOST_MQTT_BENCHMARK_PRODUCERS; i++){
+        if(xTaskCreate(mqtt_benchmark_producer_task, MQTT_BENCHMARK_PRODUCER_TASK_NAME, MQTT_BENCHMARK_PRODUCER_STACK_SIZE,
+                       (void *)(uintptr_t)i, MQTT_BENCHMARK_TASK_PRIORITY, NULL) == pdPASS){
+            __atomic_fetch_add(&benchmark_producers_active, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_HOMEPOST_MQTT_BENCHMARK_DURATION_S * 1000));
+    benchmark_running = false;
+    acked = benchmark_acked;
+    duration_ms = pdTICKS_TO_MS(xTaskGetTickCount() - started);
+
+    while(benchmark_producers_active > 0){
+        vTaskDelay(MQTT_BENCHMARK_POLL_INTERVAL);
+    }
+    // Let the messages still in flight collect their latency samples
+    vTaskDelay(MQTT_BENCHMARK_DRAIN_TIME);
+
+    // Late acks stop recording before the samples are sorted
+    samples = benchmark_latency_us;
+    benchmark_latency_us = NULL;
+    vTaskDelay(MQTT_BENCHMARK_POLL_INTERVAL);
+
+    mqtt_benchmark_report(duration_ms, acked, heap_before, samples);
+    free(samples);
+    vTaskDelete(NULL);
+}
+
+void mqtt_benchmark_start(void){
+    xTaskCreate(mqtt_benchmark_task, MQTT_BENCHMARK_TASK_NAME, MQTT_BENCHMARK_STACK_SIZE, NULL, MQTT_BENCHMARK_TASK_PRIORITY, NULL);
+}
+
+void mqtt_benchmark_record_ack(const struct mqtt_publish_queue_item_t *item){
+    int64_t enqueued_at;
+
+    if(strncmp(item->payload, MQTT_BENCHMARK_TIMESTAMP_PREFIX, strlen(MQTT_BENCHMARK_TIMESTAMP_PREFIX)) != 0 ||
+       strcmp(item->topic, mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_BENCHMARK)) != 0){
+        return;
+    }
+
+    benchmark_acked++;
+    if(benchmark_latency_us != NULL && benchmark_samples < MQTT_BENCHMARK_MAX_SAMPLES){
+        enqueued_at = strtoll(item->payload + strlen(MQTT_BENCHMARK_TIMESTAMP_PREFIX), NULL, 10);
+        benchmark_latency_us[benchmark_samples++] = esp_timer_get_time() - enqueued_at;
+    }
+}
+#endif
@@ -0,0 +1,167 @@
+#include "mqtt_command.h"
+#include "mqtt_connection.h"
+#include "internal_storage.h"
+#include "htu21_sensor.h"
+#include "geiger_counter.h"
+#include "tracker_scanner.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <esp_log.h>
+
+/*
+ * One entry per runtime setting. The storage key names the setting in the
+ * config record (at most 15 characters) and set() applies the value to the
+ * running module; it must be safe to call before the module is started.
+ */
+struct mqtt_command_t {
+    const char *name;
+    const char *storage_key;
+    uint32_t min;
+    uint32_t max;
+    uint32_t default_value;
+    esp_err_t (*set)(uint32_t value);
+};
+
+static const char *TAG = __FILE__;
+
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+static esp_err_t mqtt_command_set_temperature_deadband(uint32_t value){
+    return mqtt_connection_set_deadband_absolute(MQTT_CONNECTION_TOPIC_TEMPERATURE, value);
+}
+
+static esp_err_t mqtt_command_set_humidity_deadband(uint32_t value){
+    return mqtt_connection_set_deadband_absolute(MQTT_CONNECTION_TOPIC_HUMIDITY, value);
+}
+
+static esp_err_t mqtt_command_set_radiation_deadband(uint32_t value){
+    return mqtt_connection_set_deadband_relative(MQTT_CONNECTION_TOPIC_RADIATION, value);
+}
+
+static esp_err_t mqtt_command_set_rssi_deadband(uint32_t value){
+    return mqtt_connection_set_deadband_absolute(MQTT_CONNECTION_TOPIC_PHONE_RSSI, value);
+}
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+static esp_err_t mqtt_command_set_event_rate(uint32_t value){
+    return mqtt_connection_set_shaper_rate(MQTT_PUBLISH_QUEUE_LANE_EVENT, value);
+}
+
+static esp_err_t mqtt_command_set_telemetry_rate(uint32_t value){
+    return mqtt_connection_set_shaper_rate(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY, value);
+}
+#endif
+
+static const struct mqtt_command_t mqtt_commands[] = {
+    { "htu21/period_ms",      "htu21_period",   1000,  86400000,   CONFIG_HOMEPOST_HTU21_TIMER_PERIOD_MS,           htu21_sensor_set_period },
+    { "geiger/period_ms",     "geiger_period",  10000, 3600000,    CONFIG_HOMEPOST_GEIGER_COUNTER_TIMER_PERIOD_MS,  geiger_counter_set_period },
+    { "scan/timeout_min",     "scan_timeout",   1,     1440,       CONFIG_HOMEPOST_SCAN_TIMEOUT_MINUTES,            tracker_scanner_set_timeout },
+    { "scan/major",           "scan_major",     0,     UINT16_MAX, CONFIG_HOMEPOST_SCAN_MAJOR_FILTER,               tracker_scanner_set_major },
+    { "scan/minor",           "scan_minor",     0,     UINT16_MAX, CONFIG_HOMEPOST_SCAN_MINOR_FILTER,               tracker_scanner_set_minor },
+#if CONFIG_HOMEPOST_MQTT_COALESCE_TELEMETRY
+    { "mqtt/coalesce",        "mqtt_coalesce",  0,     1,          1,                                               mqtt_connection_set_coalesce },
+#endif
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+    { "mqtt/heartbeat_s",     "mqtt_heartbeat", 10,    86400,      CONFIG_HOMEPOST_MQTT_HEARTBEAT_S,                mqtt_connection_set_heartbeat },
+    { "deadband/temperature", "db_temperature", 0,     100000,     CONFIG_HOMEPOST_MQTT_DEADBAND_TEMPERATURE_MILLI, mqtt_command_set_temperature_deadband },
+    { "deadband/humidity",    "db_humidity",    0,     100000,     CONFIG_HOMEPOST_MQTT_DEADBAND_HUMIDITY_MILLI,    mqtt_command_set_humidity_deadband },
+    { "deadband/radiation",   "db_radiation",   0,     100,        CONFIG_HOMEPOST_MQTT_DEADBAND_RADIATION_PERCENT, mqtt_command_set_radiation_deadband },
+    { "deadband/rssi",        "db_rssi",        0,     100000,     CONFIG_HOMEPOST_MQTT_DEADBAND_RSSI_MILLI,        mqtt_command_set_rssi_deadband },
+#endif
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+    { "shaper/event_bps",     "shaper_event",   0,     1000000,    CONFIG_HOMEPOST_MQTT_SHAPER_EVENT_RATE,          mqtt_command_set_event_rate },
+    { "shaper/telemetry_bps", "shaper_telem",   0,     1000000,    CONFIG_HOMEPOST_MQTT_SHAPER_TELEMETRY_RATE,      mqtt_command_set_telemetry_rate },
+#endif
+};
+
+static const struct mqtt_command_t *mqtt_command_find(const char *name){
+    for (int i = 0; i < sizeof(mqtt_commands) / sizeof(mqtt_commands[0]); i++) {
+        if (strcmp(mqtt_commands[i].name, name) == 0) {
+            return &mqtt_commands[i];
+        }
+    }
+    return NULL;
+}
+
+static bool mqtt_command_parse(const char *text, uint32_t *value){
+    char *end;
+
+    if (strcasecmp(text, "ON") == 0) {
+        *value = 1;
+        return true;
+    }
+    if (strcasecmp(text, "OFF") == 0) {
+        *value = 0;
+        return true;
+    }
+    if (*text < '0' || *text > '9') {
+        return false;
+    }
+
+    *value = strtoul(text, &end, 10);
+    return *end == '\0';
+}
+
+void mqtt_command_load_settings(void){
+    uint32_t value;
+
+    for (int i = 0; i < sizeof(mqtt_commands) / sizeof(mqtt_commands[0]); i++) {
+        const struct mqtt_command_t *command = &mqtt_commands[i];
+
+        if (internal_storage_get_setting(command->storage_key, &value) != ESP_OK) {
+            continue;
+        }
+        if (value < command->min || value > command->max) {
+            ESP_LOGW(TAG, "Stored %s value %lu out of range, ignoring", command->name, value);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Restoring %s = %lu", command->name, value);
+        command->set(value);
+    }
+}
+
+esp_err_t mqtt_command_dispatch(const char *name, const char *text){
+    const struct mqtt_command_t *command = mqtt_command_find(name);
+    uint32_t stored;
+    uint32_t value;
+    char echo[MQTT_COMMAND_VALUE_MAX_LEN];
+    bool restore_default;
+    esp_err_t ret;
+
+    if (command == NULL) {
+        ESP_LOGW(TAG, "Unknown command: %s", name);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    restore_default = strcasecmp(text, "default") == 0;
+    if (restore_default) {
+        value = command->default_value;
+    } else if (!mqtt_command_parse(text, &value) || value < command->min || value > command->max) {
+        ESP_LOGW(TAG, "Invalid value for %s: %s (range %lu-%lu)", name, text, command->min, command->max);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ret = command->set(value);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to apply %s: %s", name, esp_err_to_name(ret));
+        return ret;
+    }
+    ESP_LOGI(TAG, "Command %s = %lu applied", name, value);
+
+    // Retained commands come back on every reconnect, only write flash on a change
+    if (restore_default) {
+        ret = internal_storage_erase_setting(command->storage_key);
+    } else if (internal_storage_get_setting(command->storage_key, &stored) != ESP_OK || stored != value) {
+        ret = internal_storage_save_setting(command->storage_key, value);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to store %s, the value is lost on reboot: %s", name, esp_err_to_name(ret));
+    }
+
+    snprintf(echo, sizeof(echo), "%lu", value);
+    mqtt_connection_publish_state(MQTT_CONNECTION_TOPIC_SETTINGS, name, echo);
+
+    return ESP_OK;
+}
@@ -1,45 +1,219 @@
 #include "mqtt_connection.h"
 
-#define MQTT_CONNECTION_TOPIC_MAX_LEN                       64
 #define MQTT_CONNECTION_TASK_PRIORITY                       7
 #define MQTT_CONNECTION_STACK_SIZE                          3072
 #define MQTT_CONNECTION_TASK_NAME                           "mqtt_conn"
 #define MQTT_CONNECTION_CONNECTED_EVENT_BIT                 BIT0
 #define MQTT_CONNECTION_CONNECTION_ERROR_EVENT_BIT          BIT1
-#define MQTT_CONNECTION_PUBLISH_EVENT_BIT                   BIT2
+#define MQTT_CONNECTION_PROTOCOL_FALLBACK_EVENT_BIT         BIT2
+#define MQTT_CONNECTION_RECONFIGURE_EVENT_BIT               BIT3
+#define MQTT_CONNECTION_STOP_TIMEOUT                        pdMS_TO_TICKS(5000)
+#define MQTT_CONNECTION_STOP_POLL_INTERVAL                  pdMS_TO_TICKS(10)
+#define MQTT_CONNECTION_INFLIGHT_TIMEOUT                    pdMS_TO_TICKS(CONFIG_HOMEPOST_MQTT_INFLIGHT_TIMEOUT_MS)
+#define MQTT_CONNECTION_ACK_QUEUE_SIZE                      (CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW * 2)
+#define MQTT_CONNECTION_SPILL_DELAY                         pdMS_TO_TICKS(CONFIG_HOMEPOST_MQTT_OUTBOX_SPILL_DELAY_MS)
+#define MQTT_CONNECTION_OFFLINE_POLL_INTERVAL               pdMS_TO_TICKS(1000)
+#define MQTT_CONNECTION_PUBLISH_RETRY_INTERVAL              pdMS_TO_TICKS(500)
+#define MQTT_CONNECTION_METRIC_PAYLOAD_SIZE                 48
+#define MQTT_CONNECTION_BATCH_PAYLOAD_SIZE                  (40 + CONFIG_HOMEPOST_MQTT_BATCH_MAX_METRICS * 56)
+#define MQTT_CONNECTION_CLOCK_VALID_AFTER                   1704067200
+#define MQTT_CONNECTION_VERSION_PAYLOAD_SIZE                32
+#define MQTT_CONNECTION_SHAPER_OVERHEAD                     4
+#define MQTT_CONNECTION_TOPIC_ARENA_SIZE                    (MQTT_CONNECTION_TOPIC_COUNT * (MQTT_CONNECTION_TOPIC_MAX_LEN + 24))
 
-static const char *TAG = __FILE__;
+struct mqtt_connection_inflight_t {
+    struct mqtt_publish_queue_item_t item;
+    int msg_id;
+    TickType_t sent_at;
+    uint8_t retries;
+};
+
+struct mqtt_connection_topic_spec_t {
+    const char *name;
+    bool encoded;
+};
 
-QueueHandle_t mqtt_connection_message_queue = NULL;
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+struct mqtt_connection_deadband_t {
+    uint32_t absolute_milli;
+    uint32_t relative_percent;
+    bool has_sent;
+    float last_sent;
+    int64_t last_sent_us;
+};
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+/*
+ * Token bucket in bytes. A lane may send while its bucket is above zero and
+ * the message may take it below, so a message larger than the burst still
+ * goes out and the debt delays the next one.
+ */
+struct mqtt_connection_bucket_t {
+    volatile uint32_t rate;
+    uint32_t burst;
+    int32_t tokens;
+    TickType_t refilled_at;
+    bool throttled;
+    TickType_t throttled_since;
+    uint32_t throttled_ms;
+    uint32_t throttle_events;
+};
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH
+struct mqtt_connection_metric_t {
+    const char *name;
+    float value;
+    uint8_t precision;
+    int64_t uptime_ms;
+};
+#endif
+
+static const char *TAG = __FILE__;
 
 static EventGroupHandle_t mqtt_connection_event_group;
 static esp_mqtt_client_handle_t client = NULL;
 static TaskHandle_t mqtt_connection_task_handle = NULL;
 static bool mqtt_connection_task_running = false;
+static QueueHandle_t mqtt_connection_ack_queue = NULL;
+static volatile uint32_t mqtt_connection_generation = 0;
+static volatile uint32_t mqtt_connection_disconnects = 0;
+
+static struct mqtt_connection_inflight_t inflight_window[CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW];
+static uint32_t inflight_count = 0;
+static struct mqtt_connection_stats_t mqtt_connection_stats;
+
+// Topic names under the base topic, encoded ones carry the payload format suffix
+static const struct mqtt_connection_topic_spec_t topic_specs[MQTT_CONNECTION_TOPIC_COUNT] = {
+    [MQTT_CONNECTION_TOPIC_VERSION]         = { "homepost_version", false },
+    [MQTT_CONNECTION_TOPIC_PHONE_PRESENT]   = { "phone_present", true },
+    [MQTT_CONNECTION_TOPIC_PHONE_RSSI]      = { "phone_rssi", true },
+    [MQTT_CONNECTION_TOPIC_TEMPERATURE]     = { "temperature", true },
+    [MQTT_CONNECTION_TOPIC_HUMIDITY]        = { "humidity", true },
+    [MQTT_CONNECTION_TOPIC_RADIATION]       = { "radiation", true },
+    [MQTT_CONNECTION_TOPIC_DOSE]            = { "dose", true },
+    [MQTT_CONNECTION_TOPIC_TELEMETRY]       = { "telemetry", true },
+    [MQTT_CONNECTION_TOPIC_COMMAND]         = { "cmd/#", false },
+    [MQTT_CONNECTION_TOPIC_SETTINGS]        = { "settings", true },
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+    [MQTT_CONNECTION_TOPIC_BENCHMARK]       = { "benchmark", false },
+#endif
+#if CONFIG_HOMEPOST_SENSOR_MOCK
+    [MQTT_CONNECTION_TOPIC_MOCK]            = { "mock", true },
+#endif
+};
+
+/*
+ * Two arenas so a rebuild never touches the strings producers may be
+ * reading: the new table is written to the idle arena and published by
+ * switching topic_active.
+ */
+static char topic_arenas[2][MQTT_CONNECTION_TOPIC_ARENA_SIZE];
+static uint16_t topic_offsets[2][MQTT_CONNECTION_TOPIC_COUNT];
+static uint8_t topic_active = 0;
+
+#if CONFIG_HOMEPOST_MQTT_COALESCE_TELEMETRY
+static volatile bool telemetry_coalesce = true;
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+/*
+ * Outgoing topic aliases are per connection: alias N + 1 stands for topic
+ * ID N once a message carrying both has been sent. alias_limit drops to the
+ * broker's Topic Alias Maximum when the client rejects a larger alias.
+ */
+static bool mqtt5_enabled = true;
+static uint32_t mqtt5_alias_sent = 0;
+static uint16_t mqtt5_alias_limit = UINT16_MAX;
+#endif
 
-static char version_payload[32];
-static char version_topic[100];
-static struct mqtt_connection_message_t version_message = {
-    .topic = version_topic,
-    .payload = version_payload,
-    .qos = 1
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+static struct mqtt_connection_deadband_t deadbands[MQTT_CONNECTION_TOPIC_COUNT] = {
+    [MQTT_CONNECTION_TOPIC_PHONE_RSSI]      = { .absolute_milli = CONFIG_HOMEPOST_MQTT_DEADBAND_RSSI_MILLI },
+    [MQTT_CONNECTION_TOPIC_TEMPERATURE]     = { .absolute_milli = CONFIG_HOMEPOST_MQTT_DEADBAND_TEMPERATURE_MILLI },
+    [MQTT_CONNECTION_TOPIC_HUMIDITY]        = { .absolute_milli = CONFIG_HOMEPOST_MQTT_DEADBAND_HUMIDITY_MILLI },
+    [MQTT_CONNECTION_TOPIC_RADIATION]       = { .relative_percent = CONFIG_HOMEPOST_MQTT_DEADBAND_RADIATION_PERCENT },
 };
+static uint32_t deadband_heartbeat_s = CONFIG_HOMEPOST_MQTT_HEARTBEAT_S;
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+static struct mqtt_connection_bucket_t buckets[MQTT_PUBLISH_QUEUE_LANE_COUNT] = {
+    [MQTT_PUBLISH_QUEUE_LANE_EVENT] = {
+        .rate = CONFIG_HOMEPOST_MQTT_SHAPER_EVENT_RATE,
+        .burst = CONFIG_HOMEPOST_MQTT_SHAPER_EVENT_BURST,
+        .tokens = CONFIG_HOMEPOST_MQTT_SHAPER_EVENT_BURST,
+    },
+    [MQTT_PUBLISH_QUEUE_LANE_TELEMETRY] = {
+        .rate = CONFIG_HOMEPOST_MQTT_SHAPER_TELEMETRY_RATE,
+        .burst = CONFIG_HOMEPOST_MQTT_SHAPER_TELEMETRY_BURST,
+        .tokens = CONFIG_HOMEPOST_MQTT_SHAPER_TELEMETRY_BURST,
+    },
+};
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH
+static SemaphoreHandle_t batch_mutex = NULL;
+static esp_timer_handle_t batch_timer = NULL;
+static struct mqtt_connection_metric_t batch_metrics[CONFIG_HOMEPOST_MQTT_BATCH_MAX_METRICS];
+static uint32_t batch_count = 0;
+#endif
 
 static void mqtt_connection_subscribe_topics(void){
+    const char *topic = mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_COMMAND);
 
+    if(esp_mqtt_client_subscribe(client, topic, 1) < 0){
+        ESP_LOGE(TAG, "Failed to subscribe to %s", topic);
+    }
+}
+
+static void mqtt_connection_handle_data(esp_mqtt_event_handle_t event){
+    const char *command_topic = mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_COMMAND);
+    size_t prefix_len = strlen(command_topic) - 1;
+    char name[MQTT_COMMAND_NAME_MAX_LEN];
+    char value[MQTT_COMMAND_VALUE_MAX_LEN];
+    size_t name_len;
+
+    // Commands are a few bytes, a message split over several events is not one
+    if(event->current_data_offset != 0 || event->data_len != event->total_data_len){
+        return;
+    }
+    if(event->topic_len <= prefix_len || strncmp(event->topic, command_topic, prefix_len) != 0){
+        return;
+    }
+
+    name_len = event->topic_len - prefix_len;
+    if(name_len >= sizeof(name) || event->data_len >= sizeof(value)){
+        ESP_LOGW(TAG, "Ignoring oversized command on %.*s", event->topic_len, event->topic);
+        return;
+    }
+
+    memcpy(name, event->topic + prefix_len, name_len);
+    name[name_len] = '\0';
+    memcpy(value, event->data, event->data_len);
+    value[event->data_len] = '\0';
+
+    mqtt_command_dispatch(name, value);
 }
 
 static void mqtt_connection_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data){
+    esp_mqtt_event_handle_t event = event_data;
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32, base, event_id);
     switch((esp_mqtt_event_id_t)event_id){
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
             mqtt_connection_subscribe_topics();
+            mqtt_connection_generation++;
             xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT);
+            mqtt_publish_queue_wake();
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
             xEventGroupClearBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT);
+            // Auto reconnect is off, the publish loop schedules the next attempt
+            mqtt_connection_disconnects++;
+            mqtt_publish_queue_wake();
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED");
@@ -48,15 +222,29 @@ static void mqtt_connection_event_handler(void *handler_args, esp_event_base_t b
             ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED");
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED");
-            xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_PUBLISH_EVENT_BIT);
+            ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            // The publish loop owns the in-flight window, hand the ack over to it
+            if(xQueueSend(mqtt_connection_ack_queue, &event->msg_id, 0) != pdTRUE){
+                ESP_LOGW(TAG, "Ack queue full, message %d will time out", event->msg_id);
+            }
+            mqtt_publish_queue_wake();
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGD(TAG, "MQTT_EVENT_DATA");
+            mqtt_connection_handle_data(event);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGE(TAG, "MQTT_EVENT_ERROR: %d", *(int *)event_data);
             xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTION_ERROR_EVENT_BIT);
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+            if(mqtt5_enabled && event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+               (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+                (int)event->error_handle->connect_return_code == MQTT5_UNSUPPORTED_PROTOCOL_VER)){
+                // The client cannot be rebuilt from its own event handler, leave it to the publish loop
+                xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_PROTOCOL_FALLBACK_EVENT_BIT);
+                mqtt_publish_queue_wake();
+            }
+#endif
             break;
         default:
             ESP_LOGW(TAG, "Unknown event ID: %ld", event_id);
@@ -72,6 +260,7 @@ static esp_err_t mqtt_connection_start(void){
     char mqtt_password[64] = {0};
     char mqtt_client_id[64] = {0};
     char mqtt_broker_full_uri[128] = {0};
+    esp_transport_handle_t transport = NULL;
 
     mqtt_broker_connection_allowed &= internal_storage_check_mqtt_broker_preserved();
     mqtt_broker_connection_allowed &= internal_storage_check_mqtt_port_preserved();
@@ -90,7 +279,18 @@ static esp_err_t mqtt_connection_start(void){
     ESP_ERROR_CHECK(internal_storage_get_mqtt_password(mqtt_password));
     ESP_ERROR_CHECK(internal_storage_get_mqtt_client_id(mqtt_client_id));
 
+#if CONFIG_HOMEPOST_MQTT_TLS
+    snprintf(mqtt_broker_full_uri, sizeof(mqtt_broker_full_uri), "mqtts://%s", mqtt_broker);
+
+    // Owned by the client from here on, destroyed together with it
+    transport = mqtt_tls_transport_create();
+    if(transport == NULL){
+        ESP_LOGE(TAG, "Failed to create MQTT TLS transport");
+        return ESP_ERR_NO_MEM;
+    }
+#else
     snprintf(mqtt_broker_full_uri, sizeof(mqtt_broker_full_uri), "mqtt://%s", mqtt_broker);
+#endif
 
     ESP_LOGD(TAG, "MQTT broker: %s:%d", mqtt_broker, mqtt_port);
     ESP_LOGD(TAG, "MQTT username: %s", mqtt_username);
@@ -106,11 +306,20 @@ static esp_err_t mqtt_connection_start(void){
             .client_id = mqtt_client_id,
             .authentication.password = mqtt_password,
         },
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+        .session.protocol_ver = mqtt5_enabled ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1,
+#endif
+        .session.message_retransmit_timeout = CONFIG_HOMEPOST_MQTT_INFLIGHT_TIMEOUT_MS,
+        .network.disable_auto_reconnect = true,
+        .network.transport = transport,
     };
 
     client = esp_mqtt_client_init(&mqtt_config);
     if(client == NULL){
         ESP_LOGE(TAG, "Failed to create MQTT client");
+        if(transport != NULL){
+            esp_transport_destroy(transport);
+        }
         return ESP_FAIL;
     }
 
@@ -119,136 +328,1116 @@ static esp_err_t mqtt_connection_start(void){
 
     ESP_LOGI(TAG, "MQTT client started successfully, connecting...");
 
-    xEventGroupWaitBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
-
-    ESP_LOGI(TAG, "MQTT client connected successfully");
-
     return ESP_OK;
 }
 
 static void mqtt_connection_publish_version(void){
-    char base_topic[MQTT_CONNECTION_TOPIC_MAX_LEN];
-    if (mqtt_connection_get_base_topic(base_topic, sizeof(base_topic)) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to get base topic for version publish");
+    struct mqtt_publish_queue_reservation_t reservation;
+    int len;
+
+    ESP_LOGI(TAG, "Publishing firmware version: %s", CONFIG_APP_PROJECT_VER);
+    if (mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_EVENT, mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_VERSION), MQTT_CONNECTION_VERSION_PAYLOAD_SIZE, 1, &reservation) != ESP_OK) {
         return;
     }
-    snprintf(version_topic, sizeof(version_topic), "%s/homepost_version", base_topic);
-    snprintf(version_payload, sizeof(version_payload), "{\"version\":\"%s\"}", CONFIG_APP_PROJECT_VER);
-    ESP_LOGI(TAG, "Publishing firmware version: %s", CONFIG_APP_PROJECT_VER);
-    mqtt_connection_put_publish_queue(&version_message);
+
+    len = snprintf(reservation.payload, reservation.payload_size, "{\"version\":\"%s\"}", CONFIG_APP_PROJECT_VER);
+    if (len < 0 || len >= reservation.payload_size) {
+        mqtt_connection_abort_message(&reservation);
+        ESP_LOGE(TAG, "Failed to format version payload");
+        return;
+    }
+
+    mqtt_connection_commit_message(&reservation, len);
+}
+
+static size_t mqtt_connection_varint_size(size_t value){
+    size_t size = 1;
+    while(value >= 128){
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static void mqtt_connection_count_wire_bytes(const char *topic, size_t properties_len, const struct mqtt_publish_queue_item_t *item){
+    size_t remaining = 2 + strlen(topic) + (item->qos > 0 ? 2 : 0) + item->payload_len;
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+    if(mqtt5_enabled){
+        remaining += mqtt_connection_varint_size(properties_len) + properties_len;
+    }
+#endif
+
+    // PUBLISH fixed header, variable header and payload as sent by the client
+    mqtt_connection_stats.wire_messages++;
+    mqtt_connection_stats.wire_bytes += 1 + mqtt_connection_varint_size(remaining) + remaining;
+}
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+static int mqtt_connection_find_topic(const char *topic){
+    for(int i = 0; i < MQTT_CONNECTION_TOPIC_COUNT; i++){
+        if(strcmp(mqtt_connection_get_topic(i), topic) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Sets the publish properties for the next message and picks the topic to
+ * send: empty once the alias is known to the broker. QoS 1 messages always
+ * carry the topic because the client may resend them on a new connection,
+ * where the alias means nothing.
+ */
+static const char *mqtt_connection_mqtt5_prepare(const struct mqtt_publish_queue_item_t *item, int *topic_id, size_t *properties_len){
+    esp_mqtt5_publish_property_config_t property = {0};
+    int id = mqtt_connection_find_topic(item->topic);
+
+    *topic_id = -1;
+    *properties_len = 0;
+
+    if(item->lane == MQTT_PUBLISH_QUEUE_LANE_TELEMETRY && CONFIG_HOMEPOST_MQTT_TELEMETRY_EXPIRY_S > 0){
+        property.message_expiry_interval = CONFIG_HOMEPOST_MQTT_TELEMETRY_EXPIRY_S;
+        *properties_len += 5;
+    }
+
+    if(id >= 0 && id + 1 <= mqtt5_alias_limit){
+        property.topic_alias = id + 1;
+        if(esp_mqtt5_client_set_publish_property(client, &property) == ESP_OK){
+            *topic_id = id;
+            *properties_len += 3;
+            if((mqtt5_alias_sent & (1u << id)) && item->qos == 0){
+                mqtt_connection_stats.alias_hits++;
+                return "";
+            }
+            return item->topic;
+        }
+
+        ESP_LOGI(TAG, "Broker allows %d topic aliases", id);
+        mqtt5_alias_limit = id;
+        property.topic_alias = 0;
+    }
+
+    esp_mqtt5_client_set_publish_property(client, &property);
+    return item->topic;
+}
+#endif
+
+static int mqtt_connection_send(struct mqtt_publish_queue_item_t *item){
+    const char *topic = item->topic;
+    size_t properties_len = 0;
+    int ret;
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+    int topic_id = -1;
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+    if(mqtt5_enabled){
+        topic = mqtt_connection_mqtt5_prepare(item, &topic_id, &properties_len);
+    }
+#endif
+
+    // Topic and payload are published straight from the queue storage
+    ESP_LOGD(TAG, "Publishing message to topic: %s", item->topic);
+    ret = esp_mqtt_client_publish(client, topic, item->payload, item->payload_len, item->qos, 0);
+    if(ret < 0){
+        return ret;
+    }
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+    if(topic_id >= 0){
+        mqtt5_alias_sent |= 1u << topic_id;
+    }
+#endif
+    mqtt_connection_count_wire_bytes(topic, properties_len, item);
+
+    return ret;
+}
+
+bool mqtt_connection_is_connected(void){
+    if(mqtt_connection_event_group == NULL){
+        return false;
+    }
+    return (xEventGroupGetBits(mqtt_connection_event_group) & MQTT_CONNECTION_CONNECTED_EVENT_BIT) != 0;
+}
+
+static void mqtt_connection_release(struct mqtt_publish_queue_item_t *item){
+    // Messages loaded from the outbox leave flash once delivered or given up
+    if(item->tag != 0){
+        mqtt_outbox_consume(item->tag);
+    }
+    mqtt_publish_queue_release(item);
+}
+
+/*
+ * Returns the mask of lanes to move into the outbox, 0 for none. While
+ * connected only telemetry is spilled, events wait in RAM for their turn.
+ */
+static uint32_t mqtt_connection_spill_lanes(bool connected, bool throttled, TickType_t disconnected_for){
+    struct mqtt_publish_queue_stats_t queue_stats;
+    uint32_t lanes = 0;
+
+    if(!mqtt_outbox_is_available()){
+        return 0;
+    }
+
+    if(!connected && disconnected_for >= MQTT_CONNECTION_SPILL_DELAY){
+        lanes = MQTT_PUBLISH_QUEUE_ALL_LANES;
+    } else if(!connected || inflight_count >= CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW || throttled){
+        // Keep room for new messages in the lanes under pressure while the broker is slow, briefly away or rate limiting
+        for(int i = 0; i < MQTT_PUBLISH_QUEUE_LANE_COUNT; i++){
+            mqtt_publish_queue_get_stats(i, &queue_stats);
+            if(queue_stats.used * 4 >= queue_stats.capacity * 3){
+                lanes |= MQTT_PUBLISH_QUEUE_LANE_BIT(i);
+            }
+        }
+        if(connected){
+            lanes &= MQTT_PUBLISH_QUEUE_LANE_BIT(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY);
+        }
+    }
+
+    return lanes != 0 && mqtt_outbox_has_write_budget() ? lanes : 0;
+}
+
+static void mqtt_connection_spill(struct mqtt_publish_queue_item_t *item){
+    if(item->tag != 0){
+        // Still stored in the outbox, it is loaded again once connected
+        mqtt_outbox_requeue(item->tag);
+    } else if(mqtt_outbox_append(item->lane, item->topic, item->payload, item->payload_len, item->qos) != ESP_OK){
+        ESP_LOGE(TAG, "Failed to store message to topic %s in the outbox, dropping", item->topic);
+        mqtt_connection_stats.dropped++;
+    }
+    mqtt_publish_queue_release(item);
 }
 
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+static void mqtt_connection_shaper_refill(struct mqtt_connection_bucket_t *bucket, TickType_t now){
+    uint32_t rate = bucket->rate;
+    uint64_t added;
+
+    if(rate == 0){
+        bucket->tokens = bucket->burst;
+        bucket->refilled_at = now;
+        return;
+    }
+
+    added = (uint64_t)pdTICKS_TO_MS(now - bucket->refilled_at) * rate / 1000;
+    if(added == 0){
+        // Keep the elapsed time for the next refill so slow rates still add up
+        return;
+    }
+    bucket->tokens = (int64_t)bucket->tokens + added > bucket->burst ? (int32_t)bucket->burst : bucket->tokens + (int32_t)added;
+    bucket->refilled_at = now;
+}
+
+/*
+ * Returns the lanes allowed to send now. Lanes held back with messages
+ * waiting shorten next_timeout to their next token and count as throttled.
+ */
+static uint32_t mqtt_connection_shaper_update(TickType_t now, uint32_t pending, TickType_t *next_timeout){
+    uint32_t allowed = 0;
+    TickType_t wait;
+
+    for(int i = 0; i < MQTT_PUBLISH_QUEUE_LANE_COUNT; i++){
+        struct mqtt_connection_bucket_t *bucket = &buckets[i];
+
+        mqtt_connection_shaper_refill(bucket, now);
+
+        if(bucket->tokens > 0 || !(pending & MQTT_PUBLISH_QUEUE_LANE_BIT(i))){
+            if(bucket->tokens > 0){
+                allowed |= MQTT_PUBLISH_QUEUE_LANE_BIT(i);
+            }
+            if(bucket->throttled){
+                bucket->throttled = false;
+                bucket->throttled_ms += pdTICKS_TO_MS(now - bucket->throttled_since);
+            }
+            continue;
+        }
+
+        if(!bucket->throttled){
+            bucket->throttled = true;
+            bucket->throttled_since = now;
+            bucket->throttle_events++;
+        }
+        wait = pdMS_TO_TICKS(((uint64_t)(1 - bucket->tokens) * 1000 + bucket->rate - 1) / bucket->rate);
+        if(wait == 0){
+            wait = 1;
+        }
+        if(wait < *next_timeout){
+            *next_timeout = wait;
+        }
+    }
+
+    return allowed;
+}
+
+static int32_t mqtt_connection_shaper_cost(const struct mqtt_publish_queue_item_t *item){
+    return strlen(item->topic) + item->payload_len + MQTT_CONNECTION_SHAPER_OVERHEAD;
+}
+
+static void mqtt_connection_shaper_charge(const struct mqtt_publish_queue_item_t *item){
+    buckets[item->lane].tokens -= mqtt_connection_shaper_cost(item);
+}
+
+static void mqtt_connection_shaper_refund(const struct mqtt_publish_queue_item_t *item){
+    buckets[item->lane].tokens += mqtt_connection_shaper_cost(item);
+}
+#endif
+
+static void mqtt_connection_inflight_add(struct mqtt_publish_queue_item_t *item, int msg_id){
+    for(int i = 0; i < CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW; i++){
+        struct mqtt_connection_inflight_t *slot = &inflight_window[i];
+        if(slot->item.record == NULL){
+            slot->item = *item;
+            slot->msg_id = msg_id;
+            slot->sent_at = xTaskGetTickCount();
+            slot->retries = 0;
+            inflight_count++;
+            if(inflight_count > mqtt_connection_stats.inflight_high_water){
+                mqtt_connection_stats.inflight_high_water = inflight_count;
+            }
+            return;
+        }
+    }
+}
+
+static void mqtt_connection_inflight_remove(struct mqtt_connection_inflight_t *slot){
+    mqtt_connection_release(&slot->item);
+    slot->msg_id = -1;
+    inflight_count--;
+}
+
+static void mqtt_connection_inflight_process_acks(void){
+    int msg_id;
+
+    while(xQueueReceive(mqtt_connection_ack_queue, &msg_id, 0) == pdTRUE){
+        bool matched = false;
+        for(int i = 0; i < CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW; i++){
+            struct mqtt_connection_inflight_t *slot = &inflight_window[i];
+            if(slot->item.record != NULL && slot->msg_id == msg_id){
+                ESP_LOGD(TAG, "Message %d acknowledged, topic: %s", msg_id, slot->item.topic);
+#if CONFIG_HOMEPOST_MQTT_BENCHMARK
+                mqtt_benchmark_record_ack(&slot->item);
+#endif
+                mqtt_connection_inflight_remove(slot);
+                mqtt_connection_stats.acked++;
+                matched = true;
+                break;
+            }
+        }
+        if(!matched){
+            ESP_LOGD(TAG, "Ack for message %d does not match any in-flight message", msg_id);
+        }
+    }
+}
+
+/*
+ * The client resends an unacknowledged message itself, with the DUP flag and
+ * the same message ID, every message_retransmit_timeout. Each timeout here
+ * counts one such resend, after the last one the message is deleted from the
+ * client outbox and dropped. Returns the number of ticks until the next
+ * in-flight message expires.
+ */
+static TickType_t mqtt_connection_inflight_check_timeouts(void){
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next_timeout = portMAX_DELAY;
+
+    for(int i = 0; i < CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW; i++){
+        struct mqtt_connection_inflight_t *slot = &inflight_window[i];
+        TickType_t elapsed;
+
+        if(slot->item.record == NULL){
+            continue;
+        }
+
+        elapsed = now - slot->sent_at;
+        if(elapsed >= MQTT_CONNECTION_INFLIGHT_TIMEOUT){
+            mqtt_connection_stats.timeouts++;
+            if(slot->retries >= CONFIG_HOMEPOST_MQTT_INFLIGHT_MAX_RETRIES){
+                ESP_LOGW(TAG, "Message %d to topic %s not acknowledged, dropping", slot->msg_id, slot->item.topic);
+                esp_mqtt_client_delete_outbox_msg(client, slot->msg_id);
+                mqtt_connection_inflight_remove(slot);
+                mqtt_connection_stats.dropped++;
+                continue;
+            }
+
+            ESP_LOGW(TAG, "Message %d to topic %s not acknowledged, waiting for the resend", slot->msg_id, slot->item.topic);
+            slot->retries++;
+            slot->sent_at = now;
+            mqtt_connection_stats.retries++;
+            elapsed = 0;
+        }
+
+        if(MQTT_CONNECTION_INFLIGHT_TIMEOUT - elapsed < next_timeout){
+            next_timeout = MQTT_CONNECTION_INFLIGHT_TIMEOUT - elapsed;
+        }
+    }
+
+    return next_timeout;
+}
+
+static void mqtt_connection_inflight_reset(void){
+    memset(inflight_window, 0, sizeof(inflight_window));
+    inflight_count = 0;
+    xQueueReset(mqtt_connection_ack_queue);
+}
+
+/*
+ * Replaces the client with one built from the stored settings. The publish
+ * queue is kept, messages the old client did not get acked are sent again.
+ */
+static void mqtt_connection_restart_client(void){
+    if(client != NULL){
+        esp_mqtt_client_destroy(client);
+        client = NULL;
+    }
+    xEventGroupClearBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT);
+
+    mqtt_connection_inflight_reset();
+    mqtt_publish_queue_rewind();
+
+    // Picks up a base topic changed through /mqtt-setup
+    if(mqtt_connection_build_topics() != ESP_OK){
+        ESP_LOGE(TAG, "Failed to rebuild MQTT topic table");
+    }
+
+    if(mqtt_connection_start() != ESP_OK){
+        ESP_LOGW(TAG, "MQTT client not restarted, waiting for new settings");
+        return;
+    }
+    mqtt_connection_publish_version();
+}
+
+/*
+ * Exponential backoff with equal jitter: half of the delay is fixed, the
+ * other half random, so devices that lost the same broker spread out.
+ */
+static TickType_t mqtt_connection_reconnect_delay(uint32_t attempt){
+    uint32_t delay_ms = CONFIG_HOMEPOST_MQTT_RECONNECT_MAX_MS;
+
+    if(attempt < 16 && ((uint32_t)CONFIG_HOMEPOST_MQTT_RECONNECT_MIN_MS << attempt) < delay_ms){
+        delay_ms = (uint32_t)CONFIG_HOMEPOST_MQTT_RECONNECT_MIN_MS << attempt;
+    }
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+
+    return pdMS_TO_TICKS(delay_ms);
+}
+
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+static void mqtt_connection_protocol_fallback(void){
+    ESP_LOGW(TAG, "Broker refused MQTT 5, reconnecting with MQTT 3.1.1");
+
+    mqtt5_enabled = false;
+    mqtt_connection_restart_client();
+}
+#endif
+
 static void mqtt_connection_publish_loop(void){
-    struct mqtt_connection_message_t msg = {0};
+    struct mqtt_publish_queue_item_t item = {0};
+    uint32_t generation = mqtt_connection_generation;
+    TickType_t disconnected_at = xTaskGetTickCount();
+    bool was_connected = false;
+    bool ever_connected = false;
+    bool connected;
+    uint32_t disconnects = mqtt_connection_disconnects;
+    uint32_t reconnect_attempt = 0;
+    bool reconnect_pending = false;
+    TickType_t reconnect_at = 0;
+    TickType_t next_timeout;
+    TickType_t now;
+    uint32_t reconnect_ms;
+    uint32_t lanes;
+    uint32_t spill_lanes;
+    bool throttled;
+    EventBits_t bits;
     int ret;
 
     ESP_LOGI(TAG, "MQTT publish loop started");
 
     while(mqtt_connection_task_running){
-        xEventGroupWaitBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+        bits = xEventGroupClearBits(mqtt_connection_event_group, MQTT_CONNECTION_RECONFIGURE_EVENT_BIT | MQTT_CONNECTION_PROTOCOL_FALLBACK_EVENT_BIT);
+        if(!mqtt_connection_task_running){
+            break;
+        }
 
-        if(xQueueReceive(mqtt_connection_message_queue, &msg, portMAX_DELAY) == pdTRUE){
-            ESP_LOGI(TAG, "Publishing message to topic: %s", msg.topic);
-            ret = esp_mqtt_client_publish(client, msg.topic, msg.payload, 0, msg.qos, 0);
-            if(ret < 0){
-                ESP_LOGE(TAG, "Failed to publish message to topic: %s", msg.topic);
-            }
-            else if (ret == 0) {
-                ESP_LOGI(TAG, "Message with QoS 0 published without confirmation");
+        if(bits & MQTT_CONNECTION_RECONFIGURE_EVENT_BIT){
+            ESP_LOGI(TAG, "Reconfiguring MQTT client, queued messages are kept");
+            mqtt_connection_restart_client();
+            // The old client may have reported its own disconnect on the way out
+            disconnects = mqtt_connection_disconnects;
+            reconnect_attempt = 0;
+            reconnect_pending = false;
+            continue;
+        }
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+        if(bits & MQTT_CONNECTION_PROTOCOL_FALLBACK_EVENT_BIT){
+            mqtt_connection_protocol_fallback();
+            disconnects = mqtt_connection_disconnects;
+            reconnect_pending = false;
+            continue;
+        }
+#endif
+
+        connected = mqtt_connection_is_connected();
+        now = xTaskGetTickCount();
+
+        if(disconnects != mqtt_connection_disconnects){
+            // Covers both a dropped connection and a failed attempt
+            disconnects = mqtt_connection_disconnects;
+            reconnect_at = now + mqtt_connection_reconnect_delay(reconnect_attempt++);
+            reconnect_pending = true;
+        }
+        if(!connected && reconnect_pending && client != NULL && (int32_t)(now - reconnect_at) >= 0){
+            reconnect_pending = false;
+            mqtt_connection_stats.reconnect_attempts++;
+            if(esp_mqtt_client_reconnect(client) != ESP_OK){
+                ESP_LOGW(TAG, "MQTT reconnect attempt not started");
             }
-            else {
-                ESP_LOGI(TAG, "Message %d routed to publishing successfully", ret);
-                xEventGroupWaitBits(mqtt_connection_event_group, MQTT_CONNECTION_PUBLISH_EVENT_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
-                ESP_LOGI(TAG, "Message published successfully to topic: %s", msg.topic);
-                xEventGroupClearBits(mqtt_connection_event_group, MQTT_CONNECTION_PUBLISH_EVENT_BIT);
+        }
+
+        if(!connected && !mqtt_outbox_is_available()){
+            // Nowhere to put messages while offline, they wait in the queue
+            xEventGroupWaitBits(mqtt_connection_event_group,
+                                MQTT_CONNECTION_CONNECTED_EVENT_BIT | MQTT_CONNECTION_PROTOCOL_FALLBACK_EVENT_BIT | MQTT_CONNECTION_RECONFIGURE_EVENT_BIT,
+                                pdFALSE, pdFALSE, reconnect_pending ? reconnect_at - now : MQTT_CONNECTION_OFFLINE_POLL_INTERVAL);
+            continue;
+        }
+
+        if(connected){
+            if(generation != mqtt_connection_generation){
+                // Reconnected: the client resends its outbox, give the window a fresh timeout
+                generation = mqtt_connection_generation;
+                for(int i = 0; i < CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW; i++){
+                    inflight_window[i].sent_at = now;
+                }
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+                mqtt5_alias_sent = 0;
+                mqtt5_alias_limit = UINT16_MAX;
+#endif
+                if(ever_connected){
+                    reconnect_ms = pdTICKS_TO_MS(now - disconnected_at);
+                    mqtt_connection_stats.reconnects++;
+                    mqtt_connection_stats.reconnect_last_ms = reconnect_ms;
+                    mqtt_connection_stats.reconnect_total_ms += reconnect_ms;
+                    if(reconnect_ms > mqtt_connection_stats.reconnect_max_ms){
+                        mqtt_connection_stats.reconnect_max_ms = reconnect_ms;
+                    }
+                    ESP_LOGI(TAG, "MQTT reconnected after %" PRIu32 " ms", reconnect_ms);
+                }
+                ever_connected = true;
+                reconnect_attempt = 0;
+                reconnect_pending = false;
             }
+
+            mqtt_connection_inflight_process_acks();
+            next_timeout = mqtt_connection_inflight_check_timeouts();
         } else {
-            ESP_LOGE(TAG, "Failed to receive message from queue");
+            if(was_connected){
+                disconnected_at = now;
+            }
+            next_timeout = MQTT_CONNECTION_OFFLINE_POLL_INTERVAL;
+            if(reconnect_pending && reconnect_at - now < next_timeout){
+                next_timeout = reconnect_at - now;
+            }
+        }
+        was_connected = connected;
+
+        lanes = MQTT_PUBLISH_QUEUE_ALL_LANES;
+        throttled = false;
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+        if(connected){
+            uint32_t pending = mqtt_publish_queue_get_pending_lanes();
+
+            lanes = mqtt_connection_shaper_update(now, pending, &next_timeout);
+            throttled = (pending & ~lanes) != 0;
+        }
+#endif
+
+        spill_lanes = mqtt_connection_spill_lanes(connected, throttled, xTaskGetTickCount() - disconnected_at);
+        if(spill_lanes != 0 && mqtt_publish_queue_peek_lanes(spill_lanes, &item) == ESP_OK){
+            mqtt_connection_spill(&item);
+            continue;
+        }
+
+        if(connected && inflight_count < CONFIG_HOMEPOST_MQTT_INFLIGHT_WINDOW){
+            if(mqtt_publish_queue_peek_lanes(lanes, &item) == ESP_OK){
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+                mqtt_connection_shaper_charge(&item);
+#endif
+                ret = mqtt_connection_send(&item);
+                if(ret >= 0){
+                    mqtt_publish_queue_mark_sent(&item);
+                    if(item.qos == 0){
+                        mqtt_connection_release(&item);
+                    } else {
+                        mqtt_connection_inflight_add(&item, ret);
+                    }
+                    continue;
+                }
+
+                // The client refused it, the message stays first in its lane and is tried again
+                ESP_LOGE(TAG, "Failed to publish message to topic: %s", item.topic);
+                mqtt_connection_stats.publish_failures++;
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+                mqtt_connection_shaper_refund(&item);
+#endif
+                mqtt_publish_queue_unpeek(&item);
+                if(next_timeout > MQTT_CONNECTION_PUBLISH_RETRY_INTERVAL){
+                    next_timeout = MQTT_CONNECTION_PUBLISH_RETRY_INTERVAL;
+                }
+                mqtt_publish_queue_wait(next_timeout);
+                continue;
+            }
+
+            // Live messages go first, the outbox backlog is loaded once the queue is empty
+            if(!throttled && mqtt_outbox_get_backlog() > 0 && mqtt_outbox_drain(CONFIG_HOMEPOST_MQTT_OUTBOX_DRAIN_BATCH) > 0){
+                continue;
+            }
         }
+
+        // Woken up by a new message, an ack, a connection change or the next timeout
+        mqtt_publish_queue_wait(next_timeout);
     }
 }
 
 static void mqtt_connection_stop(void){
-    mqtt_connection_task_running = false;
     if (client != NULL){
         esp_mqtt_client_disconnect(client);
         esp_mqtt_client_stop(client);
         esp_mqtt_client_destroy(client);
-        mqtt_connection_task_handle = NULL;
+        client = NULL;
     }
+    xEventGroupClearBits(mqtt_connection_event_group, MQTT_CONNECTION_CONNECTED_EVENT_BIT);
 }
 
 static void mqtt_connection_task(void *arg){
     esp_err_t ret;
 
-    if (mqtt_connection_event_group == NULL) {
-        mqtt_connection_event_group = xEventGroupCreate();
-        if (mqtt_connection_event_group == NULL) {
-            ESP_LOGE(TAG, "Failed to create MQTT connection event group");
-            vTaskDelete(NULL);
-        }
-    }
+    // Messages left in flight by a previous publish loop are sent again
+    mqtt_connection_inflight_reset();
+    mqtt_publish_queue_rewind();
 
-    if (mqtt_connection_message_queue == NULL) {
-        mqtt_connection_message_queue = xQueueCreate(CONFIG_HOMEPOST_MQTT_PUBLISH_QUEUE_SIZE, sizeof(struct mqtt_connection_message_t));
-        if (mqtt_connection_message_queue == NULL) {
-            ESP_LOGE(TAG, "Failed to create MQTT connection message queue");
-            vTaskDelete(NULL);
-        }
+#if CONFIG_HOMEPOST_MQTT_OUTBOX_ENABLED
+    if(mqtt_outbox_init() != ESP_OK){
+        ESP_LOGW(TAG, "MQTT outbox not available, messages are kept in RAM only");
     }
+#endif
 
     ret = mqtt_connection_start();
     if(ret != ESP_OK){
+        // The loop keeps the queue running and restarts the client on new settings
         ESP_LOGE(TAG, "MQTT connection failed: %s", esp_err_to_name(ret));
-        vTaskDelete(NULL);
+    } else {
+        // Queued now, published as soon as the client connects
+        mqtt_connection_publish_version();
     }
 
-    mqtt_connection_task_running = true;
-
-    // Publish firmware version on successful connection
-    mqtt_connection_publish_version();
-
     mqtt_connection_publish_loop();
 
     ESP_LOGI(TAG, "MQTT publish loop exited");
-    mqtt_connection_stop_task();
+    mqtt_connection_stop();
+    mqtt_connection_task_handle = NULL;
+    vTaskDelete(NULL);
 }
 
-void mqtt_connection_stop_task(void){
+/*
+ * Payload formatters return the payload length, or -1 if it does not fit.
+ * The buffer size includes the NUL the publish queue appends.
+ */
+#if CONFIG_HOMEPOST_MQTT_PAYLOAD_CBOR
+static void mqtt_connection_encode_value(struct cbor_encoder_t *encoder, float value, uint8_t precision){
+    static const float scales[] = { 1.0f, 10.0f, 100.0f, 1000.0f, 10000.0f };
 
-    mqtt_connection_stop();
+    if (precision == 0) {
+        cbor_encode_int(encoder, lroundf(value));
+        return;
+    }
 
-    if(mqtt_connection_message_queue != NULL){
-        vQueueDelete(mqtt_connection_message_queue);
-        mqtt_connection_message_queue = NULL;
+    // Drop the digits JSON would not send, this often makes the value fit a half float
+    if (precision < sizeof(scales) / sizeof(scales[0])) {
+        value = roundf(value * scales[precision]) / scales[precision];
     }
-    if(mqtt_connection_event_group != NULL){
-        vEventGroupDelete(mqtt_connection_event_group);
-        mqtt_connection_event_group = NULL;
+    cbor_encode_float(encoder, value);
+}
+
+static int mqtt_connection_format_metric(char *buffer, size_t size, const char *metric, float value, uint8_t precision){
+    struct cbor_encoder_t encoder;
+    size_t len;
+
+    cbor_encoder_init(&encoder, buffer, size - 1);
+    cbor_encode_map(&encoder, 1);
+    cbor_encode_text(&encoder, metric);
+    mqtt_connection_encode_value(&encoder, value, precision);
+
+    return cbor_encoder_finish(&encoder, &len) == ESP_OK ? (int)len : -1;
+}
+
+static int mqtt_connection_format_text(char *buffer, size_t size, const char *key, const char *value){
+    struct cbor_encoder_t encoder;
+    size_t len;
+
+    cbor_encoder_init(&encoder, buffer, size - 1);
+    cbor_encode_map(&encoder, 1);
+    cbor_encode_text(&encoder, key);
+    cbor_encode_text(&encoder, value);
+
+    return cbor_encoder_finish(&encoder, &len) == ESP_OK ? (int)len : -1;
+}
+#else
+static int mqtt_connection_format_metric(char *buffer, size_t size, const char *metric, float value, uint8_t precision){
+    int len = snprintf(buffer, size, "{\"%s\": %.*f}", metric, precision, value);
+    return len >= 0 && len < size ? len : -1;
+}
+
+static int mqtt_connection_format_text(char *buffer, size_t size, const char *key, const char *value){
+    int len = snprintf(buffer, size, "{\"%s\": \"%s\"}", key, value);
+    return len >= 0 && len < size ? len : -1;
+}
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH
+#if CONFIG_HOMEPOST_MQTT_PAYLOAD_CBOR
+static int mqtt_connection_format_frame(char *buffer, size_t size, bool clock_valid, int64_t clock_offset_ms){
+    struct cbor_encoder_t encoder;
+    size_t len;
+
+    cbor_encoder_init(&encoder, buffer, size - 1);
+    cbor_encode_map(&encoder, 2);
+    cbor_encode_text(&encoder, "clock");
+    cbor_encode_text(&encoder, clock_valid ? "unix" : "uptime");
+    cbor_encode_text(&encoder, "metrics");
+    cbor_encode_map(&encoder, batch_count);
+    for (uint32_t i = 0; i < batch_count; i++) {
+        struct mqtt_connection_metric_t *metric = &batch_metrics[i];
+        cbor_encode_text(&encoder, metric->name);
+        cbor_encode_map(&encoder, 2);
+        cbor_encode_text(&encoder, "v");
+        mqtt_connection_encode_value(&encoder, metric->value, metric->precision);
+        cbor_encode_text(&encoder, "t");
+        cbor_encode_int(&encoder, metric->uptime_ms + clock_offset_ms);
+    }
+
+    return cbor_encoder_finish(&encoder, &len) == ESP_OK ? (int)len : -1;
+}
+#else
+static int mqtt_connection_format_frame(char *buffer, size_t size, bool clock_valid, int64_t clock_offset_ms){
+    int len;
+
+    len = snprintf(buffer, size, "{\"clock\":\"%s\",\"metrics\":{", clock_valid ? "unix" : "uptime");
+    for (uint32_t i = 0; i < batch_count && len >= 0 && len < size; i++) {
+        struct mqtt_connection_metric_t *metric = &batch_metrics[i];
+        len += snprintf(buffer + len, size - len, "%s\"%s\":{\"v\":%.*f,\"t\":%lld}",
+                        i == 0 ? "" : ",", metric->name, metric->precision, metric->value, (long long)(metric->uptime_ms + clock_offset_ms));
+    }
+    if (len >= 0 && len < size) {
+        len += snprintf(buffer + len, size - len, "}}");
+    }
+
+    return len >= 0 && len < size ? len : -1;
+}
+#endif
+
+/*
+ * Writes the pending readings as one frame. Readings carry their uptime and
+ * are converted to Unix time at flush if SNTP has set the clock by then.
+ * Must be called with batch_mutex taken.
+ */
+static void mqtt_connection_batch_flush(void){
+    struct mqtt_publish_queue_reservation_t reservation;
+    struct timeval now;
+    int64_t clock_offset_ms = 0;
+    bool clock_valid;
+    int len;
+
+    if (batch_count == 0) {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    clock_valid = now.tv_sec >= MQTT_CONNECTION_CLOCK_VALID_AFTER;
+    if (clock_valid) {
+        clock_offset_ms = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - esp_timer_get_time() / 1000;
+    }
+
+    if (mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY, mqtt_connection_get_topic(MQTT_CONNECTION_TOPIC_TELEMETRY), MQTT_CONNECTION_BATCH_PAYLOAD_SIZE, 0, &reservation) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to enqueue telemetry frame, %lu readings lost", batch_count);
+        batch_count = 0;
+        return;
+    }
+
+    len = mqtt_connection_format_frame(reservation.payload, reservation.payload_size, clock_valid, clock_offset_ms);
+    if (len < 0) {
+        mqtt_connection_abort_message(&reservation);
+        ESP_LOGE(TAG, "Failed to format telemetry frame");
+    } else {
+        // Frames are not coalesced, each one carries different readings
+        mqtt_connection_commit_message(&reservation, len);
+        mqtt_connection_stats.batched_metrics += batch_count;
+        mqtt_connection_stats.batch_frames++;
+    }
+
+    batch_count = 0;
+}
+
+static void mqtt_connection_batch_timer_cb(void *arg){
+    xSemaphoreTake(batch_mutex, portMAX_DELAY);
+    mqtt_connection_batch_flush();
+    xSemaphoreGive(batch_mutex);
+}
+
+static const esp_timer_create_args_t batch_timer_args = {
+    .callback = &mqtt_connection_batch_timer_cb,
+    .name = "mqtt_batch",
+};
+
+static esp_err_t mqtt_connection_batch_init(void){
+    if (batch_mutex == NULL) {
+        batch_mutex = xSemaphoreCreateMutex();
+        if (batch_mutex == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (batch_timer == NULL) {
+        return esp_timer_create(&batch_timer_args, &batch_timer);
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t mqtt_connection_batch_add(const char *metric, float value, uint8_t precision){
+    struct mqtt_connection_metric_t *slot = NULL;
+
+    if (batch_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(batch_mutex, portMAX_DELAY);
+
+    // A metric read twice within one window only keeps its newest reading
+    for (uint32_t i = 0; i < batch_count; i++) {
+        if (strcmp(batch_metrics[i].name, metric) == 0) {
+            slot = &batch_metrics[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        if (batch_count == CONFIG_HOMEPOST_MQTT_BATCH_MAX_METRICS) {
+            mqtt_connection_batch_flush();
+        }
+        if (batch_count == 0) {
+            // Already running after a flush on a full frame, which is fine
+            esp_timer_start_once(batch_timer, (uint64_t)CONFIG_HOMEPOST_MQTT_BATCH_WINDOW_MS * 1000);
+        }
+        slot = &batch_metrics[batch_count++];
+        slot->name = metric;
+    }
+
+    slot->value = value;
+    slot->precision = precision;
+    slot->uptime_ms = esp_timer_get_time() / 1000;
+
+    xSemaphoreGive(batch_mutex);
+
+    return ESP_OK;
+}
+#endif
+
+void mqtt_connection_stop_task(void){
+    TickType_t started = xTaskGetTickCount();
+
+    if(mqtt_connection_task_handle == NULL){
+        return;
+    }
+
+    // The task shuts the client down itself, so it never dies holding the queue lock
+    mqtt_connection_task_running = false;
+    xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_RECONFIGURE_EVENT_BIT);
+    mqtt_publish_queue_wake();
+
+    while(mqtt_connection_task_handle != NULL && xTaskGetTickCount() - started < MQTT_CONNECTION_STOP_TIMEOUT){
+        vTaskDelay(MQTT_CONNECTION_STOP_POLL_INTERVAL);
     }
     if(mqtt_connection_task_handle != NULL){
-        vTaskDelete(mqtt_connection_task_handle);
-        mqtt_connection_task_handle = NULL;
+        ESP_LOGW(TAG, "MQTT connection task did not stop in time");
     }
 }
 
 void mqtt_connection_start_task(void){
     if (mqtt_connection_task_handle != NULL) {
-        ESP_LOGW(TAG, "MQTT connection task already running, stopping it first");
-        mqtt_connection_stop_task();
+        // New settings: the running task rebuilds its client, the queue stays as it is
+        ESP_LOGI(TAG, "MQTT connection task running, reconfiguring the client");
+        xEventGroupSetBits(mqtt_connection_event_group, MQTT_CONNECTION_RECONFIGURE_EVENT_BIT);
+        mqtt_publish_queue_wake();
+        return;
+    }
+    if (mqtt_connection_event_group == NULL) {
+        mqtt_connection_event_group = xEventGroupCreate();
+        if (mqtt_connection_event_group == NULL) {
+            ESP_LOGE(TAG, "Failed to create MQTT connection event group");
+            return;
+        }
     }
+    if (mqtt_connection_build_topics() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to build MQTT topic table");
+        return;
+    }
+    if (mqtt_publish_queue_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize MQTT publish queue");
+        return;
+    }
+#if CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH
+    if (mqtt_connection_batch_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize MQTT telemetry batching");
+        return;
+    }
+#endif
+    if (mqtt_connection_ack_queue == NULL) {
+        mqtt_connection_ack_queue = xQueueCreate(MQTT_CONNECTION_ACK_QUEUE_SIZE, sizeof(int));
+        if (mqtt_connection_ack_queue == NULL) {
+            ESP_LOGE(TAG, "Failed to create MQTT ack queue");
+            return;
+        }
+    }
+    mqtt_connection_task_running = true;
     xTaskCreate(mqtt_connection_task, MQTT_CONNECTION_TASK_NAME, MQTT_CONNECTION_STACK_SIZE, NULL, MQTT_CONNECTION_TASK_PRIORITY, &mqtt_connection_task_handle);
 }
 
 esp_err_t mqtt_connection_put_publish_queue(struct mqtt_connection_message_t *msg){
-    BaseType_t ret = pdFALSE;
-    if(mqtt_connection_message_queue != NULL){
-        ret = xQueueSend(mqtt_connection_message_queue, msg, 0);
-    } else {
-        ESP_LOGE(TAG, "MQTT connection message queue is NULL");
+    struct mqtt_publish_queue_reservation_t reservation;
+    size_t payload_len = strlen(msg->payload);
+    esp_err_t ret;
+
+    ret = mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_EVENT, msg->topic, payload_len + 1, msg->qos, &reservation);
+    if(ret != ESP_OK){
+        return ret;
     }
 
-    return ret == pdTRUE ? ESP_OK : ESP_FAIL;
+    memcpy(reservation.payload, msg->payload, payload_len);
+
+    return mqtt_connection_commit_message(&reservation, payload_len);
+}
+
+esp_err_t mqtt_connection_reserve_message(enum mqtt_publish_queue_lane_t lane, const char *topic, size_t payload_size, uint8_t qos, struct mqtt_publish_queue_reservation_t *reservation){
+    esp_err_t ret = mqtt_publish_queue_reserve(lane, topic, payload_size, qos, reservation);
+    if(ret == ESP_ERR_NO_MEM){
+        ESP_LOGW(TAG, "MQTT publish queue is full, dropping message to topic: %s", topic);
+    } else if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to reserve MQTT publish queue space: %s", esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+esp_err_t mqtt_connection_commit_message(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len){
+    return mqtt_publish_queue_commit(reservation, payload_len);
+}
+
+esp_err_t mqtt_connection_commit_telemetry(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len){
+#if CONFIG_HOMEPOST_MQTT_COALESCE_TELEMETRY
+    if (!telemetry_coalesce) {
+        return mqtt_publish_queue_commit(reservation, payload_len);
+    }
+    return mqtt_publish_queue_commit_latest(reservation, payload_len);
+#else
+    return mqtt_publish_queue_commit(reservation, payload_len);
+#endif
+}
+
+void mqtt_connection_abort_message(struct mqtt_publish_queue_reservation_t *reservation){
+    mqtt_publish_queue_abort(reservation);
+}
+
+#if CONFIG_HOMEPOST_MQTT_COALESCE_TELEMETRY
+esp_err_t mqtt_connection_set_coalesce(uint32_t enabled){
+    telemetry_coalesce = enabled != 0;
+    return ESP_OK;
+}
+#endif
+
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+/*
+ * Every topic has a single producer, so its deadband state needs no lock.
+ * Thresholds changed over MQTT are single word writes.
+ */
+static bool mqtt_connection_deadband_check(enum mqtt_connection_topic_t topic, float value){
+    struct mqtt_connection_deadband_t *deadband = &deadbands[topic];
+    float change;
+
+    if (!deadband->has_sent || esp_timer_get_time() - deadband->last_sent_us >= (int64_t)deadband_heartbeat_s * 1000000) {
+        return true;
+    }
+
+    change = fabsf(value - deadband->last_sent);
+    if (deadband->absolute_milli == 0 && deadband->relative_percent == 0) {
+        return change > 0;
+    }
+
+    return (deadband->absolute_milli > 0 && change * 1000 > deadband->absolute_milli) ||
+           (deadband->relative_percent > 0 && change * 100 > deadband->relative_percent * fabsf(deadband->last_sent));
+}
+
+static void mqtt_connection_deadband_update(enum mqtt_connection_topic_t topic, float value){
+    struct mqtt_connection_deadband_t *deadband = &deadbands[topic];
+
+    deadband->has_sent = true;
+    deadband->last_sent = value;
+    deadband->last_sent_us = esp_timer_get_time();
+}
+
+esp_err_t mqtt_connection_set_deadband_absolute(enum mqtt_connection_topic_t topic, uint32_t absolute_milli){
+    deadbands[topic].absolute_milli = absolute_milli;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_connection_set_deadband_relative(enum mqtt_connection_topic_t topic, uint32_t relative_percent){
+    deadbands[topic].relative_percent = relative_percent;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_connection_set_heartbeat(uint32_t heartbeat_s){
+    deadband_heartbeat_s = heartbeat_s;
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t mqtt_connection_enqueue_metric(enum mqtt_connection_topic_t topic, const char *metric, float value, uint8_t precision){
+#if CONFIG_HOMEPOST_MQTT_TELEMETRY_BATCH
+    return mqtt_connection_batch_add(metric, value, precision);
+#else
+    struct mqtt_publish_queue_reservation_t reservation;
+    esp_err_t ret;
+    int len;
+
+    ret = mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY, mqtt_connection_get_topic(topic), MQTT_CONNECTION_METRIC_PAYLOAD_SIZE, 0, &reservation);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    len = mqtt_connection_format_metric(reservation.payload, reservation.payload_size, metric, value, precision);
+    if (len < 0) {
+        mqtt_connection_abort_message(&reservation);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    return mqtt_connection_commit_telemetry(&reservation, len);
+#endif
+}
+
+esp_err_t mqtt_connection_publish_metric(enum mqtt_connection_topic_t topic, const char *metric, float value, uint8_t precision){
+#if CONFIG_HOMEPOST_MQTT_DEADBAND
+    esp_err_t ret;
+
+    if (!mqtt_connection_deadband_check(topic, value)) {
+        __atomic_add_fetch(&mqtt_connection_stats.deadband_suppressed, 1, __ATOMIC_RELAXED);
+        return ESP_OK;
+    }
+
+    // The reference value only moves once the reading is actually queued
+    ret = mqtt_connection_enqueue_metric(topic, metric, value, precision);
+    if (ret == ESP_OK) {
+        mqtt_connection_deadband_update(topic, value);
+        __atomic_add_fetch(&mqtt_connection_stats.deadband_passed, 1, __ATOMIC_RELAXED);
+    }
+
+    return ret;
+#else
+    return mqtt_connection_enqueue_metric(topic, metric, value, precision);
+#endif
+}
+
+esp_err_t mqtt_connection_publish_state(enum mqtt_connection_topic_t topic, const char *key, const char *value){
+    struct mqtt_publish_queue_reservation_t reservation;
+    esp_err_t ret;
+    int len;
+
+    ret = mqtt_connection_reserve_message(MQTT_PUBLISH_QUEUE_LANE_EVENT, mqtt_connection_get_topic(topic), MQTT_CONNECTION_METRIC_PAYLOAD_SIZE, 0, &reservation);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    len = mqtt_connection_format_text(reservation.payload, reservation.payload_size, key, value);
+    if (len < 0) {
+        mqtt_connection_abort_message(&reservation);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // State changes are events, every one of them is delivered
+    return mqtt_connection_commit_message(&reservation, len);
+}
+
+void mqtt_connection_get_queue_stats(enum mqtt_publish_queue_lane_t lane, struct mqtt_publish_queue_stats_t *stats){
+    mqtt_publish_queue_get_stats(lane, stats);
+}
+
+#if CONFIG_HOMEPOST_MQTT_SHAPER
+esp_err_t mqtt_connection_set_shaper_rate(enum mqtt_publish_queue_lane_t lane, uint32_t rate){
+    buckets[lane].rate = rate;
+    return ESP_OK;
+}
+
+void mqtt_connection_get_shaper_stats(enum mqtt_publish_queue_lane_t lane, struct mqtt_connection_shaper_stats_t *stats){
+    const struct mqtt_connection_bucket_t *bucket = &buckets[lane];
+
+    stats->rate = bucket->rate;
+    stats->burst = bucket->burst;
+    stats->tokens = bucket->tokens;
+    stats->throttled = bucket->throttled;
+    stats->throttled_ms = bucket->throttled_ms;
+    if(bucket->throttled){
+        stats->throttled_ms += pdTICKS_TO_MS(xTaskGetTickCount() - bucket->throttled_since);
+    }
+    stats->throttle_events = bucket->throttle_events;
+}
+#endif
+
+void mqtt_connection_get_stats(struct mqtt_connection_stats_t *stats){
+    *stats = mqtt_connection_stats;
+    stats->inflight = inflight_count;
+}
+
+const char *mqtt_connection_get_protocol(void){
+#if CONFIG_HOMEPOST_MQTT_PROTOCOL_V5
+    return mqtt5_enabled ? "5" : "3.1.1";
+#else
+    return "3.1.1";
+#endif
+}
+
+esp_err_t mqtt_connection_build_topics(void){
+    char base_topic[MQTT_CONNECTION_TOPIC_MAX_LEN];
+    uint8_t next = !__atomic_load_n(&topic_active, __ATOMIC_ACQUIRE);
+    char *arena = topic_arenas[next];
+    size_t used = 0;
+    int len;
+
+    if (mqtt_connection_get_base_topic(base_topic, sizeof(base_topic)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to get base topic, using default");
+        strncpy(base_topic, CONFIG_HOMEPOST_MQTT_TOPIC, sizeof(base_topic) - 1);
+        base_topic[sizeof(base_topic) - 1] = '\0';
+    }
+
+    for (int i = 0; i < MQTT_CONNECTION_TOPIC_COUNT; i++) {
+        len = snprintf(arena + used, sizeof(topic_arenas[next]) - used, "%s/%s%s",
+                       base_topic, topic_specs[i].name, topic_specs[i].encoded ? MQTT_CONNECTION_TOPIC_SUFFIX : "");
+        if (len < 0 || len >= sizeof(topic_arenas[next]) - used) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        topic_offsets[next][i] = used;
+        used += len + 1;
+    }
+
+    __atomic_store_n(&topic_active, next, __ATOMIC_RELEASE);
+    ESP_LOGI(TAG, "MQTT topics built for base topic %s, %u bytes", base_topic, used);
+
+    return ESP_OK;
+}
+
+const char *mqtt_connection_get_topic(enum mqtt_connection_topic_t topic){
+    uint8_t active = __atomic_load_n(&topic_active, __ATOMIC_ACQUIRE);
+
+    return &topic_arenas[active][topic_offsets[active][topic]];
 }
 
 esp_err_t mqtt_connection_get_base_topic(char *topic_out, size_t topic_out_size){
@@ -0,0 +1,472 @@
+#include "mqtt_outbox.h"
+#include "mqtt_publish_queue.h"
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define MQTT_OUTBOX_SEGMENT_SIZE                4096
+#define MQTT_OUTBOX_SEGMENT_MAGIC               0x424F5048
+#define MQTT_OUTBOX_MAX_PARTITION_SIZE          (1 << MQTT_OUTBOX_TAG_SEQUENCE_SHIFT)
+#define MQTT_OUTBOX_MAX_RECORD_SIZE             512
+#define MQTT_OUTBOX_RECORD_ALIGN(x)             (((x) + 3) & ~3)
+#define MQTT_OUTBOX_RECORD_ERASED               0xFF
+#define MQTT_OUTBOX_RECORD_WRITTEN              0xFE
+#define MQTT_OUTBOX_RECORD_CONSUMED             0x00
+#define MQTT_OUTBOX_TAG_SEQUENCE_SHIFT          20
+#define MQTT_OUTBOX_TAG_OFFSET_MASK             ((1 << MQTT_OUTBOX_TAG_SEQUENCE_SHIFT) - 1)
+#define MQTT_OUTBOX_WRITE_TOKEN_PERIOD          pdMS_TO_TICKS(3600000 / CONFIG_HOMEPOST_MQTT_OUTBOX_MAX_WRITES_PER_HOUR)
+#define MQTT_OUTBOX_WRITE_TOKEN_BURST           ((CONFIG_HOMEPOST_MQTT_OUTBOX_MAX_WRITES_PER_HOUR + 9) / 10)
+
+/*
+ * The partition is split into flash sectors used as segments in round-robin
+ * order, so every sector is erased equally often. Records are only appended,
+ * their state byte is programmed from ERASED to WRITTEN once the record is
+ * complete and to CONSUMED once the message is delivered, all without an
+ * erase. A segment is erased only when the writer comes back to it.
+ */
+struct mqtt_outbox_segment_header_t {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t erase_count;
+    uint32_t reserved;
+};
+
+struct mqtt_outbox_record_t {
+    uint8_t state;
+    uint8_t qos;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t lane;
+    uint8_t reserved;
+    uint32_t crc;
+};
+
+struct mqtt_outbox_segment_t {
+    uint32_t sequence;
+    uint32_t erase_count;
+    uint16_t pending;
+    uint16_t end;
+};
+
+static const char *TAG = __FILE__;
+
+static const esp_partition_t *outbox_partition = NULL;
+static struct mqtt_outbox_segment_t *outbox_segments = NULL;
+static uint32_t outbox_segment_count = 0;
+static uint32_t outbox_write_segment = 0;
+static uint32_t outbox_next_sequence = 1;
+static uint32_t outbox_drain_segment = 0;
+static uint32_t outbox_drain_offset = sizeof(struct mqtt_outbox_segment_header_t);
+static uint32_t outbox_write_tokens = MQTT_OUTBOX_WRITE_TOKEN_BURST;
+static TickType_t outbox_write_tokens_updated = 0;
+static bool outbox_throttled = false;
+static uint8_t outbox_scratch[MQTT_OUTBOX_MAX_RECORD_SIZE];
+static struct mqtt_outbox_stats_t outbox_stats;
+
+static inline uint32_t mqtt_outbox_record_size(const struct mqtt_outbox_record_t *record){
+    return MQTT_OUTBOX_RECORD_ALIGN(sizeof(struct mqtt_outbox_record_t) + record->topic_len + record->payload_len);
+}
+
+// Records written before the lane was stored read back as erased flash and go to telemetry
+static inline uint8_t mqtt_outbox_record_lane(const struct mqtt_outbox_record_t *record){
+    return record->lane < MQTT_PUBLISH_QUEUE_LANE_COUNT ? record->lane : MQTT_PUBLISH_QUEUE_LANE_TELEMETRY;
+}
+
+/*
+ * The CRC only covers the body, so a damaged header is caught here: the body
+ * plus the terminator drain adds to the topic has to fit the scratch buffer
+ * and the record has to end inside the written part of its segment.
+ */
+static inline bool mqtt_outbox_record_fits(const struct mqtt_outbox_record_t *record, uint32_t offset, uint32_t end){
+    return sizeof(*record) + record->topic_len + record->payload_len + 1 <= MQTT_OUTBOX_MAX_RECORD_SIZE &&
+           offset + mqtt_outbox_record_size(record) <= end;
+}
+
+static inline uint32_t mqtt_outbox_make_tag(uint32_t segment, uint32_t offset){
+    return (outbox_segments[segment].sequence << MQTT_OUTBOX_TAG_SEQUENCE_SHIFT) | (segment * MQTT_OUTBOX_SEGMENT_SIZE + offset);
+}
+
+/*
+ * Resolves a tag to its segment, returning false if the segment has been
+ * erased and reused since the message was drained.
+ */
+static bool mqtt_outbox_resolve_tag(uint32_t tag, uint32_t *segment, uint32_t *offset){
+    uint32_t location = tag & MQTT_OUTBOX_TAG_OFFSET_MASK;
+    uint32_t sequence_bits = tag >> MQTT_OUTBOX_TAG_SEQUENCE_SHIFT;
+
+    *segment = location / MQTT_OUTBOX_SEGMENT_SIZE;
+    *offset = location % MQTT_OUTBOX_SEGMENT_SIZE;
+    if (*segment >= outbox_segment_count) {
+        return false;
+    }
+
+    return ((outbox_segments[*segment].sequence << MQTT_OUTBOX_TAG_SEQUENCE_SHIFT) >> MQTT_OUTBOX_TAG_SEQUENCE_SHIFT) == sequence_bits;
+}
+
+static void mqtt_outbox_scan_segment(uint32_t index){
+    struct mqtt_outbox_segment_t *segment = &outbox_segments[index];
+    struct mqtt_outbox_segment_header_t header;
+    struct mqtt_outbox_record_t record;
+    uint32_t base = index * MQTT_OUTBOX_SEGMENT_SIZE;
+    uint32_t offset = sizeof(header);
+
+    memset(segment, 0, sizeof(*segment));
+
+    if (esp_partition_read(outbox_partition, base, &header, sizeof(header)) != ESP_OK || header.magic != MQTT_OUTBOX_SEGMENT_MAGIC) {
+        return;
+    }
+
+    segment->sequence = header.sequence;
+    segment->erase_count = header.erase_count;
+
+    while (offset + sizeof(record) <= MQTT_OUTBOX_SEGMENT_SIZE) {
+        if (esp_partition_read(outbox_partition, base + offset, &record, sizeof(record)) != ESP_OK) {
+            offset = MQTT_OUTBOX_SEGMENT_SIZE;
+            break;
+        }
+        if (record.state == MQTT_OUTBOX_RECORD_ERASED && record.topic_len == UINT16_MAX) {
+            break;
+        }
+        if (!mqtt_outbox_record_fits(&record, offset, MQTT_OUTBOX_SEGMENT_SIZE)) {
+            // Torn header, nothing after it can be trusted
+            offset = MQTT_OUTBOX_SEGMENT_SIZE;
+            break;
+        }
+        if (record.state == MQTT_OUTBOX_RECORD_WRITTEN) {
+            segment->pending++;
+        }
+        offset += mqtt_outbox_record_size(&record);
+    }
+
+    segment->end = offset;
+}
+
+static esp_err_t mqtt_outbox_open_segment(void){
+    uint32_t index = (outbox_write_segment + 1) % outbox_segment_count;
+    struct mqtt_outbox_segment_t *segment = &outbox_segments[index];
+    struct mqtt_outbox_segment_header_t header;
+    esp_err_t ret;
+
+    if (segment->pending > 0) {
+        ESP_LOGW(TAG, "Outbox full, overwriting %u undelivered messages", segment->pending);
+        outbox_stats.overwritten += segment->pending;
+        outbox_stats.backlog -= segment->pending;
+    }
+
+    if (outbox_drain_segment == index && segment->sequence != 0) {
+        outbox_drain_segment = (index + 1) % outbox_segment_count;
+        outbox_drain_offset = sizeof(header);
+    }
+
+    ret = esp_partition_erase_range(outbox_partition, index * MQTT_OUTBOX_SEGMENT_SIZE, MQTT_OUTBOX_SEGMENT_SIZE);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase outbox segment %lu: %s", index, esp_err_to_name(ret));
+        return ret;
+    }
+
+    segment->erase_count++;
+    outbox_stats.erases++;
+    if (segment->erase_count > outbox_stats.max_segment_erases) {
+        outbox_stats.max_segment_erases = segment->erase_count;
+    }
+
+    header.magic = MQTT_OUTBOX_SEGMENT_MAGIC;
+    header.sequence = outbox_next_sequence;
+    header.erase_count = segment->erase_count;
+    header.reserved = UINT32_MAX;
+
+    ret = esp_partition_write(outbox_partition, index * MQTT_OUTBOX_SEGMENT_SIZE, &header, sizeof(header));
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write outbox segment header: %s", esp_err_to_name(ret));
+        segment->sequence = 0;
+        return ret;
+    }
+
+    segment->sequence = outbox_next_sequence++;
+    segment->pending = 0;
+    segment->end = sizeof(header);
+    outbox_write_segment = index;
+
+    return ESP_OK;
+}
+
+static void mqtt_outbox_refill_write_tokens(void){
+    TickType_t now = xTaskGetTickCount();
+    uint32_t refill = (now - outbox_write_tokens_updated) / MQTT_OUTBOX_WRITE_TOKEN_PERIOD;
+
+    if (outbox_write_tokens + refill >= MQTT_OUTBOX_WRITE_TOKEN_BURST) {
+        outbox_write_tokens = MQTT_OUTBOX_WRITE_TOKEN_BURST;
+        outbox_write_tokens_updated = now;
+    } else {
+        outbox_write_tokens += refill;
+        outbox_write_tokens_updated += refill * MQTT_OUTBOX_WRITE_TOKEN_PERIOD;
+    }
+}
+
+esp_err_t mqtt_outbox_init(void){
+    uint32_t newest_sequence = 0;
+
+    if (outbox_partition != NULL) {
+        return ESP_OK;
+    }
+
+    outbox_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_HOMEPOST_MQTT_OUTBOX_PARTITION_LABEL);
+    if (outbox_partition == NULL) {
+        ESP_LOGW(TAG, "Partition '%s' not found, MQTT outbox disabled", CONFIG_HOMEPOST_MQTT_OUTBOX_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (outbox_partition->size > MQTT_OUTBOX_MAX_PARTITION_SIZE || outbox_partition->size < 2 * MQTT_OUTBOX_SEGMENT_SIZE) {
+        ESP_LOGE(TAG, "Outbox partition size %lu not supported", outbox_partition->size);
+        outbox_partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    outbox_segment_count = outbox_partition->size / MQTT_OUTBOX_SEGMENT_SIZE;
+    outbox_segments = calloc(outbox_segment_count, sizeof(struct mqtt_outbox_segment_t));
+    if (outbox_segments == NULL) {
+        outbox_partition = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The writer continues in the newest segment, which starts out as the one before segment 0
+    outbox_write_segment = outbox_segment_count - 1;
+    for (uint32_t i = 0; i < outbox_segment_count; i++) {
+        mqtt_outbox_scan_segment(i);
+        outbox_stats.backlog += outbox_segments[i].pending;
+        if (outbox_segments[i].erase_count > outbox_stats.max_segment_erases) {
+            outbox_stats.max_segment_erases = outbox_segments[i].erase_count;
+        }
+        if (outbox_segments[i].sequence > newest_sequence) {
+            newest_sequence = outbox_segments[i].sequence;
+            outbox_write_segment = i;
+        }
+    }
+    outbox_next_sequence = newest_sequence + 1;
+
+    // Drain from the oldest segment still in use
+    outbox_drain_segment = outbox_write_segment;
+    for (uint32_t i = 1; i <= outbox_segment_count; i++) {
+        uint32_t index = (outbox_write_segment + i) % outbox_segment_count;
+        if (outbox_segments[index].sequence != 0) {
+            outbox_drain_segment = index;
+            break;
+        }
+    }
+    outbox_drain_offset = sizeof(struct mqtt_outbox_segment_header_t);
+
+    outbox_write_tokens_updated = xTaskGetTickCount();
+    outbox_stats.available = true;
+    outbox_stats.segments = outbox_segment_count;
+    outbox_stats.backlog_high_water = outbox_stats.backlog;
+
+    ESP_LOGI(TAG, "MQTT outbox mounted: %lu segments, %lu messages waiting", outbox_segment_count, outbox_stats.backlog);
+
+    return ESP_OK;
+}
+
+bool mqtt_outbox_is_available(void){
+    return outbox_stats.available;
+}
+
+bool mqtt_outbox_has_write_budget(void){
+    if (!outbox_stats.available) {
+        return false;
+    }
+
+    mqtt_outbox_refill_write_tokens();
+    if (outbox_write_tokens == 0 && !outbox_throttled) {
+        ESP_LOGW(TAG, "Outbox write budget used up, spilling paused");
+        outbox_stats.rate_limited++;
+    }
+    outbox_throttled = outbox_write_tokens == 0;
+
+    return !outbox_throttled;
+}
+
+esp_err_t mqtt_outbox_append(uint8_t lane, const char *topic, const char *payload, size_t payload_len, uint8_t qos){
+    struct mqtt_outbox_record_t *record = (struct mqtt_outbox_record_t *)outbox_scratch;
+    struct mqtt_outbox_segment_t *segment;
+    size_t topic_len;
+    uint32_t size;
+    uint32_t address;
+    uint8_t state = MQTT_OUTBOX_RECORD_WRITTEN;
+    esp_err_t ret;
+
+    if (!outbox_stats.available) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    topic_len = strlen(topic);
+    size = MQTT_OUTBOX_RECORD_ALIGN(sizeof(*record) + topic_len + payload_len);
+    // Drain needs one more byte to terminate the topic
+    if (sizeof(*record) + topic_len + payload_len + 1 > sizeof(outbox_scratch)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mqtt_outbox_refill_write_tokens();
+    if (outbox_write_tokens == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    outbox_write_tokens--;
+
+    segment = &outbox_segments[outbox_write_segment];
+    if (segment->sequence == 0 || segment->end + size > MQTT_OUTBOX_SEGMENT_SIZE) {
+        ret = mqtt_outbox_open_segment();
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        segment = &outbox_segments[outbox_write_segment];
+    }
+
+    memset(outbox_scratch, 0xFF, size);
+    record->qos = qos;
+    record->lane = lane;
+    record->topic_len = topic_len;
+    record->payload_len = payload_len;
+    memcpy(outbox_scratch + sizeof(*record), topic, topic_len);
+    memcpy(outbox_scratch + sizeof(*record) + topic_len, payload, payload_len);
+    record->crc = esp_rom_crc32_le(0, outbox_scratch + sizeof(*record), topic_len + payload_len);
+
+    // The state byte is programmed last, a record cut short by a reset stays ERASED and is skipped
+    address = outbox_write_segment * MQTT_OUTBOX_SEGMENT_SIZE + segment->end;
+    ret = esp_partition_write(outbox_partition, address, outbox_scratch, size);
+    if (ret == ESP_OK) {
+        ret = esp_partition_write(outbox_partition, address, &state, sizeof(state));
+    }
+    segment->end += size;
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write outbox record: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    segment->pending++;
+    outbox_stats.written++;
+    outbox_stats.backlog++;
+    if (outbox_stats.backlog > outbox_stats.backlog_high_water) {
+        outbox_stats.backlog_high_water = outbox_stats.backlog;
+    }
+
+    return ESP_OK;
+}
+
+uint32_t mqtt_outbox_drain(uint32_t max_messages){
+    struct mqtt_outbox_record_t record;
+    struct mqtt_publish_queue_reservation_t reservation;
+    uint32_t loaded = 0;
+
+    if (!outbox_stats.available) {
+        return 0;
+    }
+
+    while (loaded < max_messages) {
+        struct mqtt_outbox_segment_t *segment = &outbox_segments[outbox_drain_segment];
+        uint32_t address = outbox_drain_segment * MQTT_OUTBOX_SEGMENT_SIZE + outbox_drain_offset;
+        uint32_t size;
+        char *topic = (char *)outbox_scratch;
+
+        if (segment->sequence == 0 || outbox_drain_offset >= segment->end) {
+            if (outbox_drain_segment == outbox_write_segment) {
+                break;
+            }
+            outbox_drain_segment = (outbox_drain_segment + 1) % outbox_segment_count;
+            outbox_drain_offset = sizeof(struct mqtt_outbox_segment_header_t);
+            continue;
+        }
+
+        if (esp_partition_read(outbox_partition, address, &record, sizeof(record)) != ESP_OK) {
+            break;
+        }
+        size = mqtt_outbox_record_size(&record);
+
+        if (!mqtt_outbox_record_fits(&record, outbox_drain_offset, segment->end)) {
+            // Torn header, nothing after it in this segment can be trusted
+            ESP_LOGW(TAG, "Outbox record at 0x%lx has a bad header, skipping the rest of its segment", address);
+            if (record.state == MQTT_OUTBOX_RECORD_WRITTEN) {
+                mqtt_outbox_consume(mqtt_outbox_make_tag(outbox_drain_segment, outbox_drain_offset));
+            }
+            outbox_drain_offset = segment->end;
+            continue;
+        }
+
+        if (record.state != MQTT_OUTBOX_RECORD_WRITTEN) {
+            outbox_drain_offset += size;
+            continue;
+        }
+
+        if (esp_partition_read(outbox_partition, address + sizeof(record), outbox_scratch, record.topic_len + record.payload_len) != ESP_OK) {
+            break;
+        }
+        if (esp_rom_crc32_le(0, outbox_scratch, record.topic_len + record.payload_len) != record.crc) {
+            ESP_LOGW(TAG, "Outbox record at 0x%lx is corrupted, discarding", address);
+            mqtt_outbox_consume(mqtt_outbox_make_tag(outbox_drain_segment, outbox_drain_offset));
+            outbox_drain_offset += size;
+            continue;
+        }
+
+        // Make the topic a string in place, the payload moves one byte up
+        memmove(outbox_scratch + record.topic_len + 1, outbox_scratch + record.topic_len, record.payload_len);
+        topic[record.topic_len] = '\0';
+
+        if (mqtt_publish_queue_reserve(mqtt_outbox_record_lane(&record), topic, record.payload_len + 1, record.qos, &reservation) != ESP_OK) {
+            // Publish queue is full, continue from this record next time
+            break;
+        }
+        memcpy(reservation.payload, outbox_scratch + record.topic_len + 1, record.payload_len);
+        reservation.tag = mqtt_outbox_make_tag(outbox_drain_segment, outbox_drain_offset);
+        mqtt_publish_queue_commit(&reservation, record.payload_len);
+
+        outbox_drain_offset += size;
+        outbox_stats.drained++;
+        loaded++;
+    }
+
+    return loaded;
+}
+
+void mqtt_outbox_consume(uint32_t tag){
+    uint8_t state = MQTT_OUTBOX_RECORD_CONSUMED;
+    uint32_t segment;
+    uint32_t offset;
+
+    if (!outbox_stats.available || !mqtt_outbox_resolve_tag(tag, &segment, &offset)) {
+        return;
+    }
+
+    if (esp_partition_write(outbox_partition, segment * MQTT_OUTBOX_SEGMENT_SIZE + offset, &state, sizeof(state)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mark outbox record consumed");
+    }
+
+    if (outbox_segments[segment].pending > 0) {
+        outbox_segments[segment].pending--;
+        outbox_stats.backlog--;
+    }
+    outbox_stats.consumed++;
+}
+
+void mqtt_outbox_requeue(uint32_t tag){
+    uint32_t segment;
+    uint32_t offset;
+
+    if (!outbox_stats.available || !mqtt_outbox_resolve_tag(tag, &segment, &offset)) {
+        return;
+    }
+
+    if (outbox_segments[segment].sequence < outbox_segments[outbox_drain_segment].sequence ||
+        (segment == outbox_drain_segment && offset < outbox_drain_offset)) {
+        outbox_drain_segment = segment;
+        outbox_drain_offset = offset;
+    }
+}
+
+uint32_t mqtt_outbox_get_backlog(void){
+    return outbox_stats.backlog;
+}
+
+void mqtt_outbox_get_stats(struct mqtt_outbox_stats_t *stats){
+    *stats = outbox_stats;
+}
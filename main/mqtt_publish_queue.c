@@ -0,0 +1,565 @@
+#include "mqtt_publish_queue.h"
+#include <string.h>
+#include <esp_log.h>
+#include <freertos/semphr.h>
+
+#define MQTT_PUBLISH_QUEUE_ALIGNMENT                8
+#define MQTT_PUBLISH_QUEUE_ALIGN(x)                 (((x) + MQTT_PUBLISH_QUEUE_ALIGNMENT - 1) & ~((size_t)MQTT_PUBLISH_QUEUE_ALIGNMENT - 1))
+#define MQTT_PUBLISH_QUEUE_CAPACITY(size)           ((size) & ~(MQTT_PUBLISH_QUEUE_ALIGNMENT - 1))
+#define MQTT_PUBLISH_QUEUE_EVENT_CAPACITY           MQTT_PUBLISH_QUEUE_CAPACITY(CONFIG_HOMEPOST_MQTT_EVENT_QUEUE_SIZE_BYTES)
+#define MQTT_PUBLISH_QUEUE_TELEMETRY_CAPACITY       MQTT_PUBLISH_QUEUE_CAPACITY(CONFIG_HOMEPOST_MQTT_PUBLISH_QUEUE_SIZE_BYTES)
+#define MQTT_PUBLISH_QUEUE_NO_SPACE                 SIZE_MAX
+#define MQTT_PUBLISH_QUEUE_LATEST_SLOTS             CONFIG_HOMEPOST_MQTT_COALESCE_TOPICS
+
+/*
+ * Messages are stored back to back in a preallocated byte ring per lane. Every
+ * record starts with this header followed by the NUL terminated topic and
+ * payload. Records never wrap: when the tail of the buffer is too short the
+ * remainder is filled with a padding record and the message starts at 0.
+ *
+ * tail            read                          head
+ *  |  in flight /  |  committed, waiting for the  |  free
+ *  |  done         |  publish loop                |
+ */
+enum mqtt_publish_queue_record_state_t {
+    MQTT_PUBLISH_QUEUE_RECORD_RESERVED = 0,
+    MQTT_PUBLISH_QUEUE_RECORD_COMMITTED,
+    MQTT_PUBLISH_QUEUE_RECORD_INFLIGHT,
+    MQTT_PUBLISH_QUEUE_RECORD_DONE,
+    MQTT_PUBLISH_QUEUE_RECORD_PADDING,
+};
+
+struct mqtt_publish_queue_record_t {
+    uint16_t size;
+    uint8_t state;
+    uint8_t qos;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint32_t tag;
+    TickType_t enqueued_at;
+    char data[];
+};
+
+/*
+ * Latest-value index: one slot per topic that has a committed record not yet
+ * handed to the publish loop. A slot is cleared when its record is peeked or
+ * superseded, so every slot always points at a COMMITTED record.
+ */
+struct mqtt_publish_queue_latest_slot_t {
+    uint32_t hash;
+    struct mqtt_publish_queue_record_t *record;
+};
+
+struct mqtt_publish_queue_lane_state_t {
+    uint8_t *buffer;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    size_t read;
+    size_t used;
+    size_t read_used;
+    uint32_t unread;
+    uint64_t latency_sum_ms;
+    struct mqtt_publish_queue_latest_slot_t latest[MQTT_PUBLISH_QUEUE_LATEST_SLOTS];
+    struct mqtt_publish_queue_stats_t stats;
+};
+
+static const char *TAG = __FILE__;
+
+static uint8_t event_buffer[MQTT_PUBLISH_QUEUE_EVENT_CAPACITY] __attribute__((aligned(MQTT_PUBLISH_QUEUE_ALIGNMENT)));
+static uint8_t telemetry_buffer[MQTT_PUBLISH_QUEUE_TELEMETRY_CAPACITY] __attribute__((aligned(MQTT_PUBLISH_QUEUE_ALIGNMENT)));
+
+static struct mqtt_publish_queue_lane_state_t queue_lanes[MQTT_PUBLISH_QUEUE_LANE_COUNT] = {
+    [MQTT_PUBLISH_QUEUE_LANE_EVENT] = {
+        .buffer = event_buffer,
+        .capacity = MQTT_PUBLISH_QUEUE_EVENT_CAPACITY,
+        .stats.capacity = MQTT_PUBLISH_QUEUE_EVENT_CAPACITY,
+    },
+    [MQTT_PUBLISH_QUEUE_LANE_TELEMETRY] = {
+        .buffer = telemetry_buffer,
+        .capacity = MQTT_PUBLISH_QUEUE_TELEMETRY_CAPACITY,
+        .stats.capacity = MQTT_PUBLISH_QUEUE_TELEMETRY_CAPACITY,
+    },
+};
+static uint32_t queue_event_streak = 0;
+
+static SemaphoreHandle_t queue_mutex = NULL;
+static SemaphoreHandle_t queue_data_sem = NULL;
+
+static inline struct mqtt_publish_queue_record_t *mqtt_publish_queue_record_at(struct mqtt_publish_queue_lane_state_t *lane, size_t offset){
+    return (struct mqtt_publish_queue_record_t *)&lane->buffer[offset];
+}
+
+static inline size_t mqtt_publish_queue_offset_of(struct mqtt_publish_queue_lane_state_t *lane, const struct mqtt_publish_queue_record_t *record){
+    return (const uint8_t *)record - lane->buffer;
+}
+
+static inline size_t mqtt_publish_queue_advance(struct mqtt_publish_queue_lane_state_t *lane, size_t offset, size_t size){
+    offset += size;
+    return offset == lane->capacity ? 0 : offset;
+}
+
+static uint32_t mqtt_publish_queue_topic_hash(const char *topic){
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*topic) {
+        hash ^= (uint8_t)*topic++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct mqtt_publish_queue_latest_slot_t *mqtt_publish_queue_latest_find(struct mqtt_publish_queue_lane_state_t *lane, const struct mqtt_publish_queue_record_t *record, uint32_t hash){
+    for (int i = 0; i < MQTT_PUBLISH_QUEUE_LATEST_SLOTS; i++) {
+        struct mqtt_publish_queue_latest_slot_t *slot = &lane->latest[i];
+        if (slot->record != NULL && slot->hash == hash &&
+            slot->record->topic_len == record->topic_len && strcmp(slot->record->data, record->data) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void mqtt_publish_queue_latest_forget(struct mqtt_publish_queue_lane_state_t *lane, const struct mqtt_publish_queue_record_t *record){
+    for (int i = 0; i < MQTT_PUBLISH_QUEUE_LATEST_SLOTS; i++) {
+        if (lane->latest[i].record == record) {
+            lane->latest[i].record = NULL;
+            return;
+        }
+    }
+}
+
+static void mqtt_publish_queue_reset_if_empty(struct mqtt_publish_queue_lane_state_t *lane){
+    if (lane->used == 0) {
+        lane->head = 0;
+        lane->tail = 0;
+        lane->read = 0;
+        lane->read_used = 0;
+    }
+}
+
+static size_t mqtt_publish_queue_allocate(struct mqtt_publish_queue_lane_state_t *lane, size_t size){
+    size_t offset;
+
+    if (size > lane->capacity - lane->used) {
+        return MQTT_PUBLISH_QUEUE_NO_SPACE;
+    }
+
+    if (lane->head >= lane->tail) {
+        size_t end_space = lane->capacity - lane->head;
+        if (size > end_space) {
+            if (size > lane->tail) {
+                return MQTT_PUBLISH_QUEUE_NO_SPACE;
+            }
+            struct mqtt_publish_queue_record_t *padding = mqtt_publish_queue_record_at(lane, lane->head);
+            padding->size = end_space;
+            padding->state = MQTT_PUBLISH_QUEUE_RECORD_PADDING;
+            lane->used += end_space;
+            lane->head = 0;
+        }
+    } else if (size > lane->tail - lane->head) {
+        return MQTT_PUBLISH_QUEUE_NO_SPACE;
+    }
+
+    offset = lane->head;
+    lane->head = mqtt_publish_queue_advance(lane, lane->head, size);
+    lane->used += size;
+
+    return offset;
+}
+
+static void mqtt_publish_queue_reclaim(struct mqtt_publish_queue_lane_state_t *lane){
+    while (lane->used > 0) {
+        struct mqtt_publish_queue_record_t *record = mqtt_publish_queue_record_at(lane, lane->tail);
+        if (record->state != MQTT_PUBLISH_QUEUE_RECORD_DONE && record->state != MQTT_PUBLISH_QUEUE_RECORD_PADDING) {
+            break;
+        }
+
+        if (lane->read_used == 0) {
+            // Padding the publish loop has not stepped over yet
+            lane->read = mqtt_publish_queue_advance(lane, lane->read, record->size);
+        } else {
+            lane->read_used -= record->size;
+        }
+        lane->used -= record->size;
+        lane->tail = mqtt_publish_queue_advance(lane, lane->tail, record->size);
+    }
+
+    mqtt_publish_queue_reset_if_empty(lane);
+}
+
+static struct mqtt_publish_queue_record_t *mqtt_publish_queue_lane_peek(struct mqtt_publish_queue_lane_state_t *lane){
+    while (lane->unread > 0 && lane->read_used < lane->used) {
+        struct mqtt_publish_queue_record_t *record = mqtt_publish_queue_record_at(lane, lane->read);
+
+        lane->read = mqtt_publish_queue_advance(lane, lane->read, record->size);
+        lane->read_used += record->size;
+
+        if (record->state == MQTT_PUBLISH_QUEUE_RECORD_COMMITTED) {
+            record->state = MQTT_PUBLISH_QUEUE_RECORD_INFLIGHT;
+            lane->unread--;
+            mqtt_publish_queue_latest_forget(lane, record);
+            return record;
+        }
+    }
+
+    return NULL;
+}
+
+static void mqtt_publish_queue_lane_rewind(struct mqtt_publish_queue_lane_state_t *lane){
+    size_t offset = lane->tail;
+    size_t walked = 0;
+
+    while (walked < lane->read_used) {
+        struct mqtt_publish_queue_record_t *record = mqtt_publish_queue_record_at(lane, offset);
+        if (record->state == MQTT_PUBLISH_QUEUE_RECORD_INFLIGHT) {
+            record->state = MQTT_PUBLISH_QUEUE_RECORD_COMMITTED;
+            lane->unread++;
+        }
+        walked += record->size;
+        offset = mqtt_publish_queue_advance(lane, offset, record->size);
+    }
+    lane->read = lane->tail;
+    lane->read_used = 0;
+}
+
+// Records after it that are still in flight are stepped over by the next peek
+static void mqtt_publish_queue_lane_unpeek(struct mqtt_publish_queue_lane_state_t *lane, struct mqtt_publish_queue_record_t *record){
+    size_t offset = lane->tail;
+    size_t walked = 0;
+
+    while (walked < lane->read_used && offset != mqtt_publish_queue_offset_of(lane, record)) {
+        size_t size = mqtt_publish_queue_record_at(lane, offset)->size;
+        walked += size;
+        offset = mqtt_publish_queue_advance(lane, offset, size);
+    }
+
+    record->state = MQTT_PUBLISH_QUEUE_RECORD_COMMITTED;
+    lane->unread++;
+    lane->read = offset;
+    lane->read_used = walked;
+}
+
+esp_err_t mqtt_publish_queue_init(void){
+    if (queue_mutex == NULL) {
+        queue_mutex = xSemaphoreCreateMutex();
+        if (queue_mutex == NULL) {
+            ESP_LOGE(TAG, "Failed to create publish queue mutex");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (queue_data_sem == NULL) {
+        queue_data_sem = xSemaphoreCreateBinary();
+        if (queue_data_sem == NULL) {
+            ESP_LOGE(TAG, "Failed to create publish queue semaphore");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_queue_reserve(enum mqtt_publish_queue_lane_t lane_id, const char *topic, size_t payload_size, uint8_t qos, struct mqtt_publish_queue_reservation_t *reservation){
+    struct mqtt_publish_queue_lane_state_t *lane;
+    struct mqtt_publish_queue_record_t *record;
+    size_t topic_len;
+    size_t size;
+    size_t offset;
+
+    if (lane_id >= MQTT_PUBLISH_QUEUE_LANE_COUNT || topic == NULL || reservation == NULL || payload_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (queue_mutex == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lane = &queue_lanes[lane_id];
+    topic_len = strlen(topic);
+    size = MQTT_PUBLISH_QUEUE_ALIGN(sizeof(struct mqtt_publish_queue_record_t) + topic_len + 1 + payload_size);
+    if (size > UINT16_MAX || size > lane->capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    offset = mqtt_publish_queue_allocate(lane, size);
+    if (offset == MQTT_PUBLISH_QUEUE_NO_SPACE) {
+        lane->stats.dropped++;
+        xSemaphoreGive(queue_mutex);
+        return ESP_ERR_NO_MEM;
+    }
+
+    record = mqtt_publish_queue_record_at(lane, offset);
+    record->size = size;
+    record->state = MQTT_PUBLISH_QUEUE_RECORD_RESERVED;
+    record->qos = qos;
+    record->topic_len = topic_len;
+    record->payload_len = 0;
+    memcpy(record->data, topic, topic_len + 1);
+
+    reservation->payload = record->data + topic_len + 1;
+    reservation->payload_size = size - sizeof(struct mqtt_publish_queue_record_t) - topic_len - 1;
+    reservation->tag = 0;
+    reservation->lane = lane_id;
+    reservation->record = record;
+
+    // The mutex stays taken until the reservation is committed or aborted
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_queue_commit(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len){
+    struct mqtt_publish_queue_lane_state_t *lane = &queue_lanes[reservation->lane];
+    struct mqtt_publish_queue_record_t *record = reservation->record;
+    size_t size;
+
+    if (payload_len >= reservation->payload_size) {
+        mqtt_publish_queue_abort(reservation);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // The reservation is always the newest record, so shrinking it only moves the head back
+    size = MQTT_PUBLISH_QUEUE_ALIGN(sizeof(struct mqtt_publish_queue_record_t) + record->topic_len + 1 + payload_len + 1);
+    lane->used -= record->size - size;
+    lane->head = mqtt_publish_queue_advance(lane, mqtt_publish_queue_offset_of(lane, record), size);
+
+    reservation->payload[payload_len] = '\0';
+    record->size = size;
+    record->payload_len = payload_len;
+    record->tag = reservation->tag;
+    record->enqueued_at = xTaskGetTickCount();
+    record->state = MQTT_PUBLISH_QUEUE_RECORD_COMMITTED;
+
+    lane->unread++;
+    lane->stats.messages++;
+    lane->stats.committed++;
+    if (lane->stats.messages > lane->stats.messages_high_water) {
+        lane->stats.messages_high_water = lane->stats.messages;
+    }
+    if (lane->used > lane->stats.used_high_water) {
+        lane->stats.used_high_water = lane->used;
+    }
+
+    reservation->record = NULL;
+    xSemaphoreGive(queue_mutex);
+    xSemaphoreGive(queue_data_sem);
+
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_queue_commit_latest(struct mqtt_publish_queue_reservation_t *reservation, size_t payload_len){
+    struct mqtt_publish_queue_lane_state_t *lane = &queue_lanes[reservation->lane];
+    struct mqtt_publish_queue_record_t *record = reservation->record;
+    struct mqtt_publish_queue_record_t *pending;
+    struct mqtt_publish_queue_latest_slot_t *slot;
+    uint32_t hash;
+    size_t capacity;
+
+    if (payload_len >= reservation->payload_size) {
+        mqtt_publish_queue_abort(reservation);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    hash = mqtt_publish_queue_topic_hash(record->data);
+    slot = mqtt_publish_queue_latest_find(lane, record, hash);
+
+    if (slot != NULL) {
+        pending = slot->record;
+        capacity = pending->size - sizeof(struct mqtt_publish_queue_record_t) - pending->topic_len - 1;
+
+        if (payload_len < capacity) {
+            // Overwrite the waiting value in place and give the reservation back
+            memcpy(pending->data + pending->topic_len + 1, reservation->payload, payload_len);
+            pending->data[pending->topic_len + 1 + payload_len] = '\0';
+            pending->payload_len = payload_len;
+            pending->qos = record->qos;
+            pending->tag = reservation->tag;
+            pending->enqueued_at = xTaskGetTickCount();
+            lane->stats.coalesced++;
+            mqtt_publish_queue_abort(reservation);
+            return ESP_OK;
+        }
+
+        // Too big for the old slot, retire it and queue the new value at the head
+        pending->state = MQTT_PUBLISH_QUEUE_RECORD_DONE;
+        slot->record = NULL;
+        lane->unread--;
+        lane->stats.messages--;
+        lane->stats.coalesced++;
+        mqtt_publish_queue_reclaim(lane);
+    } else {
+        for (int i = 0; i < MQTT_PUBLISH_QUEUE_LATEST_SLOTS; i++) {
+            if (lane->latest[i].record == NULL) {
+                slot = &lane->latest[i];
+                break;
+            }
+        }
+    }
+
+    // With every slot taken the value is queued without coalescing
+    if (slot != NULL) {
+        slot->hash = hash;
+        slot->record = record;
+    }
+
+    return mqtt_publish_queue_commit(reservation, payload_len);
+}
+
+void mqtt_publish_queue_abort(struct mqtt_publish_queue_reservation_t *reservation){
+    struct mqtt_publish_queue_lane_state_t *lane = &queue_lanes[reservation->lane];
+    struct mqtt_publish_queue_record_t *record = reservation->record;
+
+    if (record == NULL) {
+        return;
+    }
+
+    lane->head = mqtt_publish_queue_offset_of(lane, record);
+    lane->used -= record->size;
+    mqtt_publish_queue_reclaim(lane);
+
+    reservation->record = NULL;
+    xSemaphoreGive(queue_mutex);
+}
+
+esp_err_t mqtt_publish_queue_peek(struct mqtt_publish_queue_item_t *item){
+    return mqtt_publish_queue_peek_lanes(MQTT_PUBLISH_QUEUE_ALL_LANES, item);
+}
+
+esp_err_t mqtt_publish_queue_peek_lanes(uint32_t lanes, struct mqtt_publish_queue_item_t *item){
+    struct mqtt_publish_queue_record_t *record = NULL;
+    enum mqtt_publish_queue_lane_t lane_id = MQTT_PUBLISH_QUEUE_LANE_EVENT;
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+#if CONFIG_HOMEPOST_MQTT_EVENT_LANE_WEIGHT > 0
+    // Let one telemetry message through after a run of events so it cannot starve
+    if (queue_event_streak >= CONFIG_HOMEPOST_MQTT_EVENT_LANE_WEIGHT && (lanes & MQTT_PUBLISH_QUEUE_LANE_BIT(MQTT_PUBLISH_QUEUE_LANE_TELEMETRY))) {
+        record = mqtt_publish_queue_lane_peek(&queue_lanes[MQTT_PUBLISH_QUEUE_LANE_TELEMETRY]);
+        if (record != NULL) {
+            lane_id = MQTT_PUBLISH_QUEUE_LANE_TELEMETRY;
+        }
+    }
+#endif
+
+    for (int i = 0; record == NULL && i < MQTT_PUBLISH_QUEUE_LANE_COUNT; i++) {
+        if (lanes & MQTT_PUBLISH_QUEUE_LANE_BIT(i)) {
+            record = mqtt_publish_queue_lane_peek(&queue_lanes[i]);
+            lane_id = i;
+        }
+    }
+
+    if (record != NULL) {
+        queue_event_streak = lane_id == MQTT_PUBLISH_QUEUE_LANE_EVENT ? queue_event_streak + 1 : 0;
+
+        item->topic = record->data;
+        item->payload = record->data + record->topic_len + 1;
+        item->payload_len = record->payload_len;
+        item->qos = record->qos;
+        item->tag = record->tag;
+        item->lane = lane_id;
+        item->enqueued_at = record->enqueued_at;
+        item->record = record;
+    }
+
+    xSemaphoreGive(queue_mutex);
+
+    return record != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+uint32_t mqtt_publish_queue_get_pending_lanes(void){
+    uint32_t lanes = 0;
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    for (int i = 0; i < MQTT_PUBLISH_QUEUE_LANE_COUNT; i++) {
+        if (queue_lanes[i].unread > 0) {
+            lanes |= MQTT_PUBLISH_QUEUE_LANE_BIT(i);
+        }
+    }
+    xSemaphoreGive(queue_mutex);
+
+    return lanes;
+}
+
+void mqtt_publish_queue_mark_sent(const struct mqtt_publish_queue_item_t *item){
+    struct mqtt_publish_queue_lane_state_t *lane = &queue_lanes[item->lane];
+    uint32_t latency_ms = pdTICKS_TO_MS(xTaskGetTickCount() - item->enqueued_at);
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    lane->stats.sent++;
+    lane->latency_sum_ms += latency_ms;
+    if (latency_ms > lane->stats.latency_max_ms) {
+        lane->stats.latency_max_ms = latency_ms;
+    }
+
+    xSemaphoreGive(queue_mutex);
+}
+
+void mqtt_publish_queue_release(struct mqtt_publish_queue_item_t *item){
+    struct mqtt_publish_queue_lane_state_t *lane;
+    struct mqtt_publish_queue_record_t *record = item->record;
+
+    if (record == NULL) {
+        return;
+    }
+
+    lane = &queue_lanes[item->lane];
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    record->state = MQTT_PUBLISH_QUEUE_RECORD_DONE;
+    lane->stats.messages--;
+    mqtt_publish_queue_reclaim(lane);
+
+    xSemaphoreGive(queue_mutex);
+
+    item->record = NULL;
+}
+
+void mqtt_publish_queue_unpeek(struct mqtt_publish_queue_item_t *item){
+    if (item->record == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    mqtt_publish_queue_lane_unpeek(&queue_lanes[item->lane], item->record);
+    xSemaphoreGive(queue_mutex);
+
+    item->record = NULL;
+}
+
+void mqtt_publish_queue_rewind(void){
+    xSemaphoreTake(queue_mutex, portMAX_DELAY);
+
+    for (int i = 0; i < MQTT_PUBLISH_QUEUE_LANE_COUNT; i++) {
+        mqtt_publish_queue_lane_rewind(&queue_lanes[i]);
+    }
+    queue_event_streak = 0;
+
+    xSemaphoreGive(queue_mutex);
+}
+
+bool mqtt_publish_queue_wait(TickType_t timeout){
+    return xSemaphoreTake(queue_data_sem, timeout) == pdTRUE;
+}
+
+void mqtt_publish_queue_wake(void){
+    xSemaphoreGive(queue_data_sem);
+}
+
+void mqtt_publish_queue_get_stats(enum mqtt_publish_queue_lane_t lane_id, struct mqtt_publish_queue_stats_t *stats){
+    struct mqtt_publish_queue_lane_state_t *lane = &queue_lanes[lane_id];
+
+    if (queue_mutex != NULL) {
+        xSemaphoreTake(queue_mutex, portMAX_DELAY);
+    }
+
+    *stats = lane->stats;
+    stats->used = lane->used;
+    stats->latency_avg_ms = lane->stats.sent > 0 ? lane->latency_sum_ms / lane->stats.sent : 0;
+
+    if (queue_mutex != NULL) {
+        xSemaphoreGive(queue_mutex);
+    }
+}
@@ -0,0 +1,269 @@
+#include "mqtt_tls.h"
+#include "internal_storage.h"
+#include <string.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <esp_log.h>
+#include <esp_tls.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_crt_bundle.h>
+
+#define MQTT_TLS_DEFAULT_PORT                   8883
+#define MQTT_TLS_HOST_MAX_LEN                   100
+
+struct mqtt_tls_transport_t {
+    esp_tls_t *tls;
+    char *ca_cert;
+    size_t ca_cert_len;
+};
+
+static const char *TAG = __FILE__;
+
+/*
+ * Only the MQTT client task connects, so the cached session needs no lock.
+ * It is tied to the broker it came from and dropped when the host changes.
+ */
+#if CONFIG_HOMEPOST_MQTT_TLS_SESSION_RESUMPTION
+static esp_tls_client_session_t *tls_session = NULL;
+static char tls_session_host[MQTT_TLS_HOST_MAX_LEN + 1];
+static int tls_session_port = 0;
+#endif
+static struct mqtt_tls_stats_t tls_stats;
+
+#if CONFIG_HOMEPOST_MQTT_TLS_SESSION_RESUMPTION
+static void mqtt_tls_session_forget(void){
+    if(tls_session != NULL){
+        esp_tls_free_client_session(tls_session);
+        tls_session = NULL;
+    }
+}
+
+static esp_tls_client_session_t *mqtt_tls_session_lookup(const char *host, int port){
+    if(tls_session != NULL && (port != tls_session_port || strcmp(host, tls_session_host) != 0)){
+        ESP_LOGI(TAG, "Broker changed, dropping cached TLS session");
+        mqtt_tls_session_forget();
+    }
+    return tls_session;
+}
+
+static void mqtt_tls_session_store(esp_tls_t *tls, const char *host, int port){
+    mqtt_tls_session_forget();
+    tls_session = esp_tls_get_client_session(tls);
+    if(tls_session == NULL){
+        ESP_LOGW(TAG, "Broker sent no TLS session to resume");
+        return;
+    }
+    strncpy(tls_session_host, host, sizeof(tls_session_host) - 1);
+    tls_session_host[sizeof(tls_session_host) - 1] = '\0';
+    tls_session_port = port;
+}
+#endif
+
+static void mqtt_tls_record_handshake(struct mqtt_tls_handshake_stats_t *stats, uint32_t duration_ms, uint32_t heap_peak, uint32_t heap_retained){
+    stats->count++;
+    stats->last_ms = duration_ms;
+    stats->avg_ms = (stats->avg_ms * (stats->count - 1) + duration_ms) / stats->count;
+    if(duration_ms > stats->max_ms){
+        stats->max_ms = duration_ms;
+    }
+    if(heap_peak > stats->heap_peak){
+        stats->heap_peak = heap_peak;
+    }
+    stats->heap_retained = heap_retained;
+}
+
+static int mqtt_tls_poll(esp_transport_handle_t transport, int timeout_ms, bool write){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+    struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    fd_set fds;
+    int sockfd;
+
+    if(context->tls == NULL || esp_tls_get_conn_sockfd(context->tls, &sockfd) != ESP_OK){
+        return -1;
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(sockfd, &fds);
+    return select(sockfd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, timeout_ms < 0 ? NULL : &timeout);
+}
+
+static int mqtt_tls_poll_read(esp_transport_handle_t transport, int timeout_ms){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+
+    // Records already decrypted by mbedTLS do not show up on the socket
+    if(context->tls != NULL && esp_tls_get_bytes_avail(context->tls) > 0){
+        return 1;
+    }
+    return mqtt_tls_poll(transport, timeout_ms, false);
+}
+
+static int mqtt_tls_poll_write(esp_transport_handle_t transport, int timeout_ms){
+    return mqtt_tls_poll(transport, timeout_ms, true);
+}
+
+static int mqtt_tls_connect(esp_transport_handle_t transport, const char *host, int port, int timeout_ms){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+    esp_tls_cfg_t config = {
+        .timeout_ms = timeout_ms,
+    };
+    size_t free_before;
+    size_t free_after;
+    size_t low;
+    int ret;
+    int64_t started;
+    uint32_t duration_ms;
+    bool resuming = false;
+
+    if(context->ca_cert != NULL){
+        config.cacert_buf = (const unsigned char *)context->ca_cert;
+        config.cacert_bytes = context->ca_cert_len + 1;
+    } else {
+        config.crt_bundle_attach = esp_crt_bundle_attach;
+    }
+#if CONFIG_HOMEPOST_MQTT_TLS_SESSION_RESUMPTION
+    config.client_session = mqtt_tls_session_lookup(host, port);
+    resuming = config.client_session != NULL;
+#endif
+
+    context->tls = esp_tls_init();
+    if(context->tls == NULL){
+        return -1;
+    }
+
+    // Watch the low-water mark of this handshake alone, the one since boot rarely moves again
+    free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_start();
+    started = esp_timer_get_time();
+
+    ret = esp_tls_conn_new_sync(host, strlen(host), port, &config, context->tls);
+
+    duration_ms = (esp_timer_get_time() - started) / 1000;
+    low = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+    free_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+    if(ret <= 0){
+        ESP_LOGE(TAG, "TLS handshake with %s:%d failed", host, port);
+        esp_tls_conn_destroy(context->tls);
+        context->tls = NULL;
+        tls_stats.failures++;
+#if CONFIG_HOMEPOST_MQTT_TLS_SESSION_RESUMPTION
+        // Do not offer a session the broker may have rejected again
+        mqtt_tls_session_forget();
+#endif
+        return -1;
+    }
+
+    // Other tasks may free memory meanwhile, so neither figure can go below zero
+    mqtt_tls_record_handshake(resuming ? &tls_stats.resumed : &tls_stats.full, duration_ms,
+                              free_before > low ? free_before - low : 0,
+                              free_before > free_after ? free_before - free_after : 0);
+    ESP_LOGI(TAG, "TLS handshake (%s) took %" PRIu32 " ms", resuming ? "resumed" : "full", duration_ms);
+
+#if CONFIG_HOMEPOST_MQTT_TLS_SESSION_RESUMPTION
+    mqtt_tls_session_store(context->tls, host, port);
+#endif
+
+    return 0;
+}
+
+static int mqtt_tls_read(esp_transport_handle_t transport, char *buffer, int len, int timeout_ms){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+    int ret;
+
+    if(context->tls == NULL){
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    if(esp_tls_get_bytes_avail(context->tls) <= 0){
+        ret = mqtt_tls_poll(transport, timeout_ms, false);
+        if(ret <= 0){
+            return ret == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+        }
+    }
+
+    ret = esp_tls_conn_read(context->tls, buffer, len);
+    if(ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE){
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if(ret == 0){
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ret;
+}
+
+static int mqtt_tls_write(esp_transport_handle_t transport, const char *buffer, int len, int timeout_ms){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+    int ret;
+
+    if(context->tls == NULL){
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    ret = mqtt_tls_poll(transport, timeout_ms, true);
+    if(ret <= 0){
+        return ret == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    ret = esp_tls_conn_write(context->tls, buffer, len);
+    if(ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE){
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ret;
+}
+
+static int mqtt_tls_close(esp_transport_handle_t transport){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+
+    if(context->tls != NULL){
+        esp_tls_conn_destroy(context->tls);
+        context->tls = NULL;
+    }
+    return 0;
+}
+
+static int mqtt_tls_destroy(esp_transport_handle_t transport){
+    struct mqtt_tls_transport_t *context = esp_transport_get_context_data(transport);
+
+    mqtt_tls_close(transport);
+    free(context->ca_cert);
+    free(context);
+    return 0;
+}
+
+esp_transport_handle_t mqtt_tls_transport_create(void){
+    struct mqtt_tls_transport_t *context;
+    esp_transport_handle_t transport;
+
+    context = calloc(1, sizeof(*context));
+    if(context == NULL){
+        return NULL;
+    }
+
+    transport = esp_transport_init();
+    if(transport == NULL){
+        free(context);
+        return NULL;
+    }
+
+    // Read once per client, a certificate saved through /mqtt-ca applies after the client is rebuilt
+    if(internal_storage_get_mqtt_ca_cert(&context->ca_cert, &context->ca_cert_len) != ESP_OK){
+        ESP_LOGI(TAG, "No MQTT CA certificate stored, using the certificate bundle");
+        context->ca_cert = NULL;
+        context->ca_cert_len = 0;
+    }
+    tls_stats.ca_from_storage = context->ca_cert != NULL;
+
+    esp_transport_set_context_data(transport, context);
+    esp_transport_set_default_port(transport, MQTT_TLS_DEFAULT_PORT);
+    esp_transport_set_func(transport, mqtt_tls_connect, mqtt_tls_read, mqtt_tls_write, mqtt_tls_close,
+                           mqtt_tls_poll_read, mqtt_tls_poll_write, mqtt_tls_destroy);
+
+    return transport;
+}
+
+void mqtt_tls_get_stats(struct mqtt_tls_stats_t *stats){
+    *stats = tls_stats;
+}
@@ -0,0 +1,474 @@
+#include "sensor_log.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <math.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define SENSOR_LOG_SEGMENT_SIZE                 4096
+#define SENSOR_LOG_SEGMENT_MAGIC                0x474F4C53
+#define SENSOR_LOG_RECORD_ERASED                0xFF
+#define SENSOR_LOG_RECORD_WRITTEN               0xFE
+#define SENSOR_LOG_MAX_VALUE_MILLI              1000000000.0f
+#define SENSOR_LOG_CLOCK_VALID_AFTER            1704067200
+#define SENSOR_LOG_TASK_NAME                    "sensor_log"
+#define SENSOR_LOG_TASK_STACK_SIZE              3072
+#define SENSOR_LOG_TASK_PRIORITY                3
+
+/*
+ * The partition is split into flash sectors used as segments in round-robin
+ * order like the MQTT outbox. Each segment header carries the time its
+ * records count from, so a range query can skip whole segments by header.
+ */
+struct sensor_log_segment_header_t {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t erase_count;
+    uint32_t base_time;
+};
+
+/*
+ * time_delta is in seconds since the previous record of the segment, or
+ * since the base time for the first one. value_delta is in thousandths of
+ * the unit since the previous record of the same channel in the segment,
+ * the first one of a channel counts from zero. The state byte is programmed
+ * last, a record cut short by a reset stays ERASED and is skipped.
+ */
+struct sensor_log_record_t {
+    uint16_t time_delta;
+    uint8_t channel;
+    uint8_t state;
+    int32_t value_delta;
+};
+
+struct sensor_log_segment_t {
+    uint32_t sequence;
+    uint32_t erase_count;
+    uint32_t base_time;
+    uint16_t end;
+};
+
+struct sensor_log_entry_t {
+    uint32_t timestamp;
+    enum sensor_log_channel_t channel;
+    int32_t value_milli;
+};
+
+static const char *TAG = __FILE__;
+
+static const char *sensor_log_channel_names[SENSOR_LOG_CHANNEL_MAX] = {
+    [SENSOR_LOG_CHANNEL_TEMPERATURE] = "temperature",
+    [SENSOR_LOG_CHANNEL_HUMIDITY] = "humidity",
+    [SENSOR_LOG_CHANNEL_CPM] = "cpm",
+};
+
+static const esp_partition_t *log_partition = NULL;
+static struct sensor_log_segment_t *log_segments = NULL;
+static uint32_t log_segment_count = 0;
+static uint32_t log_write_segment = 0;
+static uint32_t log_next_sequence = 1;
+static QueueHandle_t log_queue = NULL;
+// Taken around every flash access and segment table change, readers and the writer share the partition
+static SemaphoreHandle_t log_mutex = NULL;
+static struct sensor_log_stats_t log_stats;
+static uint64_t log_write_total_us = 0;
+
+// Decoded state at the end of the write segment, owned by the writer task
+static uint32_t log_last_time = 0;
+static int32_t log_last_values[SENSOR_LOG_CHANNEL_MAX];
+
+static inline bool sensor_log_record_is_erased(const struct sensor_log_record_t *record){
+    return record->channel == SENSOR_LOG_RECORD_ERASED && record->time_delta == UINT16_MAX;
+}
+
+static void sensor_log_read_header(uint32_t index){
+    struct sensor_log_segment_t *segment = &log_segments[index];
+    struct sensor_log_segment_header_t header;
+
+    memset(segment, 0, sizeof(*segment));
+
+    if(esp_partition_read(log_partition, index * SENSOR_LOG_SEGMENT_SIZE, &header, sizeof(header)) != ESP_OK ||
+       header.magic != SENSOR_LOG_SEGMENT_MAGIC){
+        return;
+    }
+
+    segment->sequence = header.sequence;
+    segment->erase_count = header.erase_count;
+    segment->base_time = header.base_time;
+    // Closed segments are read up to the first erased record
+    segment->end = SENSOR_LOG_SEGMENT_SIZE;
+}
+
+/*
+ * Decodes the segment the writer continues in, so the next record can be
+ * stored as a delta to what is already in flash.
+ */
+static void sensor_log_resume_segment(uint32_t index){
+    struct sensor_log_segment_t *segment = &log_segments[index];
+    struct sensor_log_record_t record;
+    uint32_t offset = sizeof(struct sensor_log_segment_header_t);
+
+    log_last_time = segment->base_time;
+    memset(log_last_values, 0, sizeof(log_last_values));
+
+    while(offset + sizeof(record) <= SENSOR_LOG_SEGMENT_SIZE){
+        if(esp_partition_read(log_partition, index * SENSOR_LOG_SEGMENT_SIZE + offset, &record, sizeof(record)) != ESP_OK){
+            offset = SENSOR_LOG_SEGMENT_SIZE;
+            break;
+        }
+        if(sensor_log_record_is_erased(&record)){
+            break;
+        }
+        if(record.state == SENSOR_LOG_RECORD_WRITTEN && record.channel < SENSOR_LOG_CHANNEL_MAX){
+            log_last_time += record.time_delta;
+            log_last_values[record.channel] += record.value_delta;
+        }
+        offset += sizeof(record);
+    }
+
+    segment->end = offset;
+}
+
+static esp_err_t sensor_log_open_segment(uint32_t timestamp){
+    uint32_t index = (log_write_segment + 1) % log_segment_count;
+    struct sensor_log_segment_t *segment = &log_segments[index];
+    struct sensor_log_segment_header_t header;
+    int64_t started = esp_timer_get_time();
+    uint32_t duration_us;
+    esp_err_t ret;
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    ret = esp_partition_erase_range(log_partition, index * SENSOR_LOG_SEGMENT_SIZE, SENSOR_LOG_SEGMENT_SIZE);
+    if(ret == ESP_OK){
+        segment->erase_count++;
+        header.magic = SENSOR_LOG_SEGMENT_MAGIC;
+        header.sequence = log_next_sequence;
+        header.erase_count = segment->erase_count;
+        header.base_time = timestamp;
+        ret = esp_partition_write(log_partition, index * SENSOR_LOG_SEGMENT_SIZE, &header, sizeof(header));
+    }
+
+    if(ret == ESP_OK){
+        segment->sequence = log_next_sequence++;
+        segment->base_time = timestamp;
+        segment->end = sizeof(header);
+    } else {
+        segment->sequence = 0;
+    }
+    log_write_segment = index;
+
+    xSemaphoreGive(log_mutex);
+
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to open sensor log segment %lu: %s", index, esp_err_to_name(ret));
+        return ret;
+    }
+
+    log_last_time = timestamp;
+    memset(log_last_values, 0, sizeof(log_last_values));
+
+    duration_us = esp_timer_get_time() - started;
+    log_stats.erases++;
+    if(segment->erase_count > log_stats.max_segment_erases){
+        log_stats.max_segment_erases = segment->erase_count;
+    }
+    if(duration_us > log_stats.erase_max_us){
+        log_stats.erase_max_us = duration_us;
+    }
+
+    return ESP_OK;
+}
+
+static void sensor_log_write(const struct sensor_log_entry_t *entry){
+    struct sensor_log_segment_t *segment = &log_segments[log_write_segment];
+    struct sensor_log_record_t record;
+    uint8_t state = SENSOR_LOG_RECORD_WRITTEN;
+    // The log never goes back in time, a clock stepped back by SNTP repeats the last timestamp
+    uint32_t timestamp = entry->timestamp > log_last_time ? entry->timestamp : log_last_time;
+    uint32_t address;
+    int64_t started;
+    uint32_t duration_us;
+    esp_err_t ret;
+
+    if(segment->sequence == 0 || segment->end + sizeof(record) > SENSOR_LOG_SEGMENT_SIZE || timestamp - log_last_time > UINT16_MAX){
+        if(sensor_log_open_segment(timestamp) != ESP_OK){
+            return;
+        }
+        segment = &log_segments[log_write_segment];
+    }
+
+    record.time_delta = timestamp - log_last_time;
+    record.channel = entry->channel;
+    record.state = SENSOR_LOG_RECORD_ERASED;
+    record.value_delta = entry->value_milli - log_last_values[entry->channel];
+
+    started = esp_timer_get_time();
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    address = log_write_segment * SENSOR_LOG_SEGMENT_SIZE + segment->end;
+    ret = esp_partition_write(log_partition, address, &record, sizeof(record));
+    if(ret == ESP_OK){
+        ret = esp_partition_write(log_partition, address + offsetof(struct sensor_log_record_t, state), &state, sizeof(state));
+    }
+    segment->end += sizeof(record);
+
+    xSemaphoreGive(log_mutex);
+
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to write sensor log record: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    log_last_time = timestamp;
+    log_last_values[entry->channel] = entry->value_milli;
+
+    duration_us = esp_timer_get_time() - started;
+    log_stats.written++;
+    log_write_total_us += duration_us;
+    log_stats.write_avg_us = log_write_total_us / log_stats.written;
+    if(duration_us > log_stats.write_max_us){
+        log_stats.write_max_us = duration_us;
+    }
+}
+
+static void sensor_log_task(void *arg){
+    struct sensor_log_entry_t entry;
+
+    while(true){
+        if(xQueueReceive(log_queue, &entry, portMAX_DELAY) == pdTRUE){
+            sensor_log_write(&entry);
+        }
+    }
+}
+
+esp_err_t sensor_log_init(void){
+    uint32_t newest_sequence = 0;
+
+    if(log_partition != NULL){
+        return ESP_OK;
+    }
+
+    log_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_HOMEPOST_SENSOR_LOG_PARTITION_LABEL);
+    if(log_partition == NULL){
+        ESP_LOGW(TAG, "Partition '%s' not found, sensor log disabled", CONFIG_HOMEPOST_SENSOR_LOG_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if(log_partition->size < 2 * SENSOR_LOG_SEGMENT_SIZE){
+        ESP_LOGE(TAG, "Sensor log partition size %lu not supported", log_partition->size);
+        log_partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    log_segment_count = log_partition->size / SENSOR_LOG_SEGMENT_SIZE;
+    log_segments = calloc(log_segment_count, sizeof(struct sensor_log_segment_t));
+    log_mutex = xSemaphoreCreateMutex();
+    log_queue = xQueueCreate(CONFIG_HOMEPOST_SENSOR_LOG_QUEUE_LEN, sizeof(struct sensor_log_entry_t));
+    if(log_segments == NULL || log_mutex == NULL || log_queue == NULL){
+        log_partition = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // The writer continues in the newest segment, which starts out as the one before segment 0
+    log_write_segment = log_segment_count - 1;
+    for(uint32_t i = 0; i < log_segment_count; i++){
+        sensor_log_read_header(i);
+        if(log_segments[i].erase_count > log_stats.max_segment_erases){
+            log_stats.max_segment_erases = log_segments[i].erase_count;
+        }
+        if(log_segments[i].sequence > newest_sequence){
+            newest_sequence = log_segments[i].sequence;
+            log_write_segment = i;
+        }
+    }
+    log_next_sequence = newest_sequence + 1;
+    if(newest_sequence != 0){
+        sensor_log_resume_segment(log_write_segment);
+    }
+
+    if(xTaskCreate(sensor_log_task, SENSOR_LOG_TASK_NAME, SENSOR_LOG_TASK_STACK_SIZE, NULL, SENSOR_LOG_TASK_PRIORITY, NULL) != pdPASS){
+        log_partition = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    log_stats.available = true;
+    log_stats.segments = log_segment_count;
+
+    ESP_LOGI(TAG, "Sensor log mounted: %lu segments, newest reading at %lu", log_segment_count, log_last_time);
+
+    return ESP_OK;
+}
+
+esp_err_t sensor_log_append(enum sensor_log_channel_t channel, float value){
+    struct sensor_log_entry_t entry;
+    struct timeval now;
+    int64_t started = esp_timer_get_time();
+    uint32_t duration_us;
+
+    if(!log_stats.available || channel >= SENSOR_LOG_CHANNEL_MAX){
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    gettimeofday(&now, NULL);
+    if(now.tv_sec < SENSOR_LOG_CLOCK_VALID_AFTER){
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(isnan(value)){
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Clamped so the difference of two values still fits the record
+    value *= 1000.0f;
+    value = value > SENSOR_LOG_MAX_VALUE_MILLI ? SENSOR_LOG_MAX_VALUE_MILLI : value;
+    value = value < -SENSOR_LOG_MAX_VALUE_MILLI ? -SENSOR_LOG_MAX_VALUE_MILLI : value;
+
+    entry.timestamp = now.tv_sec;
+    entry.channel = channel;
+    entry.value_milli = lroundf(value);
+
+    if(xQueueSend(log_queue, &entry, 0) != pdTRUE){
+        log_stats.dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+    log_stats.appended++;
+
+    duration_us = esp_timer_get_time() - started;
+    if(duration_us > log_stats.append_max_us){
+        log_stats.append_max_us = duration_us;
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Must be called with log_mutex taken.
+ */
+static void sensor_log_iterator_enter(struct sensor_log_iterator_t *iterator, uint32_t index){
+    iterator->segment = index;
+    iterator->sequence = log_segments[index].sequence;
+    iterator->offset = sizeof(struct sensor_log_segment_header_t);
+    iterator->timestamp = log_segments[index].base_time;
+    memset(iterator->values, 0, sizeof(iterator->values));
+}
+
+esp_err_t sensor_log_iterator_init(struct sensor_log_iterator_t *iterator, uint32_t from, uint32_t to){
+    uint32_t start;
+    uint32_t next;
+
+    memset(iterator, 0, sizeof(*iterator));
+    iterator->from = from;
+    iterator->to = to;
+
+    if(!log_stats.available){
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+    // The oldest segment in use follows the write segment
+    start = log_write_segment;
+    for(uint32_t i = 1; i <= log_segment_count; i++){
+        uint32_t index = (log_write_segment + i) % log_segment_count;
+        if(log_segments[index].sequence != 0){
+            start = index;
+            break;
+        }
+    }
+    iterator->segments_left = (log_write_segment + log_segment_count - start) % log_segment_count + 1;
+
+    // A segment ends where the next one starts, skip those that end before the range
+    while(iterator->segments_left > 1){
+        next = (start + 1) % log_segment_count;
+        if(log_segments[next].sequence == 0 || log_segments[next].base_time >= from){
+            break;
+        }
+        start = next;
+        iterator->segments_left--;
+    }
+    sensor_log_iterator_enter(iterator, start);
+
+    xSemaphoreGive(log_mutex);
+
+    return ESP_OK;
+}
+
+bool sensor_log_iterator_next(struct sensor_log_iterator_t *iterator, struct sensor_log_sample_t *sample){
+    struct sensor_log_segment_t *segment;
+    struct sensor_log_record_t record;
+    bool valid;
+
+    while(iterator->segments_left > 0){
+        xSemaphoreTake(log_mutex, portMAX_DELAY);
+
+        segment = &log_segments[iterator->segment];
+        valid = segment->sequence != 0 && segment->sequence == iterator->sequence &&
+                iterator->offset + sizeof(record) <= segment->end &&
+                esp_partition_read(log_partition, iterator->segment * SENSOR_LOG_SEGMENT_SIZE + iterator->offset, &record, sizeof(record)) == ESP_OK &&
+                !sensor_log_record_is_erased(&record);
+
+        if(!valid){
+            // End of this segment, or it was overwritten while the query ran
+            if(--iterator->segments_left > 0){
+                sensor_log_iterator_enter(iterator, (iterator->segment + 1) % log_segment_count);
+            }
+            xSemaphoreGive(log_mutex);
+            continue;
+        }
+
+        xSemaphoreGive(log_mutex);
+
+        iterator->offset += sizeof(record);
+        if(record.state != SENSOR_LOG_RECORD_WRITTEN || record.channel >= SENSOR_LOG_CHANNEL_MAX){
+            continue;
+        }
+
+        iterator->timestamp += record.time_delta;
+        iterator->values[record.channel] += record.value_delta;
+
+        if(iterator->timestamp > iterator->to){
+            iterator->segments_left = 0;
+            break;
+        }
+        if(iterator->timestamp < iterator->from){
+            continue;
+        }
+
+        sample->timestamp = iterator->timestamp;
+        sample->channel = record.channel;
+        sample->value_milli = iterator->values[record.channel];
+        return true;
+    }
+
+    return false;
+}
+
+const char *sensor_log_get_channel_name(enum sensor_log_channel_t channel){
+    return channel < SENSOR_LOG_CHANNEL_MAX ? sensor_log_channel_names[channel] : "unknown";
+}
+
+void sensor_log_get_stats(struct sensor_log_stats_t *stats){
+    *stats = log_stats;
+
+    if(!log_stats.available){
+        return;
+    }
+
+    xSemaphoreTake(log_mutex, portMAX_DELAY);
+    for(uint32_t i = 1; i <= log_segment_count; i++){
+        uint32_t index = (log_write_segment + i) % log_segment_count;
+        if(log_segments[index].sequence != 0){
+            stats->oldest = log_segments[index].base_time;
+            break;
+        }
+    }
+    xSemaphoreGive(log_mutex);
+    stats->newest = log_last_time;
+}
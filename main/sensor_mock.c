@@ -0,0 +1,50 @@
+#include "sensor_mock.h"
+
+#if CONFIG_HOMEPOST_SENSOR_MOCK
+#define SENSOR_MOCK_WAVE_PERIOD                 200
+
+enum sensor_mock_metric_t {
+    SENSOR_MOCK_METRIC_VALUE = 0,
+    SENSOR_MOCK_METRIC_SEQUENCE,
+    SENSOR_MOCK_METRIC_COUNT,
+};
+
+static const struct sensor_metric_t sensor_mock_metrics[SENSOR_MOCK_METRIC_COUNT] = {
+    [SENSOR_MOCK_METRIC_VALUE]    = { "value",    "",  1, MQTT_CONNECTION_TOPIC_MOCK,  SENSOR_METRIC_NOT_LOGGED },
+    [SENSOR_MOCK_METRIC_SEQUENCE] = { "sequence", "",  0, SENSOR_METRIC_NOT_PUBLISHED, SENSOR_METRIC_NOT_LOGGED },
+};
+
+static uint32_t sensor_mock_sequence = 0;
+static bool sensor_mock_converting = false;
+
+static esp_err_t sensor_mock_sample(float *values, uint32_t *wait_us){
+    uint32_t phase;
+
+    // First call starts the "conversion", the second one reads it
+    if(!sensor_mock_converting && CONFIG_HOMEPOST_SENSOR_MOCK_WAIT_MS > 0){
+        sensor_mock_converting = true;
+        *wait_us = CONFIG_HOMEPOST_SENSOR_MOCK_WAIT_MS * 1000;
+        return ESP_ERR_NOT_FINISHED;
+    }
+    sensor_mock_converting = false;
+
+    sensor_mock_sequence++;
+    if(CONFIG_HOMEPOST_SENSOR_MOCK_FAIL_EVERY > 0 && sensor_mock_sequence % CONFIG_HOMEPOST_SENSOR_MOCK_FAIL_EVERY == 0){
+        return ESP_FAIL;
+    }
+
+    phase = sensor_mock_sequence % SENSOR_MOCK_WAVE_PERIOD;
+    values[SENSOR_MOCK_METRIC_VALUE] = phase < SENSOR_MOCK_WAVE_PERIOD / 2 ? phase : SENSOR_MOCK_WAVE_PERIOD - phase;
+    values[SENSOR_MOCK_METRIC_SEQUENCE] = sensor_mock_sequence;
+
+    return ESP_OK;
+}
+
+const struct sensor_driver_t sensor_mock_driver = {
+    .name = "mock",
+    .metrics = sensor_mock_metrics,
+    .metric_count = SENSOR_MOCK_METRIC_COUNT,
+    .period_ms = CONFIG_HOMEPOST_SENSOR_MOCK_PERIOD_MS,
+    .sample = sensor_mock_sample,
+};
+#endif
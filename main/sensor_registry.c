@@ -0,0 +1,271 @@
+#include "sensor_registry.h"
+#include <math.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define SENSOR_REGISTRY_TASK_NAME               "sensors"
+#define SENSOR_REGISTRY_TASK_STACK_SIZE         4096
+#define SENSOR_REGISTRY_TASK_PRIORITY           4
+
+/*
+ * resume_us is when a sample that returned ESP_ERR_NOT_FINISHED continues,
+ * 0 while the sensor waits for its next period at due_us. Values collect
+ * across the calls of one sample.
+ */
+struct sensor_registry_entry_t {
+    const struct sensor_driver_t *driver;
+    int64_t due_us;
+    int64_t resume_us;
+    int64_t started_us;
+    uint64_t lateness_total_us;
+    volatile bool period_changed;
+    float values[SENSOR_REGISTRY_MAX_METRICS];
+    struct sensor_registry_stats_t stats;
+};
+
+static const char *TAG = __FILE__;
+
+static struct sensor_registry_entry_t registry_entries[SENSOR_REGISTRY_MAX_SENSORS];
+static uint32_t registry_count = 0;
+static bool registry_started = false;
+static TaskHandle_t registry_task = NULL;
+static esp_timer_handle_t registry_timer = NULL;
+
+static void sensor_registry_timer_cb(void *arg){
+    xTaskNotifyGive(registry_task);
+}
+
+static const esp_timer_create_args_t registry_timer_args = {
+    .callback = &sensor_registry_timer_cb,
+};
+
+static void sensor_registry_publish(struct sensor_registry_entry_t *entry){
+    const struct sensor_driver_t *driver = entry->driver;
+
+    for(size_t i = 0; i < driver->metric_count; i++){
+        const struct sensor_metric_t *metric = &driver->metrics[i];
+        float value = entry->values[i];
+
+        if(isnan(value)){
+            ESP_LOGW(TAG, "No %s value in this %s sample", metric->name, driver->name);
+            continue;
+        }
+
+        ESP_LOGI(TAG, "%s %s: %.*f %s", driver->name, metric->name, metric->precision, value, metric->unit);
+
+        // Dropped readings are counted by the log
+        if(metric->channel != SENSOR_METRIC_NOT_LOGGED){
+            sensor_log_append(metric->channel, value);
+        }
+
+        if(metric->topic != SENSOR_METRIC_NOT_PUBLISHED &&
+           mqtt_connection_publish_metric(metric->topic, metric->name, value, metric->precision) != ESP_OK){
+            ESP_LOGE(TAG, "Failed to enqueue %s message", metric->name);
+        }
+    }
+}
+
+// Periods that went by while the sensor was busy or held up are skipped, not caught up
+static void sensor_registry_skip_missed(struct sensor_registry_entry_t *entry, int64_t now){
+    while(entry->due_us <= now){
+        entry->due_us += (int64_t)entry->stats.period_ms * 1000;
+        entry->stats.skipped++;
+    }
+}
+
+static void sensor_registry_begin(struct sensor_registry_entry_t *entry, int64_t now){
+    uint32_t lateness_us = now - entry->due_us;
+
+    entry->stats.lateness_max_us = lateness_us > entry->stats.lateness_max_us ? lateness_us : entry->stats.lateness_max_us;
+    entry->lateness_total_us += lateness_us;
+    entry->stats.lateness_avg_us = entry->lateness_total_us / (entry->stats.samples + entry->stats.failures + 1);
+
+    entry->started_us = now;
+    entry->due_us += (int64_t)entry->stats.period_ms * 1000;
+    sensor_registry_skip_missed(entry, now);
+
+    for(size_t i = 0; i < SENSOR_REGISTRY_MAX_METRICS; i++){
+        entry->values[i] = NAN;
+    }
+}
+
+static void sensor_registry_step(struct sensor_registry_entry_t *entry, int64_t now){
+    uint32_t wait_us = 0;
+    uint32_t busy_us;
+    uint32_t sample_us;
+    int64_t finished;
+    esp_err_t ret;
+
+    if(entry->resume_us == 0){
+        sensor_registry_begin(entry, now);
+    }
+
+    ret = entry->driver->sample(entry->values, &wait_us);
+
+    finished = esp_timer_get_time();
+    busy_us = finished - now;
+    if(busy_us > entry->stats.busy_max_us){
+        entry->stats.busy_max_us = busy_us;
+    }
+
+    if(ret == ESP_ERR_NOT_FINISHED){
+        entry->resume_us = finished + wait_us;
+        return;
+    }
+
+    entry->resume_us = 0;
+    sample_us = finished - entry->started_us;
+    if(sample_us > entry->stats.sample_max_us){
+        entry->stats.sample_max_us = sample_us;
+    }
+    sensor_registry_skip_missed(entry, finished);
+
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to sample %s: %s", entry->driver->name, esp_err_to_name(ret));
+        entry->stats.failures++;
+        return;
+    }
+
+    entry->stats.samples++;
+    sensor_registry_publish(entry);
+}
+
+/*
+ * Runs whatever is due, then sleeps on the one-shot timer until the next
+ * period or continuation of any sensor.
+ */
+static void sensor_registry_task(void *arg){
+    struct sensor_registry_entry_t *entry;
+    int64_t now;
+    int64_t next;
+    int64_t at;
+
+    while(true){
+        now = esp_timer_get_time();
+        next = INT64_MAX;
+
+        for(uint32_t i = 0; i < registry_count; i++){
+            entry = &registry_entries[i];
+            if(!entry->stats.active){
+                continue;
+            }
+
+            if(entry->period_changed){
+                entry->period_changed = false;
+                entry->due_us = now + (int64_t)entry->stats.period_ms * 1000;
+            }
+
+            at = entry->resume_us != 0 ? entry->resume_us : entry->due_us;
+            if(at <= now){
+                sensor_registry_step(entry, now);
+                now = esp_timer_get_time();
+                at = entry->resume_us != 0 ? entry->resume_us : entry->due_us;
+            }
+            next = at < next ? at : next;
+        }
+
+        if(next <= now){
+            continue;
+        }
+
+        esp_timer_stop(registry_timer);
+        if(next != INT64_MAX && esp_timer_start_once(registry_timer, next - now) != ESP_OK){
+            ESP_LOGE(TAG, "Failed to schedule the next sample");
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+esp_err_t sensor_registry_register(const struct sensor_driver_t *driver){
+    struct sensor_registry_entry_t *entry;
+
+    if(registry_started){
+        return ESP_ERR_INVALID_STATE;
+    }
+    if(driver->sample == NULL || driver->metric_count > SENSOR_REGISTRY_MAX_METRICS || driver->period_ms == 0){
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(registry_count >= SENSOR_REGISTRY_MAX_SENSORS){
+        ESP_LOGE(TAG, "No room to register %s", driver->name);
+        return ESP_ERR_NO_MEM;
+    }
+
+    entry = &registry_entries[registry_count++];
+    entry->driver = driver;
+    entry->stats.name = driver->name;
+    entry->stats.period_ms = driver->period_ms;
+
+    return ESP_OK;
+}
+
+esp_err_t sensor_registry_start(void){
+    struct sensor_registry_entry_t *entry;
+    int64_t now;
+    esp_err_t ret;
+
+    if(registry_started){
+        return ESP_OK;
+    }
+
+    ret = esp_timer_create(&registry_timer_args, &registry_timer);
+    if(ret != ESP_OK){
+        ESP_LOGE(TAG, "Failed to create sensor timer: %s", esp_err_to_name(ret));
+        return ret;
+    }
+
+    for(uint32_t i = 0; i < registry_count; i++){
+        entry = &registry_entries[i];
+
+        ret = entry->driver->init != NULL ? entry->driver->init() : ESP_OK;
+        if(ret != ESP_OK){
+            ESP_LOGE(TAG, "Failed to initialize %s, not sampled: %s", entry->driver->name, esp_err_to_name(ret));
+            continue;
+        }
+
+        entry->stats.active = true;
+    }
+
+    now = esp_timer_get_time();
+    for(uint32_t i = 0; i < registry_count; i++){
+        registry_entries[i].due_us = now + (int64_t)registry_entries[i].stats.period_ms * 1000;
+    }
+
+    registry_started = true;
+    if(xTaskCreate(sensor_registry_task, SENSOR_REGISTRY_TASK_NAME, SENSOR_REGISTRY_TASK_STACK_SIZE, NULL,
+                   SENSOR_REGISTRY_TASK_PRIORITY, &registry_task) != pdPASS){
+        ESP_LOGE(TAG, "Failed to create sensor task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Sampling %lu sensors", registry_count);
+
+    return ESP_OK;
+}
+
+esp_err_t sensor_registry_set_period(const struct sensor_driver_t *driver, uint32_t period_ms){
+    for(uint32_t i = 0; i < registry_count; i++){
+        if(registry_entries[i].driver != driver){
+            continue;
+        }
+
+        registry_entries[i].stats.period_ms = period_ms;
+        if(registry_task != NULL){
+            registry_entries[i].period_changed = true;
+            xTaskNotifyGive(registry_task);
+        }
+        return ESP_OK;
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+bool sensor_registry_get_stats(uint32_t index, struct sensor_registry_stats_t *stats){
+    if(index >= registry_count){
+        return false;
+    }
+
+    *stats = registry_entries[index].stats;
+    return true;
+}
@@ -6,26 +6,14 @@
 #define TRACKER_SCANNER_TASK_STACK_SIZE         2048
 #define TRACKER_SCANNER_TASK_NAME               "scanner"
 #define TRACKER_SCANNER_EVENT_BIT               BIT0
-#define TRACKER_SCANNER_SCAN_TIMEOUT            pdMS_TO_TICKS(CONFIG_HOMEPOST_SCAN_TIMEOUT_MINUTES * 60 * 1000)
 
 static const char *TAG = __FILE__;
 static EventGroupHandle_t tracker_scanner_event_group;
 TaskHandle_t scanner_task_handle = NULL;
 static int last_rssi = 0;
-static char presence_payload[32] = {0};
-static char presence_topic[100] = {0};
-static char rssi_payload[32] = {0};
-static char rssi_topic[100] = {0};
-static struct mqtt_connection_message_t presence_message = {
-    .topic = presence_topic,
-    .payload = presence_payload,
-    .qos = 0
-};
-static struct mqtt_connection_message_t rssi_message = {
-    .topic = rssi_topic,
-    .payload = rssi_payload,
-    .qos = 0
-};
+static uint32_t scan_timeout_minutes = CONFIG_HOMEPOST_SCAN_TIMEOUT_MINUTES;
+static uint16_t scan_major_filter = CONFIG_HOMEPOST_SCAN_MAJOR_FILTER;
+static uint16_t scan_minor_filter = CONFIG_HOMEPOST_SCAN_MINOR_FILTER;
 
 static void tracker_scanner_cb(esp_ble_gap_cb_param_t *param){
     if(esp_ble_is_ibeacon_packet(param->scan_rst.ble_adv, param->scan_rst.adv_data_len)){
@@ -33,7 +21,7 @@ static void tracker_scanner_cb(esp_ble_gap_cb_param_t *param){
 
         uint16_t major = ENDIAN_CHANGE_U16(ibeacon_data->ibeacon_vendor.major);
         uint16_t minor = ENDIAN_CHANGE_U16(ibeacon_data->ibeacon_vendor.minor);
-        if (major == CONFIG_HOMEPOST_SCAN_MAJOR_FILTER && minor == CONFIG_HOMEPOST_SCAN_MINOR_FILTER){
+        if (major == scan_major_filter && minor == scan_minor_filter){
             if(tracker_scanner_event_group != NULL){ 
 #ifdef CONFIG_HOMEPOST_SCAN_USE_RSSI_FILTER
                 if (param->scan_rst.rssi > CONFIG_HOMEPOST_SCAN_RSSI_THRESHOLD){
@@ -79,9 +67,8 @@ static void tracker_scanner_task(void *arg){
 
     while(true){
         bool tracker_present = false;
-        int ret = 0;
 
-        EventBits_t bits = xEventGroupWaitBits(tracker_scanner_event_group, TRACKER_SCANNER_EVENT_BIT, pdTRUE, pdFALSE, TRACKER_SCANNER_SCAN_TIMEOUT);
+        EventBits_t bits = xEventGroupWaitBits(tracker_scanner_event_group, TRACKER_SCANNER_EVENT_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(scan_timeout_minutes * 60 * 1000));
         if (bits & TRACKER_SCANNER_EVENT_BIT){
             ESP_LOGI(TAG, "Tracker found");
             tracker_present = true;
@@ -90,27 +77,14 @@ static void tracker_scanner_task(void *arg){
             ESP_LOGI(TAG, "Tracker lost");
         }
 
-        memset(presence_payload, 0, sizeof(presence_payload));
-        ret = snprintf(presence_payload, sizeof(presence_payload), "{\"state\": \"%s\"}", tracker_present ? "ON" : "OFF");
-        if (ret < 0 || ret >= sizeof(presence_payload)) {
-            ESP_LOGE(TAG, "Failed to create presence payload");
-            return;
-        }
-
-        if(mqtt_connection_put_publish_queue(&presence_message) != ESP_OK) {
+        if(mqtt_connection_publish_state(MQTT_CONNECTION_TOPIC_PHONE_PRESENT, "state", tracker_present ? "ON" : "OFF") != ESP_OK) {
             ESP_LOGE(TAG, "Failed to enqueue presence message");
         }
 
         // Publish RSSI when tracker is present
         if (tracker_present) {
-            memset(rssi_payload, 0, sizeof(rssi_payload));
-            ret = snprintf(rssi_payload, sizeof(rssi_payload), "{\"rssi\": %d}", last_rssi);
-            if (ret < 0 || ret >= sizeof(rssi_payload)) {
-                ESP_LOGE(TAG, "Failed to create RSSI payload");
-            } else {
-                if(mqtt_connection_put_publish_queue(&rssi_message) != ESP_OK) {
-                    ESP_LOGE(TAG, "Failed to enqueue RSSI message");
-                }
+            if(mqtt_connection_publish_metric(MQTT_CONNECTION_TOPIC_PHONE_RSSI, "rssi", last_rssi, 0) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to enqueue RSSI message");
             }
         }
     }
@@ -122,22 +96,27 @@ void tracker_scanner_start_task(void){
         return;
     }
 
-    // Build presence topic from base topic
-    char base_topic[64];
-    if (mqtt_connection_get_base_topic(base_topic, sizeof(base_topic)) == ESP_OK) {
-        snprintf(presence_topic, sizeof(presence_topic), "%s/phone_present", base_topic);
-        snprintf(rssi_topic, sizeof(rssi_topic), "%s/phone_rssi", base_topic);
-    } else {
-        ESP_LOGE(TAG, "Failed to get base topic, using default");
-        snprintf(presence_topic, sizeof(presence_topic), "%s/phone_present", CONFIG_HOMEPOST_MQTT_TOPIC);
-        snprintf(rssi_topic, sizeof(rssi_topic), "%s/phone_rssi", CONFIG_HOMEPOST_MQTT_TOPIC);
-    }
-
     tracker_scanner_event_group = xEventGroupCreate();
     xTaskCreate(tracker_scanner_task, TRACKER_SCANNER_TASK_NAME, TRACKER_SCANNER_TASK_STACK_SIZE, NULL, TRACKER_SCANNER_TASK_PRIORITY, &scanner_task_handle);
     configASSERT(scanner_task_handle);
 }
 
+esp_err_t tracker_scanner_set_timeout(uint32_t minutes){
+    // Read by the scanner task when it starts waiting for the next beacon
+    scan_timeout_minutes = minutes;
+    return ESP_OK;
+}
+
+esp_err_t tracker_scanner_set_major(uint32_t major){
+    scan_major_filter = major;
+    return ESP_OK;
+}
+
+esp_err_t tracker_scanner_set_minor(uint32_t minor){
+    scan_minor_filter = minor;
+    return ESP_OK;
+}
+
 void tracker_scanner_stop_task(void){
     if (scanner_task_handle != NULL) {
         ble_scanner_stop();